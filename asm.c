@@ -0,0 +1,1087 @@
+////////////////////////////////////////////////////////////////
+// Assembler
+//
+// codegenが出力するIntel記法のアセンブリを機械語にして、
+// ELF64の再配置可能オブジェクトを書き出す(-c)。
+// 受け付けるのはcodegenが使う命令とディレクティブだけ。
+// 分岐はすべてrel32で符号化し、短縮はしない。
+
+#include <string.h>
+#include <ctype.h>
+#include <elf.h>
+#include "k9cc.h"
+
+typedef struct Reloc Reloc;
+typedef struct Symbol Symbol;
+
+typedef struct Section {
+  char *name;
+  int type;                     // SHT_*
+  int flags;                    // SHF_*
+  int align;
+  uint8_t *data;                // SHT_NOBITSのときは使わない
+  size_t size;
+  size_t capacity;
+  int index;                    // ELFでのセクション番号
+  int sym_index;                // セクションシンボルの番号
+} Section;
+
+struct Symbol {
+  char *name;
+  Section *sec;                 // 未定義ならNULL
+  long value;
+  long size;
+  int type;                     // STT_*
+  bool global;
+  int index;                    // シンボル表での番号
+};
+
+// 後で値を埋める場所
+typedef enum {
+  FIX_PC32,                     // rip相対、jmp/jcc
+  FIX_PLT32,                    // call
+  FIX_ABS64,                    // .quad
+} FixKind;
+
+struct Reloc {
+  Section *sec;
+  size_t offset;
+  Symbol *sym;
+  long addend;
+  FixKind kind;
+  int line;
+};
+
+// オペランド
+typedef enum {
+  OP_REG,
+  OP_IMM,
+  OP_MEM,
+  OP_SYM,                       // jmp/callの飛び先
+} OperandKind;
+
+typedef struct Operand {
+  OperandKind kind;
+  int reg;                      // OP_REG: 番号
+  int size;                     // OP_REG: バイト数
+  long imm;                     // OP_IMM
+  // OP_MEM: [base + index*scale + disp + sym]
+  int base;                     // -1はなし、16はrip
+  int index;
+  int scale;
+  long disp;
+  Symbol *sym;
+} Operand;
+
+#define REG_RIP 16
+
+typedef struct Asm {
+  Section **sections;
+  int nsections;
+  Section *cur;
+  HashMap symbols;
+  Symbol **symtab;
+  int nsymbols;
+  Reloc *relocs;
+  int nrelocs;
+  int reloc_capacity;
+  int line;
+  char *text;                   // エラー表示用の行
+} Asm;
+
+static Asm as;
+
+static void asm_error(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "asm:%d: ", as.line);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n    %s\n", as.text);
+  va_end(ap);
+  exit(1);
+}
+
+////////////////////////////////////////////////////////////////
+// セクションとシンボル
+
+static Section *get_section(const char *name) {
+  for (int i = 0; i < as.nsections; i++) {
+    if (!strcmp(as.sections[i]->name, name)) {
+      return as.sections[i];
+    }
+  }
+  Section *sec = calloc(1, sizeof(Section));
+  sec->name = format("%s", name);
+  sec->align = 1;
+  sec->type = SHT_PROGBITS;
+  if (startswith(name, ".text")) {
+    sec->flags = SHF_ALLOC | SHF_EXECINSTR;
+  }
+  else if (startswith(name, ".bss")) {
+    sec->type = SHT_NOBITS;
+    sec->flags = SHF_ALLOC | SHF_WRITE;
+  }
+  else if (startswith(name, ".rodata")) {
+    sec->flags = SHF_ALLOC;
+  }
+  else if (!strcmp(name, ".fini_array")) {
+    sec->type = SHT_FINI_ARRAY;
+    sec->flags = SHF_ALLOC | SHF_WRITE;
+  }
+  else if (!strcmp(name, ".init_array")) {
+    sec->type = SHT_INIT_ARRAY;
+    sec->flags = SHF_ALLOC | SHF_WRITE;
+  }
+  else {
+    sec->flags = SHF_ALLOC | SHF_WRITE;
+  }
+  as.sections = realloc(as.sections, sizeof(Section *) * (as.nsections + 1));
+  as.sections[as.nsections++] = sec;
+  return sec;
+}
+
+static Symbol *get_symbol(const char *name) {
+  Symbol *sym = hashmap_get(&as.symbols, name);
+  if (!sym) {
+    sym = calloc(1, sizeof(Symbol));
+    sym->name = format("%s", name);
+    hashmap_put(&as.symbols, sym->name, sym);
+    as.symtab = realloc(as.symtab, sizeof(Symbol *) * (as.nsymbols + 1));
+    as.symtab[as.nsymbols++] = sym;
+  }
+  return sym;
+}
+
+// .Lで始まるラベルはオブジェクトのシンボル表に載せない
+static bool is_local_label(Symbol *sym) {
+  return startswith(sym->name, ".L");
+}
+
+static void emit_bytes(const void *p, size_t n) {
+  Section *sec = as.cur;
+  if (sec->type == SHT_NOBITS) {
+    asm_error("data in a bss section");
+  }
+  if (sec->capacity < sec->size + n) {
+    sec->capacity = (sec->size + n) * 2;
+    sec->data = realloc(sec->data, sec->capacity);
+  }
+  memcpy(sec->data + sec->size, p, n);
+  sec->size += n;
+}
+
+static void emit_byte(int b) {
+  uint8_t c = b;
+  emit_bytes(&c, 1);
+}
+
+static void emit_le(uint64_t val, int n) {
+  for (int i = 0; i < n; i++) {
+    emit_byte(val >> (i * 8));
+  }
+}
+
+static void add_reloc(FixKind kind, Symbol *sym, long addend) {
+  if (as.nrelocs == as.reloc_capacity) {
+    as.reloc_capacity = as.reloc_capacity ? as.reloc_capacity * 2 : 256;
+    as.relocs = realloc(as.relocs, sizeof(Reloc) * as.reloc_capacity);
+  }
+  as.relocs[as.nrelocs++] = (Reloc){as.cur, as.cur->size, sym, addend, kind, as.line};
+}
+
+static void align_section(int align) {
+  if (as.cur->align < align) {
+    as.cur->align = align;
+  }
+  while (as.cur->size % align) {
+    if (as.cur->type == SHT_NOBITS) {
+      as.cur->size++;
+    }
+    else {
+      emit_byte(as.cur->flags & SHF_EXECINSTR ? 0x90 : 0);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////
+// オペランドの解釈
+
+static char *reg64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+static char *reg32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                        "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+static char *reg8[] = {"al", "cl", "dl", "bl", NULL, NULL, NULL, NULL,
+                       "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+
+// レジスタならその番号、でなければ-1
+static int parse_reg(const char *s, size_t len, int *size) {
+  static char **tables[] = {reg64, reg32, reg8};
+  static int sizes[] = {8, 4, 1};
+  for (int t = 0; t < 3; t++) {
+    for (int i = 0; i < 16; i++) {
+      char *name = tables[t][i];
+      if (name && strlen(name) == len && !strncmp(name, s, len)) {
+        *size = sizes[t];
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+static bool is_symchar(char c) {
+  return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+static char *skip_space(char *p) {
+  while (isspace(*p)) {
+    p++;
+  }
+  return p;
+}
+
+// [base + index*scale + disp + sym]
+static void parse_mem(char *p, Operand *op) {
+  op->kind = OP_MEM;
+  op->base = op->index = -1;
+  op->scale = 1;
+  int sign = 1;
+
+  p = skip_space(p + 1);
+  for (;;) {
+    if (*p == ']') {
+      break;
+    }
+    if (isdigit(*p)) {
+      char *end;
+      op->disp += sign * strtol(p, &end, 0);
+      p = end;
+    }
+    else if (is_symchar(*p)) {
+      char *q = p;
+      while (is_symchar(*q)) {
+        q++;
+      }
+      int size, reg = parse_reg(p, q - p, &size);
+      if (q - p == 3 && !strncmp(p, "rip", 3)) {
+        op->base = REG_RIP;
+      }
+      else if (reg < 0) {
+        char *name = strndup(p, q - p);
+        op->sym = get_symbol(name);
+        free(name);
+      }
+      else if (*skip_space(q) == '*') {
+        op->index = reg;
+        q = skip_space(skip_space(q) + 1);
+        op->scale = strtol(q, &q, 10);
+      }
+      else if (op->base < 0) {
+        op->base = reg;
+      }
+      else {
+        op->index = reg;
+      }
+      p = q;
+    }
+    else {
+      asm_error("invalid memory operand");
+    }
+
+    p = skip_space(p);
+    if (*p == '+') {
+      sign = 1;
+    }
+    else if (*p == '-') {
+      sign = -1;
+    }
+    else if (*p != ']') {
+      asm_error("invalid memory operand");
+    }
+    if (*p != ']') {
+      p = skip_space(p + 1);
+    }
+  }
+  if (op->sym && op->base != REG_RIP) {
+    asm_error("symbol operands must be rip-relative");
+  }
+}
+
+static void parse_operand(char *p, Operand *op) {
+  memset(op, 0, sizeof(Operand));
+  p = skip_space(p);
+  // "qword ptr"などの大きさの指定は読み飛ばす
+  char *bracket = strchr(p, '[');
+  if (bracket && strstr(p, "ptr") && strstr(p, "ptr") < bracket) {
+    p = bracket;
+  }
+
+  if (*p == '[') {
+    parse_mem(p, op);
+    return;
+  }
+  if (isdigit(*p) || *p == '-') {
+    op->kind = OP_IMM;
+    op->imm = strtol(p, NULL, 0);
+    return;
+  }
+  size_t len = strlen(p);
+  while (len && isspace(p[len - 1])) {
+    len--;
+  }
+  if ((op->reg = parse_reg(p, len, &op->size)) >= 0) {
+    op->kind = OP_REG;
+    return;
+  }
+  char *name = strndup(p, len);
+  op->kind = OP_SYM;
+  op->sym = get_symbol(name);
+  free(name);
+}
+
+// カンマで区切る。[]の中のカンマはない
+static int parse_operands(char *p, Operand *ops) {
+  int n = 0;
+  p = skip_space(p);
+  while (*p) {
+    if (n == 3) {
+      asm_error("too many operands");
+    }
+    char *comma = strchr(p, ',');
+    if (comma) {
+      *comma = '\0';
+    }
+    parse_operand(p, &ops[n++]);
+    if (!comma) {
+      break;
+    }
+    p = comma + 1;
+  }
+  return n;
+}
+
+////////////////////////////////////////////////////////////////
+// 命令の符号化
+
+static bool fits8(long v) {
+  return v == (int8_t)v;
+}
+
+static bool fits32(long v) {
+  return v == (int32_t)v;
+}
+
+// REXプレフィックス。rmがレジスタのときはそれがB、メモリならbaseとindex
+static void emit_rex(bool w, int reg, Operand *rm, bool byte_reg) {
+  int rex = 0x40 | (w ? 8 : 0);
+  if (8 <= reg) {
+    rex |= 4;
+  }
+  if (rm->kind == OP_REG && 8 <= rm->reg) {
+    rex |= 1;
+  }
+  if (rm->kind == OP_MEM) {
+    if (0 <= rm->index && 8 <= rm->index) {
+      rex |= 2;
+    }
+    if (0 <= rm->base && rm->base != REG_RIP && 8 <= rm->base) {
+      rex |= 1;
+    }
+  }
+  if (rex != 0x40 || byte_reg) {
+    emit_byte(rex);
+  }
+}
+
+// ModR/M(とSIB、変位)。immはこの後に続く即値のバイト数で、rip相対の補正に使う
+static void emit_modrm(int reg, Operand *rm, int imm) {
+  reg &= 7;
+  if (rm->kind == OP_REG) {
+    emit_byte(0xc0 | reg << 3 | (rm->reg & 7));
+    return;
+  }
+  if (rm->base == REG_RIP) {
+    emit_byte(reg << 3 | 5);
+    if (rm->sym) {
+      add_reloc(FIX_PC32, rm->sym, rm->disp - 4 - imm);
+      emit_le(0, 4);
+    }
+    else {
+      emit_le(rm->disp, 4);
+    }
+    return;
+  }
+  if (rm->base < 0) {
+    asm_error("memory operand without a base register");
+  }
+
+  int base = rm->base & 7;
+  int mod = (rm->disp == 0 && base != 5) ? 0 : fits8(rm->disp) ? 1 : 2;
+  if (!fits32(rm->disp)) {
+    asm_error("displacement out of range");
+  }
+  if (0 <= rm->index || base == 4) {
+    int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+    int index = 0 <= rm->index ? rm->index & 7 : 4;
+    if (rm->index == 4) {
+      asm_error("rsp cannot be an index register");
+    }
+    emit_byte(mod << 6 | reg << 3 | 4);
+    emit_byte(scale << 6 | index << 3 | base);
+  }
+  else {
+    emit_byte(mod << 6 | reg << 3 | base);
+  }
+  if (mod == 1) {
+    emit_byte(rm->disp);
+  }
+  else if (mod == 2) {
+    emit_le(rm->disp, 4);
+  }
+}
+
+// opcode reg, r/m の形
+static void emit_op(bool w, const uint8_t *opcode, int nopcode, int reg, Operand *rm, int imm) {
+  bool byte_reg = rm->kind == OP_REG && rm->size == 1 && 4 <= rm->reg;
+  emit_rex(w, reg, rm, byte_reg);
+  emit_bytes(opcode, nopcode);
+  emit_modrm(reg, rm, imm);
+}
+
+static void emit_op1(bool w, int opcode, int reg, Operand *rm, int imm) {
+  uint8_t op = opcode;
+  emit_op(w, &op, 1, reg, rm, imm);
+}
+
+static bool is_rm(Operand *op) {
+  return op->kind == OP_REG || op->kind == OP_MEM;
+}
+
+// 条件コード
+static int cond_code(const char *cc) {
+  static struct { char *name; int code; } codes[] = {
+    {"o", 0}, {"no", 1}, {"b", 2}, {"c", 2}, {"nae", 2}, {"ae", 3}, {"nb", 3}, {"nc", 3},
+    {"e", 4}, {"z", 4}, {"ne", 5}, {"nz", 5}, {"be", 6}, {"na", 6}, {"a", 7}, {"nbe", 7},
+    {"s", 8}, {"ns", 9}, {"p", 10}, {"np", 11}, {"l", 12}, {"nge", 12}, {"ge", 13}, {"nl", 13},
+    {"le", 14}, {"ng", 14}, {"g", 15}, {"nle", 15},
+  };
+  for (size_t i = 0; i < sizeof(codes) / sizeof(*codes); i++) {
+    if (!strcmp(codes[i].name, cc)) {
+      return codes[i].code;
+    }
+  }
+  return -1;
+}
+
+static void emit_branch(Symbol *sym, FixKind kind) {
+  add_reloc(kind, sym, -4);
+  emit_le(0, 4);
+}
+
+// add, or, and, sub, xor, cmp
+static bool alu_op(const char *mn, int *digit) {
+  static char *names[] = {"add", "or", NULL, NULL, "and", "sub", "xor", "cmp"};
+  for (int i = 0; i < 8; i++) {
+    if (names[i] && !strcmp(names[i], mn)) {
+      *digit = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void bad_operands(const char *mn) {
+  asm_error("invalid operands for %s", mn);
+}
+
+static void assemble_insn(char *mn, Operand *ops, int n) {
+  Operand *dst = &ops[0], *src = &ops[1];
+  bool w = !(0 < n && dst->kind == OP_REG && dst->size == 4);
+  int digit, cc;
+
+  if (!strcmp(mn, "ret") && n == 0) {
+    emit_byte(0xc3);
+  }
+  else if (!strcmp(mn, "nop") && n == 0) {
+    emit_byte(0x90);
+  }
+  else if (!strcmp(mn, "leave") && n == 0) {
+    emit_byte(0xc9);
+  }
+  else if (!strcmp(mn, "cqo") && n == 0) {
+    emit_byte(0x48);
+    emit_byte(0x99);
+  }
+  else if (!strcmp(mn, "rdtsc") && n == 0) {
+    emit_byte(0x0f);
+    emit_byte(0x31);
+  }
+  else if (!strcmp(mn, "push") && n == 1) {
+    if (dst->kind == OP_REG && dst->size == 8) {
+      if (8 <= dst->reg) {
+        emit_byte(0x41);
+      }
+      emit_byte(0x50 + (dst->reg & 7));
+    }
+    else if (dst->kind == OP_IMM && fits8(dst->imm)) {
+      emit_byte(0x6a);
+      emit_byte(dst->imm);
+    }
+    else if (dst->kind == OP_IMM && fits32(dst->imm)) {
+      emit_byte(0x68);
+      emit_le(dst->imm, 4);
+    }
+    else if (dst->kind == OP_MEM) {
+      emit_op1(false, 0xff, 6, dst, 0);
+    }
+    else {
+      bad_operands(mn);
+    }
+  }
+  else if (!strcmp(mn, "pop") && n == 1) {
+    if (dst->kind == OP_REG && dst->size == 8) {
+      if (8 <= dst->reg) {
+        emit_byte(0x41);
+      }
+      emit_byte(0x58 + (dst->reg & 7));
+    }
+    else if (dst->kind == OP_MEM) {
+      emit_op1(false, 0x8f, 0, dst, 0);
+    }
+    else {
+      bad_operands(mn);
+    }
+  }
+  else if (!strcmp(mn, "mov") && n == 2) {
+    if (is_rm(dst) && src->kind == OP_REG) {
+      emit_op1(w, 0x89, src->reg, dst, 0);
+    }
+    else if (dst->kind == OP_REG && src->kind == OP_MEM) {
+      emit_op1(w, 0x8b, dst->reg, src, 0);
+    }
+    else if (dst->kind == OP_REG && src->kind == OP_IMM && (!w || !fits32(src->imm))) {
+      // mov r32, imm32 / mov r64, imm64
+      if (w || 8 <= dst->reg) {
+        emit_byte(0x40 | (w ? 8 : 0) | (8 <= dst->reg ? 1 : 0));
+      }
+      emit_byte(0xb8 + (dst->reg & 7));
+      emit_le(src->imm, w ? 8 : 4);
+    }
+    else if (is_rm(dst) && src->kind == OP_IMM && fits32(src->imm)) {
+      emit_op1(w, 0xc7, 0, dst, 4);
+      emit_le(src->imm, 4);
+    }
+    else {
+      bad_operands(mn);
+    }
+  }
+  else if (!strcmp(mn, "lea") && n == 2 && dst->kind == OP_REG && src->kind == OP_MEM) {
+    emit_op1(w, 0x8d, dst->reg, src, 0);
+  }
+  else if (alu_op(mn, &digit) && n == 2) {
+    if (is_rm(dst) && src->kind == OP_REG) {
+      emit_op1(w, digit << 3 | 1, src->reg, dst, 0);
+    }
+    else if (dst->kind == OP_REG && src->kind == OP_MEM) {
+      emit_op1(w, digit << 3 | 3, dst->reg, src, 0);
+    }
+    else if (is_rm(dst) && src->kind == OP_IMM && fits8(src->imm)) {
+      emit_op1(w, 0x83, digit, dst, 1);
+      emit_byte(src->imm);
+    }
+    else if (is_rm(dst) && src->kind == OP_IMM && fits32(src->imm)) {
+      emit_op1(w, 0x81, digit, dst, 4);
+      emit_le(src->imm, 4);
+    }
+    else {
+      bad_operands(mn);
+    }
+  }
+  else if (!strcmp(mn, "test") && n == 2 && is_rm(dst) && src->kind == OP_REG) {
+    emit_op1(w, 0x85, src->reg, dst, 0);
+  }
+  else if (!strcmp(mn, "imul") && n == 2 && dst->kind == OP_REG && is_rm(src)) {
+    static const uint8_t op[] = {0x0f, 0xaf};
+    emit_op(w, op, 2, dst->reg, src, 0);
+  }
+  else if (!strcmp(mn, "imul") && n == 3 && dst->kind == OP_REG && is_rm(src) &&
+           ops[2].kind == OP_IMM && fits32(ops[2].imm)) {
+    if (fits8(ops[2].imm)) {
+      emit_op1(w, 0x6b, dst->reg, src, 1);
+      emit_byte(ops[2].imm);
+    }
+    else {
+      emit_op1(w, 0x69, dst->reg, src, 4);
+      emit_le(ops[2].imm, 4);
+    }
+  }
+  else if ((!strcmp(mn, "not") || !strcmp(mn, "neg") || !strcmp(mn, "idiv")) &&
+           n == 1 && is_rm(dst)) {
+    emit_op1(w, 0xf7, mn[0] == 'n' ? (mn[1] == 'o' ? 2 : 3) : 7, dst, 0);
+  }
+  else if ((!strcmp(mn, "inc") || !strcmp(mn, "dec")) && n == 1 && is_rm(dst)) {
+    emit_op1(w, 0xff, mn[0] == 'd', dst, 0);
+  }
+  else if ((!strcmp(mn, "shl") || !strcmp(mn, "shr") || !strcmp(mn, "sar")) &&
+           n == 2 && is_rm(dst)) {
+    int digit = mn[1] == 'h' ? (mn[2] == 'l' ? 4 : 5) : 7;
+    if (src->kind == OP_IMM) {
+      emit_op1(w, 0xc1, digit, dst, 1);
+      emit_byte(src->imm);
+    }
+    else if (src->kind == OP_REG && src->reg == 1 && src->size == 1) {
+      emit_op1(w, 0xd3, digit, dst, 0);
+    }
+    else {
+      bad_operands(mn);
+    }
+  }
+  else if ((!strcmp(mn, "movzb") || !strcmp(mn, "movzx")) && n == 2 &&
+           dst->kind == OP_REG && is_rm(src)) {
+    static const uint8_t op[] = {0x0f, 0xb6};
+    emit_op(w, op, 2, dst->reg, src, 0);
+  }
+  else if (startswith(mn, "set") && (cc = cond_code(mn + 3)) >= 0 && n == 1 && is_rm(dst)) {
+    uint8_t op[] = {0x0f, 0x90 + cc};
+    emit_op(false, op, 2, 0, dst, 0);
+  }
+  else if (!strcmp(mn, "jmp") && n == 1 && dst->kind == OP_SYM) {
+    emit_byte(0xe9);
+    emit_branch(dst->sym, FIX_PC32);
+  }
+  else if (mn[0] == 'j' && (cc = cond_code(mn + 1)) >= 0 && n == 1 && dst->kind == OP_SYM) {
+    emit_byte(0x0f);
+    emit_byte(0x80 + cc);
+    emit_branch(dst->sym, FIX_PC32);
+  }
+  else if (!strcmp(mn, "call") && n == 1 && dst->kind == OP_SYM) {
+    emit_byte(0xe8);
+    emit_branch(dst->sym, FIX_PLT32);
+  }
+  else {
+    asm_error("unsupported instruction: %s", mn);
+  }
+}
+
+////////////////////////////////////////////////////////////////
+// ディレクティブ
+
+// "..."を解釈してバイト列にする
+static void emit_string_literal(char *p, bool nul) {
+  p = skip_space(p);
+  if (*p++ != '"') {
+    asm_error("string expected");
+  }
+  while (*p && *p != '"') {
+    int c = *p++;
+    if (c == '\\') {
+      c = *p++;
+      if ('0' <= c && c <= '7') {
+        int v = c - '0';
+        for (int i = 0; i < 2 && '0' <= *p && *p <= '7'; i++) {
+          v = v * 8 + *p++ - '0';
+        }
+        c = v;
+      }
+      else if (c == 'n') {
+        c = '\n';
+      }
+      else if (c == 't') {
+        c = '\t';
+      }
+    }
+    emit_byte(c);
+  }
+  if (nul) {
+    emit_byte(0);
+  }
+}
+
+// 名前の後ろの空白や引数を切り落とす
+static char *directive_arg(char *p) {
+  p = skip_space(p);
+  char *end = p;
+  while (is_symchar(*end)) {
+    end++;
+  }
+  *end = '\0';
+  return p;
+}
+
+static void assemble_directive(char *dir, char *rest) {
+  if (!strcmp(dir, ".intel_syntax") || !strcmp(dir, ".file") || !strcmp(dir, ".loc") ||
+      !strcmp(dir, ".ident")) {
+    return;
+  }
+  if (!strcmp(dir, ".text") || !strcmp(dir, ".data") || !strcmp(dir, ".bss")) {
+    as.cur = get_section(dir);
+  }
+  else if (!strcmp(dir, ".section")) {
+    as.cur = get_section(directive_arg(rest));
+  }
+  else if (!strcmp(dir, ".global") || !strcmp(dir, ".globl")) {
+    get_symbol(directive_arg(rest))->global = true;
+  }
+  else if (!strcmp(dir, ".p2align")) {
+    align_section(1 << atoi(rest));
+  }
+  else if (!strcmp(dir, ".align") || !strcmp(dir, ".balign")) {
+    align_section(atoi(rest));
+  }
+  else if (!strcmp(dir, ".zero")) {
+    long n = atol(rest);
+    if (as.cur->type == SHT_NOBITS) {
+      as.cur->size += n;
+    }
+    else {
+      for (long i = 0; i < n; i++) {
+        emit_byte(0);
+      }
+    }
+  }
+  else if (!strcmp(dir, ".byte") || !strcmp(dir, ".long") || !strcmp(dir, ".quad")) {
+    int size = dir[1] == 'b' ? 1 : dir[1] == 'l' ? 4 : 8;
+    Operand op;
+    parse_operand(rest, &op);
+    if (op.kind == OP_IMM) {
+      emit_le(op.imm, size);
+    }
+    else if (op.kind == OP_SYM && size == 8) {
+      add_reloc(FIX_ABS64, op.sym, 0);
+      emit_le(0, 8);
+    }
+    else {
+      asm_error("invalid data");
+    }
+  }
+  else if (!strcmp(dir, ".string") || !strcmp(dir, ".asciz")) {
+    emit_string_literal(rest, true);
+  }
+  else if (!strcmp(dir, ".ascii")) {
+    emit_string_literal(rest, false);
+  }
+  else if (!strcmp(dir, ".type")) {
+    char *comma = strchr(rest, ',');
+    if (!comma) {
+      asm_error("invalid .type");
+    }
+    *comma = '\0';
+    Symbol *sym = get_symbol(directive_arg(rest));
+    sym->type = strstr(comma + 1, "function") ? STT_FUNC : STT_OBJECT;
+  }
+  else if (!strcmp(dir, ".size")) {
+    // .size name, .-name だけ
+    char *comma = strchr(rest, ',');
+    if (!comma) {
+      asm_error("invalid .size");
+    }
+    *comma = '\0';
+    Symbol *sym = get_symbol(directive_arg(rest));
+    char *expr = skip_space(comma + 1);
+    if (!startswith(expr, ".-") || strcmp(directive_arg(expr + 2), sym->name)) {
+      asm_error("unsupported .size expression");
+    }
+    sym->size = as.cur->size - sym->value;
+  }
+  else {
+    asm_error("unsupported directive: %s", dir);
+  }
+}
+
+static void assemble_line(char *line) {
+  char *p = skip_space(line);
+  if (!*p) {
+    return;
+  }
+  size_t len = strlen(p);
+  while (len && isspace(p[len - 1])) {
+    p[--len] = '\0';
+  }
+
+  // ラベル
+  if (p[len - 1] == ':') {
+    p[len - 1] = '\0';
+    Symbol *sym = get_symbol(p);
+    if (sym->sec) {
+      asm_error("symbol already defined: %s", p);
+    }
+    sym->sec = as.cur;
+    sym->value = as.cur->size;
+    return;
+  }
+
+  char *end = p;
+  while (*end && !isspace(*end)) {
+    end++;
+  }
+  char *rest = *end ? end + 1 : end;
+  *end = '\0';
+
+  if (*p == '.') {
+    assemble_directive(p, rest);
+    return;
+  }
+  Operand ops[3];
+  int n = parse_operands(rest, ops);
+  assemble_insn(p, ops, n);
+}
+
+////////////////////////////////////////////////////////////////
+// 再配置とELFの書き出し
+
+// 同じセクションの.Lラベルや非公開のシンボルへの相対参照はここで埋める
+static bool resolve_reloc(Reloc *r) {
+  Symbol *sym = r->sym;
+  if (!sym->sec) {
+    if (is_local_label(sym)) {
+      as.line = r->line;
+      as.text = sym->name;
+      asm_error("undefined label: %s", sym->name);
+    }
+    return false;
+  }
+  if (r->kind == FIX_ABS64 || sym->sec != r->sec || sym->global) {
+    return false;
+  }
+  long val = sym->value + r->addend - (long)r->offset;
+  if (!fits32(val)) {
+    asm_error("branch out of range");
+  }
+  int32_t v = val;
+  memcpy(r->sec->data + r->offset, &v, 4);
+  return true;
+}
+
+typedef struct Buffer {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+} Buffer;
+
+static size_t buf_append(Buffer *buf, const void *p, size_t n) {
+  size_t off = buf->size;
+  if (buf->capacity < buf->size + n) {
+    buf->capacity = (buf->size + n) * 2;
+    buf->data = realloc(buf->data, buf->capacity);
+  }
+  if (p) {
+    memcpy(buf->data + buf->size, p, n);
+  }
+  else {
+    memset(buf->data + buf->size, 0, n);
+  }
+  buf->size += n;
+  return off;
+}
+
+static void buf_align(Buffer *buf, size_t align) {
+  while (buf->size % align) {
+    buf_append(buf, "", 1);
+  }
+}
+
+static int add_str(Buffer *strtab, const char *s) {
+  return buf_append(strtab, s, strlen(s) + 1);
+}
+
+static void write_elf(FILE *out) {
+  Buffer body = {}, strtab = {}, shstrtab = {};
+  add_str(&strtab, "");
+  add_str(&shstrtab, "");
+
+  // セクション番号: 0はnull、続いて中身のあるセクション
+  int nsh = 1;
+  for (int i = 0; i < as.nsections; i++) {
+    as.sections[i]->index = nsh++;
+  }
+
+  // シンボル表: null、セクション、ローカル、グローバルの順
+  Elf64_Sym *syms = calloc(as.nsections + as.nsymbols + 1, sizeof(Elf64_Sym));
+  int nsyms = 1;
+  for (int i = 0; i < as.nsections; i++) {
+    Section *sec = as.sections[i];
+    sec->sym_index = nsyms;
+    syms[nsyms].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    syms[nsyms].st_shndx = sec->index;
+    nsyms++;
+  }
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < as.nsymbols; i++) {
+      Symbol *sym = as.symtab[i];
+      bool global = sym->global || !sym->sec;
+      if (is_local_label(sym) || global != (pass == 1)) {
+        continue;
+      }
+      sym->index = nsyms;
+      Elf64_Sym *es = &syms[nsyms++];
+      es->st_name = add_str(&strtab, sym->name);
+      es->st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL,
+                                  sym->sec && sym->sec->flags & SHF_EXECINSTR && !sym->type ? STT_FUNC : sym->type);
+      es->st_shndx = sym->sec ? sym->sec->index : SHN_UNDEF;
+      es->st_value = sym->value;
+      es->st_size = sym->size;
+    }
+  }
+  int first_global = 1;
+  while (first_global < nsyms && ELF64_ST_BIND(syms[first_global].st_info) == STB_LOCAL) {
+    first_global++;
+  }
+
+  // 再配置をセクションごとにまとめる
+  Buffer *relas = calloc(as.nsections, sizeof(Buffer));
+  for (int i = 0; i < as.nrelocs; i++) {
+    Reloc *r = &as.relocs[i];
+    if (resolve_reloc(r)) {
+      continue;
+    }
+    Symbol *sym = r->sym;
+    Elf64_Rela rela = {};
+    rela.r_offset = r->offset;
+    rela.r_addend = r->addend;
+    int symidx;
+    if (is_local_label(sym) || (sym->sec && !sym->global && sym->index == 0)) {
+      symidx = sym->sec->sym_index;
+      rela.r_addend += sym->value;
+    }
+    else {
+      symidx = sym->index;
+    }
+    int type = r->kind == FIX_ABS64 ? R_X86_64_64 :
+      r->kind == FIX_PLT32 ? R_X86_64_PLT32 : R_X86_64_PC32;
+    rela.r_info = ELF64_R_INFO(symidx, type);
+    int secidx = r->sec->index - 1;
+    buf_append(&relas[secidx], &rela, sizeof(rela));
+  }
+
+  int nrela = 0;
+  for (int i = 0; i < as.nsections; i++) {
+    if (relas[i].size) {
+      nrela++;
+    }
+  }
+  int rela_base = nsh;
+  int symtab_index = rela_base + nrela;
+  int strtab_index = symtab_index + 1;
+  int note_index = strtab_index + 1;
+  int shstrtab_index = note_index + 1;
+  nsh = shstrtab_index + 1;
+
+  Elf64_Shdr *sh = calloc(nsh, sizeof(Elf64_Shdr));
+  buf_append(&body, NULL, sizeof(Elf64_Ehdr));
+
+  for (int i = 0; i < as.nsections; i++) {
+    Section *sec = as.sections[i];
+    Elf64_Shdr *s = &sh[sec->index];
+    s->sh_name = add_str(&shstrtab, sec->name);
+    s->sh_type = sec->type;
+    s->sh_flags = sec->flags;
+    s->sh_addralign = sec->align;
+    s->sh_size = sec->size;
+    buf_align(&body, sec->align);
+    s->sh_offset = body.size;
+    if (sec->type != SHT_NOBITS) {
+      buf_append(&body, sec->data, sec->size);
+    }
+  }
+
+  int ri = rela_base;
+  for (int i = 0; i < as.nsections; i++) {
+    if (!relas[i].size) {
+      continue;
+    }
+    Elf64_Shdr *s = &sh[ri++];
+    s->sh_name = add_str(&shstrtab, format(".rela%s", as.sections[i]->name));
+    s->sh_type = SHT_RELA;
+    s->sh_flags = SHF_INFO_LINK;
+    s->sh_link = symtab_index;
+    s->sh_info = as.sections[i]->index;
+    s->sh_entsize = sizeof(Elf64_Rela);
+    s->sh_addralign = 8;
+    buf_align(&body, 8);
+    s->sh_offset = body.size;
+    s->sh_size = relas[i].size;
+    buf_append(&body, relas[i].data, relas[i].size);
+  }
+
+  Elf64_Shdr *s = &sh[symtab_index];
+  s->sh_name = add_str(&shstrtab, ".symtab");
+  s->sh_type = SHT_SYMTAB;
+  s->sh_link = strtab_index;
+  s->sh_info = first_global;
+  s->sh_entsize = sizeof(Elf64_Sym);
+  s->sh_addralign = 8;
+  buf_align(&body, 8);
+  s->sh_offset = body.size;
+  s->sh_size = nsyms * sizeof(Elf64_Sym);
+  buf_append(&body, syms, s->sh_size);
+
+  s = &sh[strtab_index];
+  s->sh_name = add_str(&shstrtab, ".strtab");
+  s->sh_type = SHT_STRTAB;
+  s->sh_addralign = 1;
+  s->sh_offset = body.size;
+  s->sh_size = strtab.size;
+  buf_append(&body, strtab.data, strtab.size);
+
+  // スタックを実行可能にしない
+  s = &sh[note_index];
+  s->sh_name = add_str(&shstrtab, ".note.GNU-stack");
+  s->sh_type = SHT_PROGBITS;
+  s->sh_addralign = 1;
+  s->sh_offset = body.size;
+
+  s = &sh[shstrtab_index];
+  s->sh_name = add_str(&shstrtab, ".shstrtab");
+  s->sh_type = SHT_STRTAB;
+  s->sh_addralign = 1;
+  s->sh_offset = body.size;
+  s->sh_size = shstrtab.size;
+  buf_append(&body, shstrtab.data, shstrtab.size);
+
+  buf_align(&body, 8);
+  Elf64_Ehdr *eh = (Elf64_Ehdr *)body.data;
+  memcpy(eh->e_ident, ELFMAG, SELFMAG);
+  eh->e_ident[EI_CLASS] = ELFCLASS64;
+  eh->e_ident[EI_DATA] = ELFDATA2LSB;
+  eh->e_ident[EI_VERSION] = EV_CURRENT;
+  eh->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  eh->e_type = ET_REL;
+  eh->e_machine = EM_X86_64;
+  eh->e_version = EV_CURRENT;
+  eh->e_ehsize = sizeof(Elf64_Ehdr);
+  eh->e_shentsize = sizeof(Elf64_Shdr);
+  eh->e_shnum = nsh;
+  eh->e_shstrndx = shstrtab_index;
+  eh->e_shoff = body.size;
+
+  fwrite(body.data, 1, body.size, out);
+  fwrite(sh, sizeof(Elf64_Shdr), nsh, out);
+}
+
+// アセンブリのテキストからオブジェクトファイルを作る
+void assemble(char *text, const char *path) {
+  as.cur = get_section(".text");
+  as.text = "";
+  for (char *line = text; *line; ) {
+    char *end = strchr(line, '\n');
+    if (end) {
+      *end = '\0';
+    }
+    as.line++;
+    as.text = format("%s", line);
+    assemble_line(line);
+    free(as.text);
+    as.text = "";
+    if (!end) {
+      break;
+    }
+    line = end + 1;
+  }
+
+  FILE *out = fopen(path, "wb");
+  if (!out) {
+    error("cannot open %s", path);
+  }
+  write_elf(out);
+  fclose(out);
+}
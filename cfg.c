@@ -0,0 +1,368 @@
+////////////////////////////////////////////////////////////////
+// Control flow graph
+//
+// 1つの関数分のアセンブリを基本ブロックに分けて、制御フローグラフとして整理する。
+//   - 空のブロックを経由するジャンプは最終的な飛び先へ直接飛ばす(jump threading)
+//   - 入口からたどれないブロックを消す
+//   - 飛び込む経路が1つしかないブロックは、前のブロックにつなげる
+//   - 次に置いたブロックへのジャンプは消し、条件分岐は条件を反転してfall-throughにする
+// ブロックは元の順番で並べ直すので、codegenが決めた配置(コールドブロックなど)は保たれる。
+
+#include <string.h>
+#include "k9cc.h"
+
+typedef enum {
+  END_FALL,                     // 次のブロックへ進む
+  END_JMP,
+  END_JCC,                      // 条件が成り立てばtarget、でなければnext
+  END_RET,
+} BlockEnd;
+
+typedef struct Block Block;
+struct Block {
+  char *label;                  // 最初のラベル(なければNULL)
+  char *align;                  // 先頭の.p2align
+  char **lines;                 // 終端のジャンプを除いた命令と.loc
+  int nlines;
+  bool has_insn;                // .loc以外の行がある
+
+  BlockEnd end;
+  char *cc;                     // END_JCCの条件("e", "ne", ...)
+  char *target_label;
+  Block *target;                // END_JMP, END_JCCの飛び先
+  Block *next;                  // END_FALL, END_JCCで進む先
+
+  int npreds;
+  bool live;
+  bool referenced;              // ラベルを出す必要がある
+  Block *layout_next;           // 出力で次に置くブロック
+};
+
+typedef struct CFG {
+  Block **blocks;               // 元の順番
+  int nblocks;
+  HashMap labels;               // ラベル -> Block
+  const char *name;
+} CFG;
+
+static int nchanges;            // 付け替えたジャンプと消したブロックの数
+static int ninsns;              // 出力した命令の数
+
+static Block *new_block(CFG *cfg) {
+  Block *b = calloc(1, sizeof(Block));
+  b->live = true;
+  cfg->blocks = realloc(cfg->blocks, sizeof(Block *) * (cfg->nblocks + 1));
+  cfg->blocks[cfg->nblocks++] = b;
+  return b;
+}
+
+static void add_line(Block *b, char *line) {
+  b->lines = realloc(b->lines, sizeof(char *) * (b->nlines + 1));
+  b->lines[b->nlines++] = line;
+}
+
+// ラベルの後ろに命令がまだないブロック
+static bool block_is_open(Block *b) {
+  return b->end == END_FALL && !b->has_insn;
+}
+
+// textを行に分けてブロックを作る。関数の外へのジャンプがあればfalse
+static bool build_cfg(CFG *cfg, char *text) {
+  Block *cur = new_block(cfg);
+  for (char *line = text; *line;) {
+    char *eol = strchr(line, '\n');
+    char *next_line = eol ? eol + 1 : line + strlen(line);
+    if (eol) {
+      *eol = '\0';
+    }
+    size_t len = strlen(line);
+
+    if (!len) {
+    }
+    else if (line[0] != ' ' && line[len - 1] == ':') {
+      // 続けて置かれたラベルは同じブロックの名前になる
+      line[len - 1] = '\0';
+      if (!block_is_open(cur)) {
+        cur = new_block(cfg);
+      }
+      if (!cur->label) {
+        cur->label = line;
+      }
+      hashmap_put(&cfg->labels, line, cur);
+    }
+    else if (startswith(line, ".p2align")) {
+      if (!block_is_open(cur) || cur->label || cur->align) {
+        cur = new_block(cfg);
+      }
+      cur->align = line;
+    }
+    else if (line[0] == '.') {
+      // .locなどはブロックの中身として残す
+      add_line(cur, line);
+    }
+    else {
+      char *mn = line + strspn(line, " ");
+      size_t mnlen = strcspn(mn, " ");
+      char *operand = mn + mnlen + strspn(mn + mnlen, " ");
+      if (mnlen == 3 && startswith(mn, "ret")) {
+        cur->end = END_RET;
+      }
+      else if (mn[0] == 'j' && *operand) {
+        cur->end = mnlen == 3 && startswith(mn, "jmp") ? END_JMP : END_JCC;
+        if (cur->end == END_JCC) {
+          cur->cc = format("%.*s", (int)mnlen - 1, mn + 1);
+        }
+        cur->target_label = operand;
+      }
+      else {
+        add_line(cur, line);
+        cur->has_insn = true;
+        line = next_line;
+        continue;
+      }
+      cur->has_insn = true;
+      cur = new_block(cfg);
+    }
+    line = next_line;
+  }
+
+  // 飛び先と次のブロックをつなぐ
+  for (int i = 0; i < cfg->nblocks; i++) {
+    Block *b = cfg->blocks[i];
+    if (b->end == END_FALL || b->end == END_JCC) {
+      b->next = i + 1 < cfg->nblocks ? cfg->blocks[i + 1] : NULL;
+    }
+    if (b->target_label && !(b->target = hashmap_get(&cfg->labels, b->target_label))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 空のブロックを飛ばした、実際に命令のある行き先
+static Block *forward(CFG *cfg, Block *b) {
+  Block *to = b;
+  for (int steps = 0; to && !to->has_insn && !to->align; steps++) {
+    Block *succ = to->end == END_JMP ? to->target : to->end == END_FALL ? to->next : NULL;
+    if (!succ || cfg->nblocks < steps) {
+      // 関数の終わりに落ちるか、空のまま回り続けるループ
+      return b;
+    }
+    to = succ;
+  }
+  return to;
+}
+
+static void thread_jumps(CFG *cfg) {
+  for (int i = 0; i < cfg->nblocks; i++) {
+    Block *b = cfg->blocks[i];
+    Block *target = forward(cfg, b->target);
+    Block *next = forward(cfg, b->next);
+    if (target != b->target) {
+      nchanges++;
+    }
+    b->target = target;
+    b->next = next;
+    if (b->end == END_JCC && b->target == b->next) {
+      b->end = END_FALL;
+      b->target = NULL;
+      b->cc = NULL;
+    }
+  }
+}
+
+static void mark_live(CFG *cfg) {
+  for (int i = 0; i < cfg->nblocks; i++) {
+    cfg->blocks[i]->live = false;
+    cfg->blocks[i]->npreds = 0;
+  }
+  Block **stack = calloc(cfg->nblocks, sizeof(Block *));
+  int depth = 0;
+  stack[depth++] = cfg->blocks[0];
+  cfg->blocks[0]->live = true;
+  while (depth) {
+    Block *b = stack[--depth];
+    Block *succ[2] = {b->target, b->next};
+    for (int i = 0; i < 2; i++) {
+      if (!succ[i]) {
+        continue;
+      }
+      succ[i]->npreds++;
+      if (!succ[i]->live) {
+        succ[i]->live = true;
+        stack[depth++] = succ[i];
+      }
+    }
+  }
+  free(stack);
+}
+
+// 唯一の後続で、そこへの経路がほかにないブロックをつなげる
+static bool merge_blocks(CFG *cfg) {
+  bool changed = false;
+  for (int i = 0; i < cfg->nblocks; i++) {
+    Block *b = cfg->blocks[i];
+    if (!b->live) {
+      continue;
+    }
+    for (;;) {
+      Block *s = b->end == END_JMP ? b->target : b->end == END_FALL ? b->next : NULL;
+      if (!s || s == b || s == cfg->blocks[0] || s->npreds != 1 || s->align) {
+        break;
+      }
+      for (int j = 0; j < s->nlines; j++) {
+        add_line(b, s->lines[j]);
+      }
+      b->has_insn |= s->has_insn;
+      b->end = s->end;
+      b->cc = s->cc;
+      b->target = s->target;
+      b->next = s->next;
+      s->live = false;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// 条件を反転する。知らない条件ならNULL
+char *invert_cc(const char *cc) {
+  static char *pairs[][2] = {
+    {"e", "ne"}, {"z", "nz"}, {"l", "ge"}, {"le", "g"}, {"b", "ae"}, {"be", "a"},
+    {"s", "ns"}, {"o", "no"}, {"p", "np"},
+  };
+  for (int i = 0; i < (int)(sizeof(pairs) / sizeof(*pairs)); i++) {
+    if (!strcmp(pairs[i][0], cc)) {
+      return pairs[i][1];
+    }
+    if (!strcmp(pairs[i][1], cc)) {
+      return pairs[i][0];
+    }
+  }
+  return NULL;
+}
+
+// ジャンプで参照するブロックのラベル。なければ作る
+static void use_label(CFG *cfg, Block *b) {
+  static int nlabels;
+  if (!b->label) {
+    b->label = format(".L.bb_%s%d", cfg->name, nlabels++);
+  }
+  b->referenced = true;
+}
+
+static void emit_jump(FILE *out, const char *mn, const char *cc, Block *to) {
+  fprintf(out, "        %s%s %s\n", mn, cc, to->label);
+  ninsns++;
+}
+
+// 元の順番で生きているブロックを並べ、つながりに必要なジャンプだけを出す
+static void emit_cfg(CFG *cfg, FILE *out) {
+  Block *prev = NULL;
+  for (int i = 0; i < cfg->nblocks; i++) {
+    Block *b = cfg->blocks[i];
+    if (b->live) {
+      if (prev) {
+        prev->layout_next = b;
+      }
+      prev = b;
+    }
+  }
+
+  // 先にどのラベルが要るかを決める
+  for (int i = 0; i < cfg->nblocks; i++) {
+    Block *b = cfg->blocks[i];
+    if (!b->live) {
+      continue;
+    }
+    if (b->end == END_JCC && b->target == b->layout_next && invert_cc(b->cc)) {
+      b->cc = invert_cc(b->cc);
+      b->target = b->next;
+      b->next = b->layout_next;
+    }
+    if (b->end == END_JCC || (b->end == END_JMP && b->target != b->layout_next)) {
+      use_label(cfg, b->target);
+    }
+    if (b->next && b->next != b->layout_next) {
+      use_label(cfg, b->next);
+    }
+  }
+
+  for (int i = 0; i < cfg->nblocks; i++) {
+    Block *b = cfg->blocks[i];
+    if (!b->live) {
+      continue;
+    }
+    if (b->align) {
+      fprintf(out, "%s\n", b->align);
+    }
+    if (b->referenced) {
+      fprintf(out, "%s:\n", b->label);
+    }
+    for (int j = 0; j < b->nlines; j++) {
+      fprintf(out, "%s\n", b->lines[j]);
+      ninsns += b->lines[j][0] != '.';
+    }
+    if (b->end == END_RET) {
+      fprintf(out, "        ret\n");
+      ninsns++;
+    }
+    else if (b->end == END_JCC) {
+      emit_jump(out, "j", b->cc, b->target);
+    }
+    else if (b->end == END_JMP && b->target != b->layout_next) {
+      emit_jump(out, "jmp", "", b->target);
+    }
+    if (b->next && b->next != b->layout_next) {
+      emit_jump(out, "jmp", "", b->next);
+    }
+  }
+}
+
+// 本体がそのまま出力されるときの命令の数
+static int count_insns(const char *text) {
+  int n = 0;
+  for (const char *p = text; *p; p++) {
+    n += (p == text || p[-1] == '\n') && startswith(p, "        ");
+  }
+  return n;
+}
+
+// 1つの関数の本体textを整理してoutに書き、変えた数を返す。
+// 出力した命令の数は*insnsに入れる。nameは新しく作るラベルに使う
+int optimize_cfg(char *text, FILE *out, const char *name, int *insns) {
+  CFG cfg = {.name = name};
+  char *orig = format("%s", text);
+  nchanges = 0;
+  ninsns = 0;
+  if (!build_cfg(&cfg, text)) {
+    // 関数の外へのジャンプなど、知らない形は手を付けない
+    fputs(orig, out);
+    ninsns = count_insns(orig);
+  }
+  else {
+    int nblocks = cfg.nblocks;
+    thread_jumps(&cfg);
+    mark_live(&cfg);
+    while (merge_blocks(&cfg)) {
+      thread_jumps(&cfg);
+      mark_live(&cfg);
+    }
+    int nlive = 0;
+    for (int i = 0; i < cfg.nblocks; i++) {
+      nlive += cfg.blocks[i]->live;
+    }
+    nchanges += nblocks - nlive;
+    emit_cfg(&cfg, out);
+  }
+
+  for (int i = 0; i < cfg.nblocks; i++) {
+    free(cfg.blocks[i]->lines);
+    free(cfg.blocks[i]);
+  }
+  free(cfg.blocks);
+  hashmap_free(&cfg.labels);
+  free(orig);
+  *insns = ninsns;
+  return nchanges;
+}
@@ -4,24 +4,46 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <unistd.h>
 #include "k9cc.h"
 
 static char *argreg[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 static const int nargreg = sizeof(argreg) / sizeof(argreg[1]);
 
+// 実行回数がもう一方の分岐のこの割合以下ならコールドとみなす
+#define COLD_RATIO 100
+
+// System V ABIのレッドゾーンの大きさ
+#define RED_ZONE_SIZE 128
+
+// スタックフレームの形
+typedef enum {
+  FRAME_RBP,                    // push rbp; mov rbp, rsp; sub rsp, N
+  FRAME_RSP,                    // 葉関数: sub rsp, Nだけでrspから参照する
+  FRAME_RED_ZONE,               // 葉関数: フレームを作らずレッドゾーンに置く
+} FrameKind;
+
 typedef struct GenInfo {
   char *name;
+  int nsite;                    // 関数内の分岐サイトの通し番号
+  FILE *cold;                   // 関数末尾に回すコールドブロック
+  FrameKind frame;
+  int stack_size;               // ローカル変数領域の大きさ
+  int depth;                    // 式の評価で積んでいる一時値の数
+  int line;                     // 最後に出した.locの位置
+  int column;
+  char *cc;                     // 最後に評価した条件式が真になる条件("e", "l", ...)
 } GenInfo;
 
+static FILE *outfp;
+static int ninsns;              // 出力した命令の数(--stats)
+
 static int sequence();
 static void emit(const char *fmt, ...);
 static void emit_head(void);
-static void load();
-static void store();
-static void gen_addr(Node *node, GenInfo *_info);
-static void gen_args(Node *node, GenInfo *info);
-static void gen_expr(Node *node, GenInfo *info);
-static void gen_stmt(Node *node, GenInfo *info);
+static void push(GenInfo *info, const char *reg);
+static void pop(GenInfo *info, const char *reg);
 
 
 static int sequence() {
@@ -30,12 +52,13 @@ static int sequence() {
 }
 
 static void emit(const char *fmt, ...) {
-  FILE *fpout = stdout;
+  FILE *fpout = outfp;
   size_t len = strlen(fmt);
 
   if (*fmt != '.' && (0 < len && fmt[len - 1] != ':')) {
     // ラベルなどでない通常のコードのとき
     fprintf(fpout, "        ");
+    ninsns++;
   }
   va_list ap;
   va_start(ap, fmt);
@@ -44,246 +67,1812 @@ static void emit(const char *fmt, ...) {
   fprintf(fpout, "\n");
 }
 
-static void load() {
-  emit("pop rax");
-  emit("mov rax, [rax]");
-  emit("push rax");
+// 引用符で囲んだ文字列を出力する
+static void emit_quoted(const char *s) {
+  fputc('"', outfp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(outfp, "\\%c", *s);
+    }
+    else if (isprint(*s)) {
+      fputc(*s, outfp);
+    }
+    else {
+      fprintf(outfp, "\\%03o", (unsigned char)*s);
+    }
+  }
+  fputc('"', outfp);
 }
 
-static void store() {
-  emit("pop rdi");
-  emit("pop rax");
-  emit("mov [rax], rdi");
-  emit("push rdi");
+// 文字列リテラルとして出力する
+static void emit_string(const char *s) {
+  fprintf(outfp, "        .string ");
+  emit_quoted(s);
+  fputc('\n', outfp);
 }
 
-static void gen_addr(Node *node, GenInfo *info) {
-  if (node->kind == ND_VAR) {
-    emit("lea rax, [rbp-%d]", node->var->offset);
-    emit("push rax");
+// 以降の出力を関数末尾に回す。戻り値はend_coldに渡す
+static FILE *begin_cold(GenInfo *info) {
+  FILE *prev = outfp;
+  info->line = 0;
+  if (!info->cold && !(info->cold = tmpfile())) {
+    error("cannot create temporary file");
   }
-  else if (node->kind == ND_DEREF) {
-    gen_expr(node->lhs, info);
+  outfp = info->cold;
+  return prev;
+}
+
+static void end_cold(GenInfo *info, FILE *prev) {
+  outfp = prev;
+  info->line = 0;
+}
+
+// コールドブロックを出力している最中か。追い出す先の中からはさらに追い出さない
+static bool emitting_cold(GenInfo *info) {
+  return info->cold && outfp == info->cold;
+}
+
+// 溜めておいたコールドブロックを出力する
+static void flush_cold(GenInfo *info) {
+  if (!info->cold) {
+    return;
   }
-  else {
-    error_tok(node->tok, "lvalueではありません");
+  char buf[BUFSIZ];
+  size_t n;
+  rewind(info->cold);
+  while ((n = fread(buf, 1, sizeof(buf), info->cold))) {
+    fwrite(buf, 1, n, outfp);
   }
+  fclose(info->cold);
+  info->cold = NULL;
 }
 
-static void gen_args(Node *node, GenInfo *info) {
-  int nargs = 0;
-  for (Node *arg = node; arg; arg = arg->next) {
-    nargs++;
-    gen_expr(arg, info);
+// -gのとき、文の位置を.locで出す
+static void emit_loc(GenInfo *info, Token *tok) {
+  if (!opt_debug_info || !tok) {
+    return;
   }
-  if (nargreg < nargs) {
-    error_tok(node->tok, "number of argument out of range");
+  int line, column;
+  source_position(tok->loc, &line, &column);
+  if (line == info->line && column == info->column) {
+    return;
   }
-  for (int i = nargs - 1; 0 <= i; i--) {
-    emit("pop %s", argreg[i]);
+  info->line = line;
+  info->column = column;
+  emit(".loc 1 %d %d", line, column);
+}
+
+// プロファイルカウンタの名前 "関数:種類サイト:辺"
+static char *edge_name(GenInfo *info, const char *kind, int site, const char *edge) {
+  return format("%s:%s%d:%s", info->name, kind, site, edge);
+}
+
+// --profile-generateのとき辺の通過回数を数えるコードを出す
+static void count_edge(GenInfo *info, const char *kind, int site, const char *edge) {
+  if (opt_profile_generate) {
+    int idx = profile_counter(edge_name(info, kind, site, edge));
+    emit("inc qword ptr [rip + .L.prof.counters + %d]", idx * 8);
   }
 }
 
-static void gen_expr(Node *node, GenInfo *info) {
-  int seq;
-  switch (node->kind) {
-  case ND_ASSIGN:
-    gen_addr(node->lhs, info);
-    gen_expr(node->rhs, info);
-    store();
-    return;
-  case ND_VAR:
-    gen_addr(node, info);
-    load();
-    return;
-  case ND_DEREF:
-    gen_expr(node->lhs, info);
-    load();
-    return;
-  case ND_ADDR:
-    gen_addr(node->lhs, info);
-    return;
-  case ND_NUM:
-    emit("push %ld", node->val);
-    return;
-  case ND_FUNCALL:
-    seq = sequence();
-    gen_args(node->args, info);
-    // rspを16の倍数に揃える
-    //   判別
-    emit("mov rax, rsp");
-    emit("and rax, 15");
-    emit("jnz .L.noalign_%s%d", info->name, seq);
-    //   揃っているとき
-    emit("call %s", node->name);
-    emit("jmp .L.end_%s%d", info->name, seq);
-    //   揃っていなかったとき
-    emit(".L.noalign_%s%d:", info->name, seq);
-    emit("sub rsp, 8");
-    emit("call %s", node->name);
-    emit("add rsp, 8");
-    // finish
-    emit(".L.end_%s%d:", info->name, seq);
-    emit("push rax");
+// --profile-useのとき辺の通過回数を返す。不明なら-1
+static long edge_count(GenInfo *info, const char *kind, int site, const char *edge) {
+  if (!opt_profile_use) {
+    return -1;
+  }
+  char *name = edge_name(info, kind, site, edge);
+  long count = profile_count(name);
+  free(name);
+  return count;
+}
+
+// countがotherに比べてほとんど実行されていないか
+static bool is_cold(long count, long other) {
+  return 0 <= count && 0 < other && count * COLD_RATIO <= other;
+}
+
+// 文の最後がreturnか(ブロックなら最後の文をたどる)
+static bool ends_with_return(NodeId id) {
+  while (id) {
+    Node *node = node_at(id);
+    if (node->kind == ND_RETURN) {
+      return true;
+    }
+    if (node->kind != ND_BLOCK) {
+      return false;
+    }
+    for (id = node->body; id && node_at(id)->next; id = node_at(id)->next) {
+    }
+  }
+  return false;
+}
+
+// プロファイルがないときの静的な分岐予測。returnで抜けるだけの分岐は通りにくい
+// (早期リターンやエラー処理)とみなし、回数の代わりに0と1を返す。
+// ループの back edge は通りやすいものとして、ループはもともと本体を続けて並べている
+static void predict_if(Node *node, long *nthen, long *nels) {
+  if (!pass_enabled("split-cold-blocks") || 0 <= *nthen || 0 <= *nels) {
     return;
   }
+  bool then_returns = ends_with_return(node->then);
+  bool els_returns = ends_with_return(node->els);
+  if (then_returns != els_returns) {
+    *nthen = !then_returns;
+    *nels = !els_returns;
+    pass_count("split-cold-blocks", 1);
+  }
+}
 
-  gen_expr(node->lhs, info);
-  gen_expr(node->rhs, info);
+// 一時値を積む。レッドゾーンのときはpushの代わりにrspより下へ書く
+static void push(GenInfo *info, const char *reg) {
+  info->depth++;
+  if (info->frame == FRAME_RED_ZONE) {
+    emit("mov qword ptr [rsp-%d], %s", info->stack_size + info->depth * 8, reg);
+  }
+  else {
+    emit("push %s", reg);
+  }
+}
 
-  emit("pop rdi");
-  emit("pop rax");
+static void pop(GenInfo *info, const char *reg) {
+  if (info->frame == FRAME_RED_ZONE) {
+    emit("mov %s, [rsp-%d]", reg, info->stack_size + info->depth * 8);
+  }
+  else {
+    emit("pop %s", reg);
+  }
+  info->depth--;
+}
 
-  switch (node->kind) {
-  case ND_ADD:
-    emit("add rax, rdi");
+// ローカル変数のメモリオペランド
+static char *local_operand(GenInfo *info, int offset) {
+  static char buf[32];
+  switch (info->frame) {
+  case FRAME_RBP:
+    snprintf(buf, sizeof(buf), "[rbp-%d]", offset);
     break;
-  case ND_SUB:
-    emit("sub rax, rdi");
+  case FRAME_RSP:
+    snprintf(buf, sizeof(buf), "[rsp+%d]", info->stack_size - offset + info->depth * 8);
     break;
-  case ND_MUL:
-    emit("imul rax, rdi");
+  case FRAME_RED_ZONE:
+    snprintf(buf, sizeof(buf), "[rsp-%d]", offset);
     break;
-  case ND_DIV:
+  }
+  return buf;
+}
+
+////////////////////////////////////////////////////////////////
+// 命令選択
+//
+// 式の木を、x86のオペランドの形(即値、メモリ、lea)を使うパターンで覆う(BURS)。
+// まず帰りがけに各ノードを非終端記号ごとの最小コストで覆う規則を求め、
+// 次に根から選んだ規則どおりにコードを出す。値はraxに求め、
+// 両方の子を評価する規則だけが左の値を一時的に積む。
+// 副作用の順番を保つため、評価する子は常に左から。左をオペランドのまま残して
+// 右だけを評価する規則は、左が即値か、左が変数で右に代入や呼び出しがないときだけ使う。
+
+typedef enum {
+  NT_NONE,
+  NT_REG,                       // raxの値
+  NT_IMM,                       // 32ビットの即値
+  NT_MEM,                       // ローカル変数のメモリオペランド
+  NT_LEA,                       // ローカル変数のアドレス(leaのオペランド)
+  NT_PTR,                       // lvalueのアドレスをraxに
+  NT_COND,                      // フラグ(条件はinfo->cc)
+  NT_VOID,                      // 値を使わない
+  NT_COUNT,
+} Nonterm;
+
+typedef enum {
+  // 連鎖規則
+  R_REG_IMM, R_REG_MEM, R_REG_LEA, R_REG_COND, R_COND_REG, R_COND_MEM, R_VOID_REG,
+  // 葉と単項
+  R_IMM_NUM, R_REG_NUM, R_MEM_VAR, R_LEA_ADDR, R_MEM_DEREF, R_PTR_DEREF, R_LOAD, R_ADDR_PTR,
+  R_CALL,
+  // 算術: 右が即値、右がメモリ、両方レジスタ、左が即値、左がメモリ
+  R_OP_RI, R_OP_RM, R_OP_RR, R_OP_IR, R_OP_MR,
+  R_MUL_SHL, R_MUL_LEA,
+  R_DIV_RI, R_DIV_RM, R_DIV_RR,
+  // 比較
+  R_CMP_RI, R_CMP_RM, R_CMP_MI, R_CMP_IR, R_CMP_IM, R_CMP_MR, R_CMP_RR,
+  // 代入
+  R_STORE_IMM, R_STORE_IMM_VALUE, R_STORE, R_STORE_PTR, R_RMW_IMM, R_RMW_REG,
+} RuleId;
+
+typedef struct Rule Rule;
+struct Rule {
+  RuleId id;
+  Nonterm nt;                   // 覆った結果
+  bool chain;                   // kids[0]からntへの連鎖規則
+  NodeKind kind;
+  Nonterm kids[2];              // lhs(単項ならその子)とrhsに求める非終端記号
+  int cost;
+  int (*extra)(Node *node, const Rule *rule);  // 追加のコスト。使えなければCOST_MAX
+};
+
+#define COST_MAX 0x3fffffff
+
+typedef struct Label {
+  int cost[NT_COUNT];
+  short rule[NT_COUNT];         // rules[]の添字
+  Nonterm goal;                 // 親が求めた非終端記号
+  bool pure;                    // 代入も呼び出しも含まない
+} Label;
+
+static Label *labels;
+static int nlabels;
+
+static int fits_imm(Node *node, const Rule *rule) {
+  return node->val == (int)node->val ? 0 : COST_MAX;
+}
+
+static int rhs_pure(Node *node, const Rule *rule) {
+  return labels[node->rhs].pure ? 0 : COST_MAX;
+}
+
+// 即値の側の子
+static Node *imm_kid(Node *node, const Rule *rule) {
+  return node_at(rule->kids[0] == NT_IMM ? node->lhs : node->rhs);
+}
+
+static int shl_ok(Node *node, const Rule *rule) {
+  long val = imm_kid(node, rule)->val;
+  return val == 2 || val == 4 || val == 8 ? 0 : COST_MAX;
+}
+
+static int lea_ok(Node *node, const Rule *rule) {
+  long val = imm_kid(node, rule)->val;
+  return val == 3 || val == 5 || val == 9 ? 0 : COST_MAX;
+}
+
+// x = x + y の形(yは即値なら即値、そうでなければ副作用のない式)
+static int rmw_cost(Node *node, bool imm) {
+  Node *lhs = node_at(node->lhs), *rhs = node_at(node->rhs);
+  if (lhs->kind != ND_VAR || (rhs->kind != ND_ADD && rhs->kind != ND_SUB)) {
+    return COST_MAX;
+  }
+  Node *x = node_at(rhs->lhs), *y = node_at(rhs->rhs);
+  if (x->kind != ND_VAR || x->var != lhs->var) {
+    return COST_MAX;
+  }
+  if (imm) {
+    return y->kind == ND_NUM && y->val == (int)y->val ? 0 : COST_MAX;
+  }
+  return labels[rhs->rhs].pure ? labels[rhs->rhs].cost[NT_REG] : COST_MAX;
+}
+
+static int rmw_imm(Node *node, const Rule *rule) {
+  return rmw_cost(node, true);
+}
+
+static int rmw_reg(Node *node, const Rule *rule) {
+  return rmw_cost(node, false);
+}
+
+#define ARITH(rule, kid0, kid1, cost_add, cost_mul, extra)      \
+  {rule, NT_REG, false, ND_ADD, {kid0, kid1}, cost_add, extra}, \
+  {rule, NT_REG, false, ND_SUB, {kid0, kid1}, cost_add, extra}, \
+  {rule, NT_REG, false, ND_MUL, {kid0, kid1}, cost_mul, extra}
+#define COMPARE(rule, kid0, kid1, cost, extra)                  \
+  {rule, NT_COND, false, ND_EQ, {kid0, kid1}, cost, extra},     \
+  {rule, NT_COND, false, ND_NE, {kid0, kid1}, cost, extra},     \
+  {rule, NT_COND, false, ND_LT, {kid0, kid1}, cost, extra},     \
+  {rule, NT_COND, false, ND_LE, {kid0, kid1}, cost, extra}
+
+// コストはおおよその命令数(imulは3、idivは20)
+static const Rule rules[] = {
+  {R_REG_IMM, NT_REG, true, 0, {NT_IMM}, 1},
+  {R_REG_MEM, NT_REG, true, 0, {NT_MEM}, 1},
+  {R_REG_LEA, NT_REG, true, 0, {NT_LEA}, 1},
+  {R_REG_COND, NT_REG, true, 0, {NT_COND}, 2},
+  {R_COND_REG, NT_COND, true, 0, {NT_REG}, 1},
+  {R_COND_MEM, NT_COND, true, 0, {NT_MEM}, 1},
+  {R_VOID_REG, NT_VOID, true, 0, {NT_REG}, 0},
+
+  {R_IMM_NUM, NT_IMM, false, ND_NUM, {NT_NONE}, 0, fits_imm},
+  {R_REG_NUM, NT_REG, false, ND_NUM, {NT_NONE}, 1},
+  {R_MEM_VAR, NT_MEM, false, ND_VAR, {NT_NONE}, 0},
+  {R_LEA_ADDR, NT_LEA, false, ND_ADDR, {NT_MEM}, 0},
+  {R_MEM_DEREF, NT_MEM, false, ND_DEREF, {NT_LEA}, 0},
+  {R_PTR_DEREF, NT_PTR, false, ND_DEREF, {NT_REG}, 0},
+  {R_LOAD, NT_REG, false, ND_DEREF, {NT_REG}, 1},
+  {R_ADDR_PTR, NT_REG, false, ND_ADDR, {NT_PTR}, 0},
+  {R_CALL, NT_REG, false, ND_FUNCALL, {NT_NONE}, 10},
+
+  ARITH(R_OP_RI, NT_REG, NT_IMM, 1, 3, NULL),
+  ARITH(R_OP_RM, NT_REG, NT_MEM, 1, 3, NULL),
+  ARITH(R_OP_RR, NT_REG, NT_REG, 3, 5, NULL),
+  ARITH(R_OP_IR, NT_IMM, NT_REG, 2, 3, NULL),
+  ARITH(R_OP_MR, NT_MEM, NT_REG, 2, 3, rhs_pure),
+  {R_MUL_SHL, NT_REG, false, ND_MUL, {NT_REG, NT_IMM}, 1, shl_ok},
+  {R_MUL_SHL, NT_REG, false, ND_MUL, {NT_IMM, NT_REG}, 1, shl_ok},
+  {R_MUL_LEA, NT_REG, false, ND_MUL, {NT_REG, NT_IMM}, 1, lea_ok},
+  {R_MUL_LEA, NT_REG, false, ND_MUL, {NT_IMM, NT_REG}, 1, lea_ok},
+  {R_DIV_RI, NT_REG, false, ND_DIV, {NT_REG, NT_IMM}, 22},
+  {R_DIV_RM, NT_REG, false, ND_DIV, {NT_REG, NT_MEM}, 21},
+  {R_DIV_RR, NT_REG, false, ND_DIV, {NT_REG, NT_REG}, 24},
+
+  COMPARE(R_CMP_RI, NT_REG, NT_IMM, 1, NULL),
+  COMPARE(R_CMP_RM, NT_REG, NT_MEM, 1, NULL),
+  COMPARE(R_CMP_MI, NT_MEM, NT_IMM, 1, NULL),
+  COMPARE(R_CMP_IR, NT_IMM, NT_REG, 1, NULL),
+  COMPARE(R_CMP_IM, NT_IMM, NT_MEM, 1, NULL),
+  COMPARE(R_CMP_MR, NT_MEM, NT_REG, 1, rhs_pure),
+  COMPARE(R_CMP_RR, NT_REG, NT_REG, 3, NULL),
+
+  {R_STORE_IMM, NT_VOID, false, ND_ASSIGN, {NT_MEM, NT_IMM}, 1},
+  {R_STORE_IMM_VALUE, NT_REG, false, ND_ASSIGN, {NT_MEM, NT_IMM}, 2},
+  {R_STORE, NT_REG, false, ND_ASSIGN, {NT_MEM, NT_REG}, 1},
+  {R_STORE_PTR, NT_REG, false, ND_ASSIGN, {NT_PTR, NT_REG}, 3},
+  {R_RMW_IMM, NT_VOID, false, ND_ASSIGN, {NT_MEM, NT_NONE}, 1, rmw_imm},
+  {R_RMW_REG, NT_VOID, false, ND_ASSIGN, {NT_MEM, NT_NONE}, 1, rmw_reg},
+};
+
+#define NRULES ((int)(sizeof(rules) / sizeof(*rules)))
+
+// 帰りがけに、子の結果から各非終端記号の最小コストの規則を求める
+static void label_node(NodeId id, void *ctx) {
+  Node *node = node_at(id);
+  Label *lb = &labels[id];
+  NodeId kids[2] = {node->lhs, node->rhs};
+  if (node->kind == ND_DEREF || node->kind == ND_ADDR) {
+    kids[1] = 0;
+  }
+  if (node->kind == ND_NUM || node->kind == ND_VAR || node->kind == ND_FUNCALL) {
+    kids[0] = kids[1] = 0;
+  }
+
+  lb->pure = node->kind != ND_ASSIGN && node->kind != ND_FUNCALL;
+  for (int i = 0; i < 2; i++) {
+    if (kids[i]) {
+      lb->pure &= labels[kids[i]].pure;
+    }
+  }
+  for (int nt = 0; nt < NT_COUNT; nt++) {
+    lb->cost[nt] = COST_MAX;
+  }
+
+  for (int i = 0; i < NRULES; i++) {
+    const Rule *r = &rules[i];
+    if (r->chain || r->kind != node->kind) {
+      continue;
+    }
+    int cost = r->cost;
+    for (int j = 0; j < 2 && cost < COST_MAX; j++) {
+      if (r->kids[j] != NT_NONE) {
+        cost = kids[j] ? cost + labels[kids[j]].cost[r->kids[j]] : COST_MAX;
+      }
+    }
+    if (r->extra && cost < COST_MAX) {
+      int extra = r->extra(node, r);
+      cost = extra < COST_MAX ? cost + extra : COST_MAX;
+    }
+    if (cost < lb->cost[r->nt]) {
+      lb->cost[r->nt] = cost;
+      lb->rule[r->nt] = i;
+    }
+  }
+
+  // 連鎖規則は変化がなくなるまで
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < NRULES; i++) {
+      const Rule *r = &rules[i];
+      if (r->chain && lb->cost[r->kids[0]] < COST_MAX &&
+          lb->cost[r->kids[0]] + r->cost < lb->cost[r->nt]) {
+        lb->cost[r->nt] = lb->cost[r->kids[0]] + r->cost;
+        lb->rule[r->nt] = i;
+        changed = true;
+      }
+    }
+  }
+
+  if (lb->cost[NT_REG] == COST_MAX && lb->cost[NT_VOID] == COST_MAX) {
+    if (node->kind == ND_ASSIGN || node->kind == ND_ADDR) {
+      error_tok(node_at(node->lhs)->tok, "lvalueではありません");
+    }
+    error_tok(node->tok, "invalid expression");
+  }
+}
+
+static void label_tree(NodeId id) {
+  if (nlabels <= node_count()) {
+    nlabels = node_count() + 1;
+    labels = realloc(labels, sizeof(Label) * nlabels);
+  }
+  visit_nodes(id, NULL, label_node, NULL);
+}
+
+// ND_VAR, *&x, &xのもとになる変数のメモリオペランド
+static char *mem_operand(GenInfo *info, NodeId id) {
+  Node *node = node_at(id);
+  while (node->kind != ND_VAR) {
+    node = node_at(node->lhs);
+  }
+  return local_operand(info, node->var->offset);
+}
+
+// 即値かメモリの子をオペランドにする
+static char *operand(GenInfo *info, NodeId id, Nonterm nt) {
+  static char buf[32];
+  if (nt == NT_IMM) {
+    snprintf(buf, sizeof(buf), "%ld", node_at(id)->val);
+    return buf;
+  }
+  return mem_operand(info, id);
+}
+
+static const char *arith_insn(NodeKind kind) {
+  return kind == ND_ADD ? "add" : kind == ND_SUB ? "sub" : "imul";
+}
+
+// 比較の条件コード。swapなら左右を入れ替えて比べたとき
+static char *compare_cc(NodeKind kind, bool swap) {
+  switch (kind) {
+  case ND_EQ:
+    return "e";
+  case ND_NE:
+    return "ne";
+  case ND_LT:
+    return swap ? "g" : "l";
+  default:
+    return swap ? "ge" : "le";
+  }
+}
+
+// 子を評価し終えたあとの規則の本体。2つの子を評価した規則では左がrdi、右がraxにある
+static void emit_rule(Node *node, const Rule *r, GenInfo *info) {
+  NodeId lhs = node->lhs, rhs = node->rhs;
+  switch (r->id) {
+  case R_REG_NUM:
+    emit("mov rax, %ld", node->val);
+    break;
+  case R_LOAD:
+    emit("mov rax, [rax]");
+    break;
+  case R_OP_RI:
+  case R_OP_RM:
+    if (node->kind == ND_MUL && r->kids[1] == NT_IMM) {
+      emit("imul rax, rax, %s", operand(info, rhs, NT_IMM));
+    }
+    else {
+      emit("%s rax, %s", arith_insn(node->kind), operand(info, rhs, r->kids[1]));
+    }
+    break;
+  case R_OP_IR:
+  case R_OP_MR:
+    if (node->kind == ND_SUB) {
+      emit("neg rax");
+      emit("add rax, %s", operand(info, lhs, r->kids[0]));
+    }
+    else if (node->kind == ND_MUL && r->kids[0] == NT_IMM) {
+      emit("imul rax, rax, %s", operand(info, lhs, NT_IMM));
+    }
+    else {
+      emit("%s rax, %s", arith_insn(node->kind), operand(info, lhs, r->kids[0]));
+    }
+    break;
+  case R_OP_RR:
+    if (node->kind == ND_SUB) {
+      emit("sub rdi, rax");
+      emit("mov rax, rdi");
+    }
+    else {
+      emit("%s rax, rdi", arith_insn(node->kind));
+    }
+    break;
+  case R_MUL_SHL:
+    emit("shl rax, %d", __builtin_ctzl(imm_kid(node, r)->val));
+    break;
+  case R_MUL_LEA:
+    emit("lea rax, [rax+rax*%ld]", imm_kid(node, r)->val - 1);
+    break;
+  case R_DIV_RI:
+    emit("mov rdi, %s", operand(info, rhs, NT_IMM));
     emit("cqo");
     emit("idiv rdi");
     break;
-  case ND_EQ:
-    emit("cmp rax, rdi");
-    emit("sete al");
-    emit("movzb rax, al");
+  case R_DIV_RM:
+    emit("cqo");
+    emit("idiv qword ptr %s", operand(info, rhs, NT_MEM));
     break;
-  case ND_NE:
-    emit("cmp rax, rdi");
-    emit("setne al");
-    emit("movzb rax, al");
+  case R_DIV_RR:
+    emit("cqo");
+    emit("idiv rdi");
     break;
-  case ND_LT:
-    emit("cmp rax, rdi");
-    emit("setl al");
-    emit("movzb rax, al");
+  case R_CMP_RI:
+  case R_CMP_RM:
+    emit("cmp rax, %s", operand(info, rhs, r->kids[1]));
+    info->cc = compare_cc(node->kind, false);
+    break;
+  case R_CMP_MI:
+    emit("cmp qword ptr %s, %s", mem_operand(info, lhs), operand(info, rhs, NT_IMM));
+    info->cc = compare_cc(node->kind, false);
+    break;
+  case R_CMP_IR:
+    emit("cmp rax, %s", operand(info, lhs, NT_IMM));
+    info->cc = compare_cc(node->kind, true);
+    break;
+  case R_CMP_IM:
+    emit("cmp qword ptr %s, %s", mem_operand(info, rhs), operand(info, lhs, NT_IMM));
+    info->cc = compare_cc(node->kind, true);
+    break;
+  case R_CMP_MR:
+    emit("cmp %s, rax", mem_operand(info, lhs));
+    info->cc = compare_cc(node->kind, false);
+    break;
+  case R_CMP_RR:
+    emit("cmp rdi, rax");
+    info->cc = compare_cc(node->kind, false);
+    break;
+  case R_STORE_IMM:
+  case R_STORE_IMM_VALUE:
+    emit("mov qword ptr %s, %s", mem_operand(info, lhs), operand(info, rhs, NT_IMM));
+    if (r->id == R_STORE_IMM_VALUE) {
+      emit("mov rax, %s", operand(info, rhs, NT_IMM));
+    }
+    break;
+  case R_STORE:
+    emit("mov %s, rax", mem_operand(info, lhs));
+    break;
+  case R_STORE_PTR:
+    emit("mov [rdi], rax");
+    break;
+  case R_RMW_IMM:
+    emit("%s qword ptr %s, %s", arith_insn(node_at(rhs)->kind), mem_operand(info, lhs),
+         operand(info, node_at(rhs)->rhs, NT_IMM));
+    break;
+  case R_RMW_REG:
+    emit("%s %s, rax", arith_insn(node_at(rhs)->kind), mem_operand(info, lhs));
     break;
-  case ND_LE:
-    emit("cmp rax, rdi");
-    emit("setle al");
+  default:
+    // 葉の即値やメモリ、アドレスをそのまま渡す規則は何も出さない
+    break;
+  }
+}
+
+// 連鎖規則で、同じノードの別の非終端記号から移す
+static void emit_chain(NodeId id, const Rule *r, GenInfo *info) {
+  switch (r->id) {
+  case R_REG_IMM:
+  case R_REG_MEM:
+    emit("mov rax, %s", operand(info, id, r->kids[0]));
+    break;
+  case R_REG_LEA:
+    emit("lea rax, %s", mem_operand(info, id));
+    break;
+  case R_REG_COND:
+    emit("set%s al", info->cc);
     emit("movzb rax, al");
     break;
+  case R_COND_REG:
+    emit("cmp rax, 0");
+    info->cc = "ne";
+    break;
+  case R_COND_MEM:
+    emit("cmp qword ptr %s, 0", mem_operand(info, id));
+    info->cc = "ne";
+    break;
   default:
-    walk(node);
-    error_tok(node->tok, "invalid expression");
+    break;
   }
-  emit("push rax");
 }
 
-static void gen_stmt(Node *node, GenInfo *info) {
-  int seq;
+static int gen_funcall(Traversal *t, Node *node, int state, GenInfo *info);
+
+// 子をntとして評価する
+static void reduce_child(Traversal *t, NodeId id, Nonterm nt) {
+  labels[id].goal = nt;
+  traverse_child(t, id);
+}
+
+static int reduce_step(Traversal *t, NodeId id, int state, void *ctx) {
+  GenInfo *info = ctx;
+  Node *node = node_at(id);
+  Label *lb = &labels[id];
+
+  // 連鎖規則をさかのぼって、このノードの形に合う規則を求める
+  const Rule *chain[NT_COUNT];
+  int nchain = 0;
+  const Rule *r = &rules[lb->rule[lb->goal]];
+  while (r->chain) {
+    chain[nchain++] = r;
+    r = &rules[lb->rule[r->kids[0]]];
+  }
+
+  if (r->id == R_CALL) {
+    if ((state = gen_funcall(t, node, state, info)) != VISIT_DONE) {
+      return state;
+    }
+  }
+  else {
+    // raxに求める子(左から順)
+    NodeId eval[2];
+    Nonterm nts[2];
+    int neval = 0;
+    if (r->id == R_RMW_REG) {
+      eval[neval] = node_at(node->rhs)->rhs;
+      nts[neval++] = NT_REG;
+    }
+    else {
+      NodeId kids[2] = {node->lhs, node->rhs};
+      for (int i = 0; i < 2; i++) {
+        if (r->kids[i] == NT_REG || r->kids[i] == NT_PTR) {
+          eval[neval] = kids[i];
+          nts[neval++] = r->kids[i];
+        }
+      }
+    }
+    if (state < neval) {
+      if (state == 1) {
+        push(info, "rax");
+      }
+      reduce_child(t, eval[state], nts[state]);
+      return state + 1;
+    }
+    if (neval == 2 && r->id == R_DIV_RR) {
+      emit("mov rdi, rax");
+      pop(info, "rax");
+    }
+    else if (neval == 2) {
+      pop(info, "rdi");
+    }
+    emit_rule(node, r, info);
+  }
+
+  for (int i = nchain - 1; 0 <= i; i--) {
+    emit_chain(id, chain[i], info);
+  }
+  return VISIT_DONE;
+}
+
+// 式をntとして評価する
+static void gen_tree(NodeId id, Nonterm nt, GenInfo *info) {
+  label_tree(id);
+  labels[id].goal = nt;
+  traverse(id, reduce_step, info);
+}
+
+// 式の値をraxに求める
+static void gen_expr(NodeId id, GenInfo *info) {
+  gen_tree(id, NT_REG, info);
+}
+
+// 値を使わない式
+static void gen_void(NodeId id, GenInfo *info) {
+  gen_tree(id, NT_VOID, info);
+}
+
+// 条件式を評価してフラグを立て、真のときの条件コードを返す
+static char *gen_cond(NodeId id, GenInfo *info) {
+  gen_tree(id, NT_COND, info);
+  return info->cc;
+}
+
+////////////////////////////////////////////////////////////////
+// 関数呼び出し
+//
+// 定数・変数・変数のアドレスの引数は、ほかの引数を評価し終えてから
+// argregへ直接読む。それ以外の引数は左から順に評価し、あとに関数呼び出しが
+// 残っていればスタックに積んだまま、なければレジスタに置いておく。
+// 7個目以降の引数は、最初に確保した領域へ評価するたびに書き込む。
+
+// 式の評価で壊れるレジスタ(rax, rdi: 二項演算と代入, rdx: idiv)以外から
+// 一時的な置き場所を選ぶ
+static char *homereg[] = {"r10", "r11", "rsi", "rcx", "r8", "r9", "rdi", "rdx"};
+#define NHOMEREG ((int)(sizeof(homereg) / sizeof(*homereg)))
+
+typedef struct ArgPlan {
+  NodeId id;
+  Node *node;
+  bool simple;                  // 命令1つでレジスタに読める
+  bool deferred;                // ほかの引数のあとでargregへ直接読む
+  bool kept;                    // あとの呼び出しで壊れるので積んだままにする
+  char *home;                   // 評価した値を置いておくレジスタ
+} ArgPlan;
+
+typedef struct CallPlan {
+  int nargs;
+  int nstack;                   // スタックで渡す引数の数
+  int area;                     // 呼び出しの前に確保するスロット数(詰め物を含む)
+  int base;                     // 確保したあとのinfo->depth
+  ArgPlan args[];
+} CallPlan;
+
+typedef struct ArgScan {
+  NodeId root;
+  bool call;
+  bool effect;                  // 代入や呼び出しで変数を書き換えうる
+} ArgScan;
+
+static int scan_arg(Traversal *t, NodeId id, int state, void *ctx) {
+  ArgScan *scan = ctx;
+  // 後ろに続く引数は見ない。呼び出しが見つかればそれ以上調べることはない
+  // (入れ子の呼び出しで引数を何度も見直さないように)
+  if ((traverse_level(t) == 0 && id != scan->root) || scan->call) {
+    return VISIT_DONE;
+  }
+  Node *node = node_at(id);
+  if (node->kind == ND_FUNCALL) {
+    scan->call = scan->effect = true;
+    return VISIT_DONE;
+  }
+  else if (node->kind == ND_ASSIGN) {
+    scan->effect = true;
+  }
+  NodeId kids[4];
+  int n = node_children(node, kids);
+  for (int i = 0; i < n; i++) {
+    traverse_list(t, kids[i]);
+  }
+  return VISIT_DONE;
+}
+
+static bool is_simple_arg(Node *node) {
+  return node->kind == ND_NUM || node->kind == ND_VAR ||
+    (node->kind == ND_ADDR && node_at(node->lhs)->kind == ND_VAR);
+}
+
+// 単純な引数をregに読む
+static void gen_simple_arg(GenInfo *info, Node *node, const char *reg) {
   switch (node->kind) {
-  case ND_RETURN:
-    gen_expr(node->lhs, info);
-    emit("pop rax");
-    emit("jmp .L.return_%s", info->name);
+  case ND_NUM:
+    emit("mov %s, %ld", reg, node->val);
     break;
-  case ND_EXPR_STMT:
-    gen_expr(node->lhs, info);
-    emit("add rsp, 8");
+  case ND_VAR:
+    emit("mov %s, %s", reg, local_operand(info, node->var->offset));
     break;
-  case ND_IF:
-    gen_expr(node->cond, info);
-    emit("pop rax");
-    emit("cmp rax, 0");
+  default:
+    emit("lea %s, %s", reg, local_operand(info, node_at(node->lhs)->var->offset));
+    break;
+  }
+}
+
+static bool reg_in(const char *reg, char **regs, int n) {
+  for (int i = 0; i < n; i++) {
+    if (regs[i] && !strcmp(regs[i], reg)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 引数ごとに、いつどこへ評価するかを決める
+static CallPlan *plan_call(Node *node) {
+  int nargs = 0;
+  for (NodeId arg = node->args; arg; arg = node_at(arg)->next) {
+    nargs++;
+  }
+  CallPlan *plan = calloc(1, sizeof(CallPlan) + sizeof(ArgPlan) * nargs);
+  plan->nargs = nargs;
+  plan->nstack = nargreg < nargs ? nargs - nargreg : 0;
+
+  bool effect[nargs + 1], call[nargs + 1];
+  int i = 0;
+  for (NodeId arg = node->args; arg; arg = node_at(arg)->next, i++) {
+    ArgScan scan = {arg};
+    traverse(arg, scan_arg, &scan);
+    plan->args[i].id = arg;
+    plan->args[i].node = node_at(arg);
+    plan->args[i].simple = is_simple_arg(node_at(arg));
+    effect[i] = scan.effect;
+    call[i] = scan.call;
+  }
+
+  // 後ろから見て、あとに書き換えや呼び出し、複雑な式の評価が残っているか
+  bool later_effect = false, later_call = false, later_complex = false;
+  char *used[NHOMEREG + nargreg];
+  int nused = 0;
+  for (i = nargs - 1; 0 <= i; i--) {
+    ArgPlan *a = &plan->args[i];
+    if (i < nargreg) {
+      a->deferred = a->simple && (a->node->kind != ND_VAR || !later_effect);
+      a->kept = !a->deferred && later_call;
+    }
+    later_effect |= effect[i];
+    later_call |= call[i];
+  }
+  for (i = 0; i < nargs && i < nargreg; i++) {
+    if (plan->args[i].kept) {
+      used[nused++] = argreg[i];
+    }
+  }
+  for (i = nargs - 1; 0 <= i; i--) {
+    ArgPlan *a = &plan->args[i];
+    if (i < nargreg && !a->deferred && !a->kept) {
+      // 自分のレジスタを第一候補に、あとの評価で壊れないところ
+      char *cand[NHOMEREG + 1] = {argreg[i]};
+      memcpy(cand + 1, homereg, sizeof(homereg));
+      for (int j = 0; j <= NHOMEREG && !a->home; j++) {
+        if (reg_in(cand[j], used, nused) ||
+            (later_complex && (!strcmp(cand[j], "rdi") || !strcmp(cand[j], "rdx")))) {
+          continue;
+        }
+        a->home = cand[j];
+      }
+      assert(a->home);
+      used[nused++] = a->home;
+    }
+    if (!a->deferred && !a->simple) {
+      later_complex = true;
+    }
+  }
+  return plan;
+}
+
+// srcからdstへの転送をまとめて行う。互いに読み書きが循環していればraxを使う
+static void gen_parallel_moves(char **src, char **dst, int n) {
+  bool done[n];
+  memset(done, 0, sizeof(done));
+  for (int left = n; left;) {
+    bool progress = false;
+    for (int i = 0; i < n; i++) {
+      if (done[i]) {
+        continue;
+      }
+      bool blocked = false;
+      for (int j = 0; j < n; j++) {
+        if (!done[j] && j != i && !strcmp(src[j], dst[i])) {
+          blocked = true;
+        }
+      }
+      if (blocked) {
+        continue;
+      }
+      if (strcmp(src[i], dst[i])) {
+        emit("mov %s, %s", dst[i], src[i]);
+      }
+      done[i] = true;
+      left--;
+      progress = true;
+    }
+    if (!progress) {
+      // 循環している。1つをraxに逃がして切る
+      for (int i = 0; i < n; i++) {
+        if (!done[i]) {
+          for (int j = 0; j < n; j++) {
+            if (!done[j] && !strcmp(src[j], dst[i])) {
+              emit("mov rax, %s", src[j]);
+              src[j] = "rax";
+            }
+          }
+          break;
+        }
+      }
+    }
+  }
+}
+
+// 評価し終えた引数をしまう
+static void finish_arg(GenInfo *info, CallPlan *plan, int i, bool evaluated) {
+  ArgPlan *a = &plan->args[i];
+  if (nargreg <= i) {
+    if (!evaluated) {
+      gen_simple_arg(info, a->node, "rax");
+    }
+    int slot = plan->base - (i - nargreg);
+    emit("mov [rsp+%d], rax", (info->depth - slot) * 8);
+  }
+  else if (a->kept) {
+    push(info, "rax");
+  }
+  else if (evaluated) {
+    emit("mov %s, rax", a->home);
+  }
+  else {
+    gen_simple_arg(info, a->node, a->home);
+  }
+}
+
+// 引数をレジスタに揃えて呼ぶ
+static void gen_call(Node *node, GenInfo *info, CallPlan *plan) {
+  int n = plan->nargs < nargreg ? plan->nargs : nargreg;
+  for (int i = n - 1; 0 <= i; i--) {
+    if (plan->args[i].kept) {
+      pop(info, argreg[i]);
+    }
+  }
+  char *src[nargreg], *dst[nargreg];
+  int nmoves = 0;
+  for (int i = 0; i < n; i++) {
+    if (plan->args[i].home) {
+      src[nmoves] = plan->args[i].home;
+      dst[nmoves++] = argreg[i];
+    }
+  }
+  gen_parallel_moves(src, dst, nmoves);
+  for (int i = 0; i < n; i++) {
+    if (plan->args[i].deferred) {
+      gen_simple_arg(info, plan->args[i].node, argreg[i]);
+    }
+  }
 
-    if (node->els) {
-      seq = sequence();
-      emit("je .L.else_%s%d", info->name, seq);
-      gen_stmt(node->then, info);
+  // rspの16の倍数への揃えは、確保のときにinfo->depthから済ませてある
+  assert(info->depth == plan->base);
+  emit("call %s", node->name);
+  if (plan->area) {
+    emit("add rsp, %d", plan->area * 8);
+    info->depth -= plan->area;
+  }
+}
+
+// locals: 0 CallPlan, 1 評価中の引数
+static int gen_funcall(Traversal *t, Node *node, int state, GenInfo *info) {
+  long *l = traverse_locals(t);
+  CallPlan *plan = (CallPlan *)l[0];
+  int i;
+
+  if (state == 0) {
+    // 関数を呼ぶのはrbpのフレームだけなので、rspの揃い方はinfo->depthからわかる
+    assert(info->frame == FRAME_RBP);
+    plan = plan_call(node);
+    l[0] = (long)plan;
+    plan->area = plan->nstack + (info->stack_size / 8 + info->depth + plan->nstack) % 2;
+    if (plan->area) {
+      emit("sub rsp, %d", plan->area * 8);
+      info->depth += plan->area;
+    }
+    plan->base = info->depth;
+    i = 0;
+  }
+  else {
+    i = l[1];
+    finish_arg(info, plan, i++, true);
+  }
+
+  for (; i < plan->nargs; i++) {
+    ArgPlan *a = &plan->args[i];
+    if (a->deferred) {
+      continue;
+    }
+    if (!a->simple || a->kept) {
+      l[1] = i;
+      reduce_child(t, a->id, NT_REG);
+      return 1;
+    }
+    finish_arg(info, plan, i, false);
+  }
+  gen_call(node, info, plan);
+  free(plan);
+  return VISIT_DONE;
+}
+
+////////////////////////////////////////////////////////////////
+// 文
+//
+// 式と同じくtraverseから状態つきで呼ばれる。入れ子の文は
+// 再帰せずに積んでおき、訪ね終えたら次の状態で続きを出力する。
+
+// ループの先頭をそろえる
+static void align_loop(GenInfo *info) {
+  if (pass_enabled("align-loops") && 1 < opt_align_loops && !emitting_cold(info)) {
+    emit(".p2align %d", __builtin_ctz(opt_align_loops));
+    pass_count("align-loops", 1);
+  }
+}
+
+// ジャンプでしか入らない分岐先をそろえる。直前から落ちてこないので、
+// 詰め物のnopは実行されない
+static void align_jump(GenInfo *info) {
+  if (pass_enabled("align-jumps") && 1 < opt_align_jumps && !emitting_cold(info)) {
+    emit(".p2align %d", __builtin_ctz(opt_align_jumps));
+    pass_count("align-jumps", 1);
+  }
+}
+
+// 分岐先の文を辺のカウンタ付きで出力する
+static void gen_branch(Traversal *t, NodeId id, GenInfo *info, const char *kind, int site, const char *edge) {
+  count_edge(info, kind, site, edge);
+  if (id) {
+    traverse_child(t, id);
+  }
+}
+
+// ifの分岐の並べ方
+typedef enum {
+  IF_COLD_THEN,                 // then節を関数末尾へ追い出す
+  IF_COLD_ELSE,                 // else節を関数末尾へ追い出す
+  IF_ELSE_FIRST,                // else節の方がよく通るのでfall-throughにする
+  IF_THEN_ELSE,
+  IF_THEN_ONLY,
+} IfLayout;
+
+// locals: 0 seq, 1 site, 2 IfLayout, 3 追い出す前の出力先
+static int gen_if(Traversal *t, Node *node, int state, GenInfo *info) {
+  long *l = traverse_locals(t);
+  int seq = l[0], site = l[1];
+  char *cc = NULL;
+
+  if (state == 0) {
+    seq = l[0] = sequence();
+    site = l[1] = info->nsite++;
+    long nthen = edge_count(info, "if", site, "then");
+    long nels = edge_count(info, "if", site, "else");
+    predict_if(node, &nthen, &nels);
+    bool split = !emitting_cold(info);
+    l[2] = split && is_cold(nthen, nels) ? IF_COLD_THEN :
+      split && is_cold(nels, nthen) ? IF_COLD_ELSE :
+      nthen < nels ? IF_ELSE_FIRST :
+      node->els || opt_profile_generate ? IF_THEN_ELSE : IF_THEN_ONLY;
+
+    cc = gen_cond(node->cond, info);
+  }
+
+  switch (l[2]) {
+  case IF_COLD_THEN:
+    switch (state) {
+    case 0:
+      emit("j%s .L.then_%s%d", cc, info->name, seq);
+      gen_branch(t, node->els, info, "if", site, "else");
+      return 1;
+    case 1:
+      emit(".L.end_%s%d:", info->name, seq);
+      l[3] = (long)begin_cold(info);
+      emit(".L.then_%s%d:", info->name, seq);
+      gen_branch(t, node->then, info, "if", site, "then");
+      return 2;
+    default:
       emit("jmp .L.end_%s%d", info->name, seq);
+      end_cold(info, (FILE *)l[3]);
+      return VISIT_DONE;
+    }
+  case IF_COLD_ELSE:
+    switch (state) {
+    case 0:
+      emit("j%s .L.else_%s%d", invert_cc(cc), info->name, seq);
+      gen_branch(t, node->then, info, "if", site, "then");
+      return 1;
+    case 1:
+      emit(".L.end_%s%d:", info->name, seq);
+      l[3] = (long)begin_cold(info);
       emit(".L.else_%s%d:", info->name, seq);
-      gen_stmt(node->els, info);
+      gen_branch(t, node->els, info, "if", site, "else");
+      return 2;
+    default:
+      emit("jmp .L.end_%s%d", info->name, seq);
+      end_cold(info, (FILE *)l[3]);
+      return VISIT_DONE;
+    }
+  case IF_ELSE_FIRST:
+    switch (state) {
+    case 0:
+      emit("j%s .L.then_%s%d", cc, info->name, seq);
+      gen_branch(t, node->els, info, "if", site, "else");
+      return 1;
+    case 1:
+      emit("jmp .L.end_%s%d", info->name, seq);
+      align_jump(info);
+      emit(".L.then_%s%d:", info->name, seq);
+      gen_branch(t, node->then, info, "if", site, "then");
+      return 2;
+    default:
       emit(".L.end_%s%d:", info->name, seq);
+      return VISIT_DONE;
     }
-    else {
-      seq = sequence();
-      emit("je .L.end_%s%d", info->name, seq);
-      gen_stmt(node->then, info);
+  case IF_THEN_ELSE:
+    switch (state) {
+    case 0:
+      emit("j%s .L.else_%s%d", invert_cc(cc), info->name, seq);
+      gen_branch(t, node->then, info, "if", site, "then");
+      return 1;
+    case 1:
+      emit("jmp .L.end_%s%d", info->name, seq);
+      align_jump(info);
+      emit(".L.else_%s%d:", info->name, seq);
+      gen_branch(t, node->els, info, "if", site, "else");
+      return 2;
+    default:
       emit(".L.end_%s%d:", info->name, seq);
+      return VISIT_DONE;
     }
-  case ND_WHILE:
-    seq = sequence();
-    emit(".L.while_%s%d:", info->name, seq);
-    gen_expr(node->cond, info);
-    emit("pop rax");
-    emit("cmp rax, 0");
-    emit("je .L.end_%s%d", info->name, seq);
-    gen_stmt(node->then, info);
-    emit("jmp .L.while_%s%d", info->name, seq);
+  default:
+    if (state == 0) {
+      emit("j%s .L.end_%s%d", invert_cc(cc), info->name, seq);
+      traverse_child(t, node->then);
+      return 1;
+    }
+    emit(".L.end_%s%d:", info->name, seq);
+    return VISIT_DONE;
+  }
+}
+
+// 条件式を評価して、その値がwhenならlabelへ飛ぶ
+static void gen_cond_jump(NodeId cond, GenInfo *info, bool when, const char *label, int seq) {
+  emit_loc(info, node_at(cond)->tok);
+  char *cc = gen_cond(cond, info);
+  emit("j%s .L.%s_%s%d", when ? cc : invert_cc(cc), label, info->name, seq);
+}
+
+// 本体を追い出すほど冷たいループは回転しない
+static bool rotate_loop(GenInfo *info, const char *kind, int site) {
+  if (!pass_enabled("rotate-loops") ||
+      is_cold(edge_count(info, kind, site, "body"), edge_count(info, kind, site, "exit"))) {
+    return false;
+  }
+  pass_count("rotate-loops", 1);
+  return true;
+}
+
+// ループの形
+typedef enum {
+  // 回転したループ。入口で一度だけ条件を調べ、
+  // あとは本体の末尾の条件分岐1つで繰り返す(ガード付きのdo-while)
+  //
+  //     cond; je end
+  //   body:
+  //     then; succ
+  //     cond; jne body
+  //   end:
+  LOOP_ROTATED,
+  LOOP_COLD,                    // 一度も実行されない本体を関数末尾へ追い出す
+  LOOP_NORMAL,
+  LOOP_INFINITE,                // 条件のないfor
+} LoopLayout;
+
+// whileとfor。locals: 0 seq, 1 site, 2 LoopLayout, 3 追い出す前の出力先
+static int gen_loop(Traversal *t, Node *node, int state, GenInfo *info) {
+  long *l = traverse_locals(t);
+  const char *kind = node->kind == ND_WHILE ? "while" : "for";
+  const char *head = node->kind == ND_WHILE ? "while" : "begin";
+  int seq = l[0], site = l[1];
+
+  if (state == 0) {
+    seq = l[0] = sequence();
+    site = l[1] = info->nsite++;
+    if (node->kind == ND_FOR && node->init) {
+      gen_void(node->init, info);
+    }
+
+    if (node->cond && rotate_loop(info, kind, site)) {
+      l[2] = LOOP_ROTATED;
+      gen_cond_jump(node->cond, info, false, "end", seq);
+      align_loop(info);
+      emit(".L.body_%s%d:", info->name, seq);
+      gen_branch(t, node->then, info, kind, site, "body");
+      return 1;
+    }
+
+    align_loop(info);
+    emit(".L.%s_%s%d:", head, info->name, seq);
+    if (!node->cond) {
+      l[2] = LOOP_INFINITE;
+      gen_branch(t, node->then, info, kind, site, "body");
+      return 1;
+    }
+    char *cc = gen_cond(node->cond, info);
+    if (!emitting_cold(info) &&
+        is_cold(edge_count(info, kind, site, "body"), edge_count(info, kind, site, "exit"))) {
+      l[2] = LOOP_COLD;
+      emit("j%s .L.body_%s%d", cc, info->name, seq);
+      l[3] = (long)begin_cold(info);
+      emit(".L.body_%s%d:", info->name, seq);
+    }
+    else {
+      l[2] = LOOP_NORMAL;
+      emit("j%s .L.end_%s%d", invert_cc(cc), info->name, seq);
+    }
+    gen_branch(t, node->then, info, kind, site, "body");
+    return 1;
+  }
+
+  // 本体のあと
+  if (node->kind == ND_FOR && node->succ) {
+    gen_void(node->succ, info);
+  }
+  switch (l[2]) {
+  case LOOP_ROTATED:
+    gen_cond_jump(node->cond, info, true, "body", seq);
     emit(".L.end_%s%d:", info->name, seq);
     break;
-  case ND_FOR:
-    seq = sequence();
-    if (node->init) {
-      gen_expr(node->init, info);
-    }
-    emit(".L.begin_%s%d:", info->name, seq);
-    if (node->cond) {
-      gen_expr(node->cond, info);
-      emit("pop rax");
-      emit("cmp rax, 0");
-      emit("je .L.end_%s%d", info->name, seq);
-      gen_stmt(node->then, info);
-    }
-    if (node->succ) {
-      gen_expr(node->succ, info);
-    }
-    emit("jmp .L.begin_%s%d", info->name, seq);
+  case LOOP_COLD:
+    emit("jmp .L.%s_%s%d", head, info->name, seq);
+    end_cold(info, (FILE *)l[3]);
+    break;
+  case LOOP_NORMAL:
+    emit("jmp .L.%s_%s%d", head, info->name, seq);
+    align_jump(info);
     emit(".L.end_%s%d:", info->name, seq);
     break;
+  default:
+    emit("jmp .L.%s_%s%d", head, info->name, seq);
+    return VISIT_DONE;
+  }
+  count_edge(info, kind, site, "exit");
+  return VISIT_DONE;
+}
+
+static int gen_stmt_step(Traversal *t, NodeId id, int state, void *ctx) {
+  GenInfo *info = ctx;
+  Node *node = node_at(id);
+  if (state == 0 && node->kind != ND_BLOCK && node->kind != ND_NOP) {
+    emit_loc(info, node->tok);
+  }
+  switch (node->kind) {
+  case ND_RETURN:
+    gen_expr(node->lhs, info);
+    emit("jmp .L.return_%s", info->name);
+    return VISIT_DONE;
+  case ND_EXPR_STMT:
+    gen_void(node->lhs, info);
+    return VISIT_DONE;
+  case ND_IF:
+    return gen_if(t, node, state, info);
+  case ND_WHILE:
+  case ND_FOR:
+    return gen_loop(t, node, state, info);
   case ND_BLOCK:
-    for (Node *cur = node->body; cur; cur = cur->next) {
-      gen_stmt(cur, info);
-    }
-    break;
+    traverse_list(t, node->body);
+    return VISIT_DONE;
   case ND_NOP:
     // nothing to do
-    break;
+    return VISIT_DONE;
   default:
     error_tok(node->tok, "invalid statement");
+    return VISIT_DONE;
   }
 }
 
+// 文の並びを出力する
+static void gen_stmts(NodeId id, GenInfo *info) {
+  traverse(id, gen_stmt_step, info);
+}
+
+static bool find_funcall(NodeId id, void *ctx) {
+  bool *found = ctx;
+  if (node_at(id)->kind == ND_FUNCALL) {
+    *found = true;
+  }
+  return !*found;
+}
+
+static bool has_funcall(NodeId id) {
+  bool found = false;
+  visit_nodes(id, find_funcall, NULL, &found);
+  return found;
+}
+
+static bool count_node(NodeId id, void *ctx) {
+  (*(int *)ctx)++;
+  return true;
+}
+
+// 式のノード数。1つのノードが同時に積む一時値は高々1つなので、
+// 式の評価中に積まれる一時値の数の上限になる
+static int expr_size(NodeId id) {
+  int size = 0;
+  visit_nodes(id, count_node, NULL, &size);
+  return size;
+}
+
+static int max(int a, int b) {
+  return a < b ? b : a;
+}
+
+static bool stmt_depth_pre(NodeId id, void *ctx) {
+  int *depth = ctx;
+  Node *node = node_at(id);
+  switch (node->kind) {
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+    *depth = max(*depth, expr_size(node->lhs));
+    return false;
+  case ND_IF:
+  case ND_WHILE:
+    *depth = max(*depth, expr_size(node->cond));
+    return true;
+  case ND_FOR:
+    *depth = max(*depth, expr_size(node->init));
+    *depth = max(*depth, expr_size(node->cond));
+    *depth = max(*depth, expr_size(node->succ));
+    return true;
+  case ND_BLOCK:
+    return true;
+  default:
+    // 条件式などの中には文はない
+    return false;
+  }
+}
+
+// 文の並びを実行する間に積まれる一時値の数の上限
+static int stmt_depth(NodeId id) {
+  int depth = 0;
+  visit_nodes(id, stmt_depth_pre, NULL, &depth);
+  return depth;
+}
+
+// 関数を呼ばない葉関数はrbpを使わずにrspから変数を参照する。
+// 変数と一時値がレッドゾーンに収まるならrspも動かさない
+static FrameKind frame_kind(Function *fun) {
+  if (!opt_omit_frame_pointer || opt_instrument_functions || has_funcall(fun->node)) {
+    return FRAME_RBP;
+  }
+  if (fun->stack_size + stmt_depth(fun->node) * 8 <= RED_ZONE_SIZE) {
+    return FRAME_RED_ZONE;
+  }
+  return FRAME_RSP;
+}
+
+////////////////////////////////////////////////////////////////
+// DWARF
+//
+// -gのとき、行番号表は.file/.locからアセンブラに作らせ、
+// .debug_infoには関数と変数の位置だけを書く(DWARF 4)。
+// 内蔵アセンブラ(-c)はこれを扱えないので、-gと-cの組み合わせはparse_argsで断る。
+
+enum {
+  ABBREV_COMPILE_UNIT = 1,
+  ABBREV_SUBPROGRAM,
+  ABBREV_PARAM,
+  ABBREV_VAR,
+  ABBREV_BASE_TYPE,
+};
+
+// (タグ, 子の有無, 属性と形式の組..., 0, 0)の並び
+static const unsigned char debug_abbrev[] = {
+  ABBREV_COMPILE_UNIT, 0x11, 1,     // DW_TAG_compile_unit
+  0x25, 0x08,                       //   DW_AT_producer, DW_FORM_string
+  0x13, 0x0b,                       //   DW_AT_language, DW_FORM_data1
+  0x03, 0x08,                       //   DW_AT_name, DW_FORM_string
+  0x1b, 0x08,                       //   DW_AT_comp_dir, DW_FORM_string
+  0x10, 0x17,                       //   DW_AT_stmt_list, DW_FORM_sec_offset
+  0, 0,
+  ABBREV_SUBPROGRAM, 0x2e, 1,       // DW_TAG_subprogram
+  0x3f, 0x0c,                       //   DW_AT_external, DW_FORM_flag
+  0x03, 0x08,                       //   DW_AT_name, DW_FORM_string
+  0x3a, 0x0b,                       //   DW_AT_decl_file, DW_FORM_data1
+  0x3b, 0x0f,                       //   DW_AT_decl_line, DW_FORM_udata
+  0x49, 0x13,                       //   DW_AT_type, DW_FORM_ref4
+  0x11, 0x01,                       //   DW_AT_low_pc, DW_FORM_addr
+  0x12, 0x07,                       //   DW_AT_high_pc, DW_FORM_data8
+  0x40, 0x18,                       //   DW_AT_frame_base, DW_FORM_exprloc
+  0, 0,
+  ABBREV_PARAM, 0x05, 0,            // DW_TAG_formal_parameter
+  0x03, 0x08,                       //   DW_AT_name, DW_FORM_string
+  0x49, 0x13,                       //   DW_AT_type, DW_FORM_ref4
+  0x02, 0x18,                       //   DW_AT_location, DW_FORM_exprloc
+  0, 0,
+  ABBREV_VAR, 0x34, 0,              // DW_TAG_variable
+  0x03, 0x08,
+  0x49, 0x13,
+  0x02, 0x18,
+  0, 0,
+  ABBREV_BASE_TYPE, 0x24, 0,        // DW_TAG_base_type
+  0x0b, 0x0b,                       //   DW_AT_byte_size, DW_FORM_data1
+  0x3e, 0x0b,                       //   DW_AT_encoding, DW_FORM_data1
+  0x03, 0x08,                       //   DW_AT_name, DW_FORM_string
+  0, 0,
+  0,
+};
+
+#define DW_OP_breg6 0x76        // rbp + n
+#define DW_OP_breg7 0x77        // rsp + n
+#define DW_OP_fbreg 0x91        // frame base + n
+#define DW_LANG_C99 0x0c
+#define DW_ATE_signed 0x05
+
+static int sleb128_size(long val) {
+  int n = 1;
+  while (val < -64 || 63 < val) {
+    val >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static void emit_debug_string(const char *s) {
+  fprintf(outfp, ".string ");
+  emit_quoted(s);
+  fputc('\n', outfp);
+}
+
+// コンパイル単位の先頭と、変数の型(intは8バイト)
+static void begin_debug_info(void) {
+  char cwd[4096];
+  emit(".section .debug_line");
+  emit(".L.debug_line0:");
+  emit(".section .debug_info");
+  emit(".L.debug_info0:");
+  emit(".long .L.debug_info_end - .L.debug_info_start");
+  emit(".L.debug_info_start:");
+  emit(".value 4");
+  emit(".long .L.debug_abbrev0");
+  emit(".byte 8");
+  emit(".uleb128 %d", ABBREV_COMPILE_UNIT);
+  emit_debug_string("k9cc");
+  emit(".byte %d", DW_LANG_C99);
+  emit_debug_string(current_filename);
+  emit_debug_string(getcwd(cwd, sizeof(cwd)) ? cwd : ".");
+  emit(".long .L.debug_line0");
+  emit(".L.debug_int:");
+  emit(".uleb128 %d", ABBREV_BASE_TYPE);
+  emit(".byte 8");
+  emit(".byte %d", DW_ATE_signed);
+  emit_debug_string("int");
+  emit(".text");
+}
+
+static void emit_debug_var(int abbrev, Var *var) {
+  emit(".uleb128 %d", abbrev);
+  emit_debug_string(var->name);
+  emit(".long .L.debug_int - .L.debug_info0");
+  emit(".uleb128 %d", 1 + sleb128_size(-var->offset));
+  emit(".byte %d", DW_OP_fbreg);
+  emit(".sleb128 %d", -var->offset);
+}
+
+static bool is_param(Function *fun, Var *var) {
+  for (VarList *vl = fun->params; vl; vl = vl->next) {
+    if (vl->var == var) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 関数と、その引数とローカル変数。
+// 変数はフレームベースからの位置で表す。rspから参照するフレームでは
+// 文の境目(一時値を積んでいないとき)のrspを基準にする
+static void emit_debug_subprogram(Function *fun, GenInfo *info) {
+  int line, column;
+  source_position(fun->tok->loc, &line, &column);
+
+  emit(".section .debug_info");
+  emit(".uleb128 %d", ABBREV_SUBPROGRAM);
+  emit(".byte %d", !fun->local);
+  emit_debug_string(fun->name);
+  emit(".byte 1");
+  emit(".uleb128 %d", line);
+  emit(".long .L.debug_int - .L.debug_info0");
+  emit(".quad %s", fun->name);
+  emit(".quad .L.fend_%s - %s", fun->name, fun->name);
+  switch (info->frame) {
+  case FRAME_RBP:
+    emit(".uleb128 2");
+    emit(".byte %d, 0", DW_OP_breg6);
+    break;
+  case FRAME_RSP:
+    emit(".uleb128 %d", 1 + sleb128_size(fun->stack_size));
+    emit(".byte %d", DW_OP_breg7);
+    emit(".sleb128 %d", fun->stack_size);
+    break;
+  case FRAME_RED_ZONE:
+    emit(".uleb128 2");
+    emit(".byte %d, 0", DW_OP_breg7);
+    break;
+  }
+  for (VarList *vl = fun->params; vl; vl = vl->next) {
+    emit_debug_var(ABBREV_PARAM, vl->var);
+  }
+  for (VarList *vl = fun->locals; vl; vl = vl->next) {
+    // 最適化で作った一時変数(.tN)は出さない
+    if (!is_param(fun, vl->var) && vl->var->name[0] != '.') {
+      emit_debug_var(ABBREV_VAR, vl->var);
+    }
+  }
+  emit(".byte 0");
+  emit(".text");
+}
+
+static void end_debug_info(void) {
+  emit(".section .debug_info");
+  emit(".byte 0");
+  emit(".L.debug_info_end:");
+  emit(".section .debug_abbrev");
+  emit(".L.debug_abbrev0:");
+  for (int i = 0; i < (int)sizeof(debug_abbrev); i++) {
+    emit(".byte %d", debug_abbrev[i]);
+  }
+  emit(".text");
+}
+
+////////////////////////////////////////////////////////////////
+// 関数の計測
+//
+// --instrument-functionsのとき、関数ごとに呼ばれた回数と、入口から出口までの
+// サイクル数(rdtsc、呼んだ先の関数の分も含む)を表に足していく。
+// 表は起動時にruntime/instrument.cの__k9cc_instrument_registerへ渡し、
+// 終了時にそちらで並べ替えて出力する。
+
+// 表の1行: 関数名, 呼ばれた回数, サイクル数
+#define INSTRUMENT_ENTRY_SIZE 24
+
+static char **instrumented;     // 表に載せた関数名
+static int ninstrumented;
+
+// タイムスタンプカウンタをraxに読む(rdxも壊す)
+static void emit_rdtsc(void) {
+  emit("rdtsc");
+  emit("shl rdx, 32");
+  emit("or rax, rdx");
+}
+
+// 表に関数を載せ、呼ばれた回数を数えて入口の時刻を控える。
+// 引数はもう変数へ移してあるのでrdxを壊してよい
+static int instrument_enter(Function *fun) {
+  int idx = ninstrumented++;
+  instrumented = realloc(instrumented, sizeof(char *) * ninstrumented);
+  // 名前は関数と一緒に解放されるので写しを残す
+  instrumented[idx] = format("%s", fun->name);
+
+  emit("inc qword ptr [rip + .L.inst.table + %d]", idx * INSTRUMENT_ENTRY_SIZE + 8);
+  emit_rdtsc();
+  emit("mov [rbp-%d], rax", fun->stack_size + 8);
+  return idx;
+}
+
+// 出口で経過したサイクル数を足す。戻り値のraxはrdiに逃がしておく
+static void instrument_leave(Function *fun, int idx) {
+  emit("mov rdi, rax");
+  emit_rdtsc();
+  emit("sub rax, [rbp-%d]", fun->stack_size + 8);
+  emit("add [rip + .L.inst.table + %d], rax", idx * INSTRUMENT_ENTRY_SIZE + 16);
+  emit("mov rax, rdi");
+}
+
+// 計測の表と、起動時にそれを登録する関数
+static void emit_instrument_table(void) {
+  if (!ninstrumented) {
+    return;
+  }
+
+  emit(".data");
+  emit(".p2align 3");
+  emit(".L.inst.table:");
+  for (int i = 0; i < ninstrumented; i++) {
+    emit(".quad .L.inst.name%d", i);
+    emit(".quad 0");
+    emit(".quad 0");
+  }
+  emit(".section .rodata");
+  for (int i = 0; i < ninstrumented; i++) {
+    emit(".L.inst.name%d:", i);
+    emit_string(instrumented[i]);
+    free(instrumented[i]);
+  }
+
+  emit(".text");
+  emit(".L.inst.init:");
+  emit("push rbp");
+  emit("mov rbp, rsp");
+  emit("lea rdi, [rip + .L.inst.table]");
+  emit("mov rsi, %d", ninstrumented);
+  emit("call __k9cc_instrument_register");
+  emit("pop rbp");
+  emit("ret");
+
+  emit(".section .init_array,\"aw\"");
+  emit(".p2align 3");
+  emit(".quad .L.inst.init");
+
+  free(instrumented);
+  instrumented = NULL;
+  ninstrumented = 0;
+}
+
 static void gen_func(Function *fun, GenInfo *info) {
-  emit(".global %s", fun->name);
+  if (fun->unlikely) {
+    emit(".section .text.unlikely,\"ax\",@progbits");
+  }
+  if (!fun->local) {
+    emit(".global %s", fun->name);
+  }
+  emit(".type %s, @function", fun->name);
   emit("%s:", fun->name);
+
+  // 本体はいったん溜めて、基本ブロックに分けて整理してから出す
+  FILE *out = outfp;
+  int ninsns_head = ninsns;
+  bool thread = pass_enabled("thread-jumps");
+  bool buffered = thread || pass_prints_code();
+  if (buffered && !(outfp = tmpfile())) {
+    error("cannot create temporary file");
+  }
   info->name = fun->name;
+  info->nsite = 0;
+  info->frame = frame_kind(fun);
+  // 計測するときは、入口で読んだタイムスタンプを置く場所を足す(揃え方を変えないよう16バイト)
+  info->stack_size = fun->stack_size + (opt_instrument_functions ? 16 : 0);
+  info->depth = 0;
+  info->line = 0;
+  emit_loc(info, fun->tok);
 
   // prologue
-  emit("push rbp");
-  emit("mov rbp, rsp");
-  emit("sub rsp, %u", fun->stack_size);
+  if (info->frame == FRAME_RBP) {
+    emit("push rbp");
+    emit("mov rbp, rsp");
+    emit("sub rsp, %u", info->stack_size);
+  }
+  else if (info->frame == FRAME_RSP && fun->stack_size) {
+    emit("sub rsp, %u", fun->stack_size);
+  }
+  if (opt_profile_generate) {
+    // 名前は関数と一緒に解放されるので写しを登録する
+    int idx = profile_counter(format("%s", fun->name));
+    emit("inc qword ptr [rip + .L.prof.counters + %d]", idx * 8);
+  }
 
-  // params
+  // params。7個目以降は戻り番地の上に積まれている
   int i = 0;
-  for (VarList *vl = fun->params; vl; vl = vl->next) {
-    if (nargreg < i) {
-      error("function %s: number of parameters out of range", fun->name);
+  for (VarList *vl = fun->params; vl; vl = vl->next, i++) {
+    if (i < nargreg) {
+      emit("mov %s, %s", local_operand(info, vl->var->offset), argreg[i]);
+      continue;
     }
-    emit("mov [rbp-%d], %s", vl->var->offset, argreg[i++]);
+    int offset = (i - nargreg) * 8;
+    if (info->frame == FRAME_RBP) {
+      emit("mov rax, [rbp+%d]", 16 + offset);
+    }
+    else {
+      emit("mov rax, [rsp+%d]", (info->frame == FRAME_RSP ? fun->stack_size : 0) + 8 + offset);
+    }
+    emit("mov %s, rax", local_operand(info, vl->var->offset));
   }
+  int inst = opt_instrument_functions ? instrument_enter(fun) : -1;
 
-  for (Node *cur = fun->node; cur; cur = cur->next) {
-    gen_stmt(cur, info);
-  }
+  gen_stmts(fun->node, info);
   emit(".L.return_%s:", info->name);
-  emit("mov rsp, rbp");
+  if (0 <= inst) {
+    instrument_leave(fun, inst);
+  }
+  if (info->frame == FRAME_RBP) {
+    emit("mov rsp, rbp");
+    emit("pop rbp");
+  }
+  else if (info->frame == FRAME_RSP && fun->stack_size) {
+    emit("add rsp, %u", fun->stack_size);
+  }
+  emit("ret");
+  flush_cold(info);
+  if (buffered) {
+    rewind(outfp);
+    char *body = read_stream(outfp);
+    fclose(outfp);
+    outfp = out;
+    pass_print_code(STAGE_EMIT, fun->name, body);
+    if (thread) {
+      // --print-after=で見るときは、整理した結果も溜める
+      FILE *fp = pass_prints_code() ? tmpfile() : outfp;
+      if (!fp) {
+        error("cannot create temporary file");
+      }
+      int insns;
+      pass_start("thread-jumps");
+      pass_count("thread-jumps", optimize_cfg(body, fp, fun->name, &insns));
+      pass_stop("thread-jumps");
+      ninsns = ninsns_head + insns;
+      free(body);
+      body = NULL;
+      if (fp != outfp) {
+        rewind(fp);
+        body = read_stream(fp);
+        fclose(fp);
+        pass_print_code(STAGE_ASM, fun->name, body);
+      }
+    }
+    if (body) {
+      fputs(body, outfp);
+    }
+    free(body);
+  }
+  emit(".L.fend_%s:", fun->name);
+  emit(".size %s, .-%s", fun->name, fun->name);
+  if (fun->unlikely) {
+    emit(".text");
+  }
+  if (opt_debug_info) {
+    emit_debug_subprogram(fun, info);
+  }
+}
+
+// プロファイルカウンタと、終了時にそれを書き出す関数
+static void emit_profile_runtime(void) {
+  int n = profile_ncounters();
+  if (!n) {
+    return;
+  }
+
+  emit(".bss");
+  emit(".p2align 3");
+  emit(".L.prof.counters:");
+  emit(".zero %d", n * 8);
+
+  emit(".data");
+  emit(".p2align 3");
+  emit(".L.prof.names:");
+  for (int i = 0; i < n; i++) {
+    emit(".quad .L.prof.name%d", i);
+  }
+  emit(".section .rodata");
+  for (int i = 0; i < n; i++) {
+    emit(".L.prof.name%d:", i);
+    emit_string(profile_counter_name(i));
+  }
+  emit(".L.prof.path:");
+  emit_string(opt_profile_generate);
+  emit(".L.prof.mode:");
+  emit_string("a");
+  emit(".L.prof.format:");
+  emit_string("%s %ld\n");
+
+  // 各カウンタを "名前 回数" の形でファイルに追記する
+  emit(".text");
+  emit(".L.prof.dump:");
+  emit("push rbp");
+  emit("mov rbp, rsp");
+  emit("push rbx");
+  emit("push r12");
+  emit("lea rdi, [rip + .L.prof.path]");
+  emit("lea rsi, [rip + .L.prof.mode]");
+  emit("call fopen");
+  emit("test rax, rax");
+  emit("jz .L.prof.dump_end");
+  emit("mov rbx, rax");
+  emit("mov r12, 0");
+  emit(".L.prof.dump_loop:");
+  emit("cmp r12, %d", n);
+  emit("jge .L.prof.dump_close");
+  emit("mov rdi, rbx");
+  emit("lea rsi, [rip + .L.prof.format]");
+  emit("lea rax, [rip + .L.prof.names]");
+  emit("mov rdx, [rax + r12*8]");
+  emit("lea rax, [rip + .L.prof.counters]");
+  emit("mov rcx, [rax + r12*8]");
+  emit("mov eax, 0");
+  emit("call fprintf");
+  emit("inc r12");
+  emit("jmp .L.prof.dump_loop");
+  emit(".L.prof.dump_close:");
+  emit("mov rdi, rbx");
+  emit("call fclose");
+  emit(".L.prof.dump_end:");
+  emit("pop r12");
+  emit("pop rbx");
   emit("pop rbp");
   emit("ret");
 
+  emit(".section .fini_array,\"aw\"");
+  emit(".p2align 3");
+  emit(".quad .L.prof.dump");
 }
 
-void codegen(Function *prog) {
-  GenInfo info;
+// 関数ごとに出力するとき(ストリーミング)は
+// codegen_begin, codegen_func..., codegen_endの順に呼ぶ
+static GenInfo gen_info;
 
+void codegen_begin(FILE *out) {
+  outfp = out;
   emit(".intel_syntax noprefix");
+  if (opt_debug_info) {
+    fprintf(outfp, ".file 1 ");
+    emit_quoted(current_filename);
+    fputc('\n', outfp);
+    begin_debug_info();
+  }
+}
+
+void codegen_func(Function *fun) {
+  gen_func(fun, &gen_info);
+}
+
+void codegen_end(void) {
+  if (opt_profile_generate) {
+    emit_profile_runtime();
+  }
+  emit_instrument_table();
+  if (opt_debug_info) {
+    end_debug_info();
+  }
+  fflush(outfp);
+}
+
+void print_codegen_stats(void) {
+  report("codegen: %d instructions\n", ninsns);
+}
+
+void codegen(Function *prog, FILE *out) {
+  codegen_begin(out);
   for (Function *fun = prog; fun; fun = fun->next) {
-    gen_func(fun, &info);
+    codegen_func(fun);
   }
+  codegen_end();
 }
@@ -0,0 +1,478 @@
+////////////////////////////////////////////////////////////////
+// Local common subexpression elimination
+//
+// 基本ブロックの中で式に値番号をつけ、同じ値番号の演算やロードが
+// もう一度出てきたら、最初の出現を(t = 式)に、2回目以降をtに書き換える。
+// 変数の値番号には代入ごとに増える版を、ロードにはメモリの版を含めるので、
+// 代入・ポインタ経由の書き込み・関数呼び出しの後では別の値になる。
+
+#include <string.h>
+#include "k9cc.h"
+
+// 値番号表のキー
+typedef struct ValueKey {
+  int kind;
+  long a, b, c;
+} ValueKey;
+
+typedef struct ValueEntry {
+  ValueKey key;
+  int vn;                       // 0は空き
+} ValueEntry;
+
+// 評価済みの値。最初の出現と、使い回すための一時変数
+typedef struct Avail {
+  int vn;
+  NodeId node;
+  Var *temp;
+} Avail;
+
+typedef struct CseInfo {
+  Function *fn;
+  int *vn;                      // NodeId -> 値番号
+  int nvn_nodes;                // vnの大きさ
+  int nvalues;                  // 振った値番号の数
+
+  ValueEntry *table;            // 値番号表(基本ブロックごとに空にする)
+  int table_size;
+  int table_used;
+
+  int *version;                 // スロットごとの代入の版
+  bool *addressed;              // アドレスを取られたスロット
+  int nslots;
+  int memory;                   // メモリの版
+
+  Avail *avail;                 // 評価済みの値(出現順)
+  int navail;
+  int avail_capacity;
+  int *avail_of;                // 値番号 -> availの添字+1
+  int avail_of_size;
+
+  int nreplaced;
+} CseInfo;
+
+static unsigned long hash_key(ValueKey *key) {
+  unsigned long h = key->kind;
+  h = h * 1000003 ^ (unsigned long)key->a;
+  h = h * 1000003 ^ (unsigned long)key->b;
+  h = h * 1000003 ^ (unsigned long)key->c;
+  return h ^ (h >> 29);
+}
+
+static void clear_values(CseInfo *info) {
+  if (info->table_used) {
+    memset(info->table, 0, sizeof(ValueEntry) * info->table_size);
+    info->table_used = 0;
+  }
+  while (info->navail) {
+    info->avail_of[info->avail[--info->navail].vn] = 0;
+  }
+}
+
+// 表になければ新しい値番号を振る
+static int value_number(CseInfo *info, int kind, long a, long b, long c) {
+  if (info->table_size <= info->table_used * 2) {
+    ValueEntry *old = info->table;
+    int old_size = info->table_size;
+    info->table_size = old_size ? old_size * 2 : 256;
+    info->table = calloc(info->table_size, sizeof(ValueEntry));
+    info->table_used = 0;
+    for (int i = 0; i < old_size; i++) {
+      if (old[i].vn) {
+        unsigned long h = hash_key(&old[i].key) & (info->table_size - 1);
+        while (info->table[h].vn) {
+          h = (h + 1) & (info->table_size - 1);
+        }
+        info->table[h] = old[i];
+        info->table_used++;
+      }
+    }
+    free(old);
+  }
+
+  ValueKey key = {kind, a, b, c};
+  unsigned long h = hash_key(&key) & (info->table_size - 1);
+  for (; info->table[h].vn; h = (h + 1) & (info->table_size - 1)) {
+    ValueKey *k = &info->table[h].key;
+    if (k->kind == kind && k->a == a && k->b == b && k->c == c) {
+      return info->table[h].vn;
+    }
+  }
+  info->table[h].key = key;
+  info->table[h].vn = ++info->nvalues;
+  info->table_used++;
+  return info->nvalues;
+}
+
+// ほかのどの値とも等しくない値番号
+static int unique_value(CseInfo *info) {
+  return ++info->nvalues;
+}
+
+static int slot_of(Var *var) {
+  return var->offset / 8 - 1;
+}
+
+static int get_vn(CseInfo *info, NodeId id) {
+  return id < info->nvn_nodes ? info->vn[id] : 0;
+}
+
+static void set_vn(CseInfo *info, NodeId id, int v) {
+  if (info->nvn_nodes <= id) {
+    int size = info->nvn_nodes;
+    info->nvn_nodes = (id + 1) * 2;
+    info->vn = realloc(info->vn, sizeof(int) * info->nvn_nodes);
+    memset(info->vn + size, 0, sizeof(int) * (info->nvn_nodes - size));
+  }
+  info->vn[id] = v;
+}
+
+// 式に評価順で値番号を振る。代入と呼び出しはここで版を進める。
+// 子を評価順に積み、すべて番号を振り終えてから自分の番号を決める
+static int number_step(Traversal *t, NodeId id, int state, void *ctx) {
+  CseInfo *info = ctx;
+  Node *node = node_at(id);
+  Node *lhs = node->kind == ND_ADDR || node->kind == ND_ASSIGN ? node_at(node->lhs) : NULL;
+
+  if (state == 0) {
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      break;
+    case ND_ADDR:
+      if (lhs->kind != ND_VAR) {
+        traverse_child(t, lhs->lhs);
+      }
+      break;
+    case ND_DEREF:
+      traverse_child(t, node->lhs);
+      break;
+    case ND_ASSIGN:
+      if (lhs->kind == ND_DEREF) {
+        traverse_child(t, lhs->lhs);
+      }
+      traverse_child(t, node->rhs);
+      break;
+    case ND_FUNCALL:
+      traverse_list(t, node->args);
+      break;
+    default:
+      // 二項演算
+      traverse_child(t, node->lhs);
+      traverse_child(t, node->rhs);
+      break;
+    }
+    return 1;
+  }
+
+  int v;
+  switch (node->kind) {
+  case ND_NUM:
+    v = value_number(info, ND_NUM, node->val, 0, 0);
+    break;
+  case ND_VAR: {
+    int slot = slot_of(node->var);
+    // アドレスを取られた変数はポインタ経由で書き換わるかもしれない
+    long mem = info->addressed[slot] ? info->memory : -1;
+    v = value_number(info, ND_VAR, (long)node->var, info->version[slot], mem);
+    break;
+  }
+  case ND_ADDR:
+    if (lhs->kind == ND_VAR) {
+      v = value_number(info, ND_ADDR, (long)lhs->var, 0, 0);
+    }
+    else {
+      v = get_vn(info, lhs->lhs);  // &*p は p
+    }
+    break;
+  case ND_DEREF:
+    v = value_number(info, ND_DEREF, get_vn(info, node->lhs), info->memory, 0);
+    break;
+  case ND_ASSIGN:
+    // 代入を含む式は置き換えると代入が消えるので、どの値とも等しくしない
+    v = unique_value(info);
+    if (lhs->kind == ND_VAR) {
+      int slot = slot_of(lhs->var);
+      info->version[slot]++;
+      if (info->addressed[slot]) {
+        info->memory++;
+      }
+    }
+    else {
+      info->memory++;
+    }
+    break;
+  case ND_FUNCALL:
+    info->memory++;
+    v = unique_value(info);
+    break;
+  default: {
+    // 二項演算
+    int l = get_vn(info, node->lhs);
+    int r = get_vn(info, node->rhs);
+    // 可換な演算は左右を揃える
+    if ((node->kind == ND_ADD || node->kind == ND_MUL ||
+         node->kind == ND_EQ || node->kind == ND_NE) && r < l) {
+      int tmp = l;
+      l = r;
+      r = tmp;
+    }
+    v = value_number(info, node->kind, l, r, 0);
+    break;
+  }
+  }
+  set_vn(info, id, v);
+  return VISIT_DONE;
+}
+
+// 使い回す価値のある式か。変数や定数は読み直した方が安い
+static bool is_candidate(Node *node) {
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_DEREF:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static Avail *find_avail(CseInfo *info, int vn) {
+  if (vn < info->avail_of_size && info->avail_of[vn]) {
+    return &info->avail[info->avail_of[vn] - 1];
+  }
+  return NULL;
+}
+
+static void add_avail(CseInfo *info, int vn, NodeId id) {
+  if (find_avail(info, vn)) {
+    return;
+  }
+  if (info->avail_of_size <= vn) {
+    int size = info->avail_of_size;
+    info->avail_of_size = (vn + 1) * 2;
+    info->avail_of = realloc(info->avail_of, sizeof(int) * info->avail_of_size);
+    memset(info->avail_of + size, 0, sizeof(int) * (info->avail_of_size - size));
+  }
+  if (info->navail == info->avail_capacity) {
+    info->avail_capacity = info->avail_capacity ? info->avail_capacity * 2 : 64;
+    info->avail = realloc(info->avail, sizeof(Avail) * info->avail_capacity);
+  }
+  info->avail[info->navail] = (Avail){vn, id, NULL};
+  info->avail_of[vn] = ++info->navail;
+}
+
+// markより後に評価した値を忘れる
+static void forget_avail(CseInfo *info, int mark) {
+  while (mark < info->navail) {
+    info->avail_of[info->avail[--info->navail].vn] = 0;
+  }
+}
+
+// nodeを評価済みの値で置き換える
+static void reuse(NodeId id, Avail *av, CseInfo *info) {
+  Node *node = node_at(id);
+  if (!av->temp) {
+    // 最初の出現を(t = 式)にする
+    Node *first = node_at(av->node);
+    av->temp = new_temp_var(info->fn);
+    NodeId expr = node_dup(av->node);
+    NodeId var = node_new(ND_VAR, first->tok);
+    node_at(var)->var = av->temp;
+    first->kind = ND_ASSIGN;
+    first->lhs = var;
+    first->rhs = expr;
+  }
+  node->kind = ND_VAR;
+  node->var = av->temp;
+  info->nreplaced++;
+}
+
+// 評価順に見て、評価済みの値と同じ式を置き換える。
+// 引数や代入先のアドレスは評価順を決めないので、
+// そこで評価した値はほかの引数や右辺では使わない。
+// locals: 0 子を評価する前の評価済みの値の数, 1 次に評価する引数
+static int rewrite_step(Traversal *t, NodeId id, int state, void *ctx) {
+  CseInfo *info = ctx;
+  Node *node = node_at(id);
+  long *l = traverse_locals(t);
+  int vn = get_vn(info, id);
+
+  if (state == 0 && is_candidate(node)) {
+    Avail *av = find_avail(info, vn);
+    if (av) {
+      reuse(id, av, info);
+      return VISIT_DONE;
+    }
+  }
+
+  switch (node->kind) {
+  case ND_ASSIGN: {
+    Node *lhs = node_at(node->lhs);
+    if (state == 0 && lhs->kind == ND_DEREF) {
+      l[0] = info->navail;
+      traverse_child(t, lhs->lhs);
+      return 1;
+    }
+    if (lhs->kind == ND_DEREF) {
+      forget_avail(info, l[0]);
+    }
+    traverse_child(t, node->rhs);
+    return VISIT_DONE;
+  }
+  case ND_FUNCALL: {
+    if (state == 0) {
+      l[1] = node->args;
+    }
+    else {
+      forget_avail(info, l[0]);
+    }
+    NodeId arg = l[1];
+    if (!arg) {
+      return VISIT_DONE;
+    }
+    l[0] = info->navail;
+    l[1] = node_at(arg)->next;
+    traverse_child(t, arg);
+    return 1;
+  }
+  case ND_ADDR:
+    if (node_at(node->lhs)->kind == ND_DEREF) {
+      traverse_child(t, node_at(node->lhs)->lhs);
+    }
+    return VISIT_DONE;
+  default:
+    if (state == 0) {
+      NodeId kids[4];
+      int n = node_children(node, kids);
+      for (int i = 0; i < n; i++) {
+        traverse_child(t, kids[i]);
+      }
+      return 1;
+    }
+    if (is_candidate(node)) {
+      add_avail(info, vn, id);
+    }
+    return VISIT_DONE;
+  }
+}
+
+static void cse_expr(NodeId id, CseInfo *info) {
+  traverse(id, number_step, info);
+  traverse(id, rewrite_step, info);
+}
+
+// 文の並び。分岐や繰り返しの前後で基本ブロックが切れる
+static int cse_stmt_step(Traversal *t, NodeId id, int state, void *ctx) {
+  CseInfo *info = ctx;
+  Node *node = node_at(id);
+  switch (node->kind) {
+  case ND_EXPR_STMT:
+    cse_expr(node->lhs, info);
+    return VISIT_DONE;
+  case ND_RETURN:
+    cse_expr(node->lhs, info);
+    clear_values(info);
+    return VISIT_DONE;
+  case ND_BLOCK:
+    traverse_list(t, node->body);
+    return VISIT_DONE;
+  case ND_IF:
+    switch (state) {
+    case 0:
+      cse_expr(node->cond, info);
+      clear_values(info);
+      traverse_list(t, node->then);
+      return 1;
+    case 1:
+      clear_values(info);
+      if (!node->els) {
+        return VISIT_DONE;
+      }
+      traverse_list(t, node->els);
+      return 2;
+    default:
+      clear_values(info);
+      return VISIT_DONE;
+    }
+  case ND_WHILE:
+    if (state == 0) {
+      clear_values(info);
+      cse_expr(node->cond, info);
+      clear_values(info);
+      traverse_list(t, node->then);
+      return 1;
+    }
+    clear_values(info);
+    return VISIT_DONE;
+  case ND_FOR:
+    if (state == 0) {
+      if (node->init) {
+        cse_expr(node->init, info);
+      }
+      clear_values(info);
+      if (node->cond) {
+        cse_expr(node->cond, info);
+        clear_values(info);
+      }
+      traverse_list(t, node->then);
+      return 1;
+    }
+    clear_values(info);
+    if (node->succ) {
+      cse_expr(node->succ, info);
+      clear_values(info);
+    }
+    return VISIT_DONE;
+  default:
+    return VISIT_DONE;
+  }
+}
+
+// アドレスを取られた変数のスロットに印をつける
+static bool mark_addressed(NodeId id, void *ctx) {
+  CseInfo *info = ctx;
+  Node *node = node_at(id);
+  if (node->kind == ND_ADDR && node_at(node->lhs)->kind == ND_VAR) {
+    info->addressed[slot_of(node_at(node->lhs)->var)] = true;
+  }
+  return true;
+}
+
+// 一時変数に置き換えた式の数を返す
+int eliminate_common_subexprs(Function **prog) {
+  CseInfo info = {};
+  info.nvn_nodes = node_count() + 1;
+  info.vn = calloc(info.nvn_nodes, sizeof(int));
+
+  for (Function *fn = *prog; fn; fn = fn->next) {
+    info.fn = fn;
+    info.nslots = fn->stack_size / 8;
+    info.version = calloc(info.nslots + 1, sizeof(int));
+    info.addressed = calloc(info.nslots + 1, sizeof(bool));
+    info.memory = 0;
+    visit_nodes(fn->node, mark_addressed, NULL, &info);
+
+    int before = info.nreplaced;
+    clear_values(&info);
+    traverse(fn->node, cse_stmt_step, &info);
+    clear_values(&info);
+    if (before != info.nreplaced) {
+      layout_locals(fn);
+    }
+    free(info.version);
+    free(info.addressed);
+  }
+
+  free(info.vn);
+  free(info.table);
+  free(info.avail);
+  free(info.avail_of);
+  return info.nreplaced;
+}
@@ -0,0 +1,383 @@
+////////////////////////////////////////////////////////////////
+// Compile-time evaluation of pure functions
+//
+// 整数演算と純粋な関数の呼び出しだけでできた関数を純粋とみなし、
+// 引数がすべて定数の呼び出しをコンパイル時に実行してND_NUMに置き換える。
+// 実行はステップ数と再帰の深さ、式と文の入れ子の深さに上限を設け、
+// 超えたときは置き換えない(インタプリタ自身はCの再帰で動くので、スタックを守る)。
+
+#include <string.h>
+#include <limits.h>
+#include "k9cc.h"
+
+#define EVAL_MAX_STEPS 1000000
+#define EVAL_MAX_DEPTH 1000
+#define EVAL_MAX_NEST 10000         // 評価中の式と文の入れ子(呼び出しをまたいで数える)
+#define EVAL_TOTAL_STEPS 10000000  // パス全体での上限
+
+typedef struct FuncInfo {
+  Function *fn;
+  bool pure;
+} FuncInfo;
+
+typedef struct EvalInfo {
+  FuncInfo *funcs;
+  int nfuncs;
+  HashMap names;                // 関数名 -> FuncInfo
+  long steps;                   // 残りのステップ数
+  long total_steps;             // パス全体での残りのステップ数
+  int depth;                    // 呼び出しの深さ
+  int nest;                     // 評価中の式と文の入れ子の深さ
+} EvalInfo;
+
+// 関数1回分の変数の値
+typedef struct Frame {
+  long *vals;
+  bool *set;
+} Frame;
+
+typedef enum {
+  EV_NEXT,                      // 次の文へ
+  EV_RETURN,                    // returnした
+  EV_FAIL,                      // 評価できなかった
+} EvalStatus;
+
+static FuncInfo *find_func(EvalInfo *info, const char *name) {
+  return hashmap_get(&info->names, name);
+}
+
+typedef struct PureScan {
+  EvalInfo *info;
+  bool pure;
+} PureScan;
+
+static bool find_memory_access(NodeId id, void *ctx) {
+  PureScan *scan = ctx;
+  Node *node = node_at(id);
+  if (node->kind == ND_DEREF || node->kind == ND_ADDR) {
+    scan->pure = false;
+  }
+  return scan->pure;
+}
+
+// 関数本体がメモリに触れないか。呼び出し先はcallee_pureで調べる
+static bool body_pure(NodeId id) {
+  PureScan scan = {NULL, true};
+  visit_nodes(id, find_memory_access, NULL, &scan);
+  return scan.pure;
+}
+
+static bool find_impure_call(NodeId id, void *ctx) {
+  PureScan *scan = ctx;
+  Node *node = node_at(id);
+  if (node->kind == ND_FUNCALL) {
+    FuncInfo *fi = find_func(scan->info, node->name);
+    if (!fi || !fi->pure) {
+      scan->pure = false;
+    }
+  }
+  return scan->pure;
+}
+
+// 呼び出している関数がすべて定義済みで純粋か
+static bool callee_pure(NodeId id, EvalInfo *info) {
+  PureScan scan = {info, true};
+  visit_nodes(id, find_impure_call, NULL, &scan);
+  return scan.pure;
+}
+
+// 純粋でない関数を呼ぶ関数は純粋でない。変化がなくなるまで繰り返す
+static void find_pure_funcs(EvalInfo *info) {
+  for (int i = 0; i < info->nfuncs; i++) {
+    info->funcs[i].pure = body_pure(info->funcs[i].fn->node);
+  }
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (int i = 0; i < info->nfuncs; i++) {
+      FuncInfo *fi = &info->funcs[i];
+      if (fi->pure && !callee_pure(fi->fn->node, info)) {
+        fi->pure = false;
+        changed = true;
+      }
+    }
+  }
+}
+
+static bool call(FuncInfo *fi, long *args, int nargs, long *ret, EvalInfo *info);
+static bool eval_expr(NodeId id, Frame *fr, EvalInfo *info, long *val);
+
+// 符号付きのオーバーフローは実行時と同じく2の補数で折り返す
+static bool eval_node(NodeId id, Frame *fr, EvalInfo *info, long *val) {
+  Node *node = node_at(id);
+
+  long lhs, rhs;
+  switch (node->kind) {
+  case ND_NUM:
+    *val = node->val;
+    return true;
+  case ND_VAR: {
+    int idx = node->var->offset / 8 - 1;
+    if (!fr->set[idx]) {
+      return false;
+    }
+    *val = fr->vals[idx];
+    return true;
+  }
+  case ND_ASSIGN: {
+    Node *lhs = node_at(node->lhs);
+    if (lhs->kind != ND_VAR || !eval_expr(node->rhs, fr, info, val)) {
+      return false;
+    }
+    int idx = lhs->var->offset / 8 - 1;
+    fr->vals[idx] = *val;
+    fr->set[idx] = true;
+    return true;
+  }
+  case ND_FUNCALL: {
+    // 入れ子の深さの分だけ積まれるので、引数の値はヒープに置く
+    int nargs = 0;
+    for (NodeId arg = node->args; arg; arg = node_at(arg)->next) {
+      nargs++;
+    }
+    long *args = calloc(nargs + 1, sizeof(long));
+    bool ok = true;
+    int i = 0;
+    for (NodeId arg = node->args; arg && ok; arg = node_at(arg)->next) {
+      ok = eval_expr(arg, fr, info, &args[i++]);
+    }
+    FuncInfo *fi = find_func(info, node->name);
+    ok = ok && fi && fi->pure && call(fi, args, nargs, val, info);
+    free(args);
+    return ok;
+  }
+  default:
+    break;
+  }
+
+  if (!node->lhs || !node->rhs ||
+      !eval_expr(node->lhs, fr, info, &lhs) ||
+      !eval_expr(node->rhs, fr, info, &rhs)) {
+    return false;
+  }
+  switch (node->kind) {
+  case ND_ADD:
+    *val = (long)((unsigned long)lhs + (unsigned long)rhs);
+    return true;
+  case ND_SUB:
+    *val = (long)((unsigned long)lhs - (unsigned long)rhs);
+    return true;
+  case ND_MUL:
+    *val = (long)((unsigned long)lhs * (unsigned long)rhs);
+    return true;
+  case ND_DIV:
+    // 実行時に例外になる割り算は実行時に任せる
+    if (rhs == 0 || (lhs == LONG_MIN && rhs == -1)) {
+      return false;
+    }
+    *val = lhs / rhs;
+    return true;
+  case ND_EQ:
+    *val = lhs == rhs;
+    return true;
+  case ND_NE:
+    *val = lhs != rhs;
+    return true;
+  case ND_LT:
+    *val = lhs < rhs;
+    return true;
+  case ND_LE:
+    *val = lhs <= rhs;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// 入れ子が深すぎる式は評価しない
+static bool eval_expr(NodeId id, Frame *fr, EvalInfo *info, long *val) {
+  if (--info->steps < 0 || EVAL_MAX_NEST <= info->nest) {
+    return false;
+  }
+  info->nest++;
+  bool ok = eval_node(id, fr, info, val);
+  info->nest--;
+  return ok;
+}
+
+static EvalStatus exec_stmt(NodeId id, Frame *fr, EvalInfo *info, long *ret);
+
+static EvalStatus exec_node(NodeId id, Frame *fr, EvalInfo *info, long *ret) {
+  Node *node = node_at(id);
+  long val;
+  EvalStatus st;
+
+  switch (node->kind) {
+  case ND_RETURN:
+    return eval_expr(node->lhs, fr, info, ret) ? EV_RETURN : EV_FAIL;
+  case ND_EXPR_STMT:
+    return eval_expr(node->lhs, fr, info, &val) ? EV_NEXT : EV_FAIL;
+  case ND_IF:
+    if (!eval_expr(node->cond, fr, info, &val)) {
+      return EV_FAIL;
+    }
+    if (val) {
+      return exec_stmt(node->then, fr, info, ret);
+    }
+    return node->els ? exec_stmt(node->els, fr, info, ret) : EV_NEXT;
+  case ND_WHILE:
+    for (;;) {
+      if (!eval_expr(node->cond, fr, info, &val)) {
+        return EV_FAIL;
+      }
+      if (!val) {
+        return EV_NEXT;
+      }
+      if ((st = exec_stmt(node->then, fr, info, ret)) != EV_NEXT) {
+        return st;
+      }
+    }
+  case ND_FOR:
+    if (node->init && !eval_expr(node->init, fr, info, &val)) {
+      return EV_FAIL;
+    }
+    for (;;) {
+      if (node->cond) {
+        if (!eval_expr(node->cond, fr, info, &val)) {
+          return EV_FAIL;
+        }
+        if (!val) {
+          return EV_NEXT;
+        }
+      }
+      if ((st = exec_stmt(node->then, fr, info, ret)) != EV_NEXT) {
+        return st;
+      }
+      if (node->succ && !eval_expr(node->succ, fr, info, &val)) {
+        return EV_FAIL;
+      }
+    }
+  case ND_BLOCK:
+    for (NodeId cur = node->body; cur; cur = node_at(cur)->next) {
+      if ((st = exec_stmt(cur, fr, info, ret)) != EV_NEXT) {
+        return st;
+      }
+    }
+    return EV_NEXT;
+  case ND_NOP:
+    return EV_NEXT;
+  default:
+    return EV_FAIL;
+  }
+}
+
+static EvalStatus exec_stmt(NodeId id, Frame *fr, EvalInfo *info, long *ret) {
+  if (--info->steps < 0 || EVAL_MAX_NEST <= info->nest) {
+    return EV_FAIL;
+  }
+  info->nest++;
+  EvalStatus st = exec_node(id, fr, info, ret);
+  info->nest--;
+  return st;
+}
+
+static bool call(FuncInfo *fi, long *args, int nargs, long *ret, EvalInfo *info) {
+  Function *fn = fi->fn;
+  if (EVAL_MAX_DEPTH <= info->depth) {
+    return false;
+  }
+
+  int nslots = fn->stack_size / 8;
+  Frame fr;
+  fr.vals = calloc(nslots + 1, sizeof(long));
+  fr.set = calloc(nslots + 1, sizeof(bool));
+
+  int i = 0;
+  VarList *param;
+  for (param = fn->params; param && i < nargs; param = param->next, i++) {
+    int idx = param->var->offset / 8 - 1;
+    fr.vals[idx] = args[i];
+    fr.set[idx] = true;
+  }
+
+  // 引数の数が合わない呼び出しと、returnせずに終わる関数は評価しない
+  EvalStatus st = EV_FAIL;
+  if (!param && i == nargs) {
+    info->depth++;
+    st = EV_NEXT;
+    for (NodeId cur = fn->node; cur && st == EV_NEXT; cur = node_at(cur)->next) {
+      st = exec_stmt(cur, &fr, info, ret);
+    }
+    info->depth--;
+  }
+  free(fr.vals);
+  free(fr.set);
+  return st == EV_RETURN;
+}
+
+typedef struct FoldInfo {
+  EvalInfo *info;
+  int nfolded;
+} FoldInfo;
+
+// 定数引数で純粋な関数を呼んでいるところを結果の値に置き換える。
+// 帰りがけに見るので内側の呼び出しから置き換わり、入れ子になった呼び出しも畳める
+static void fold_call(NodeId id, void *ctx) {
+  FoldInfo *fold = ctx;
+  EvalInfo *info = fold->info;
+  Node *node = node_at(id);
+  if (node->kind != ND_FUNCALL) {
+    return;
+  }
+
+  FuncInfo *fi = find_func(info, node->name);
+  if (!fi || !fi->pure) {
+    return;
+  }
+  long args[64];
+  int nargs = 0;
+  Node *arg;
+  for (arg = node_at(node->args); arg && arg->kind == ND_NUM && nargs < 64; arg = node_at(arg->next)) {
+    args[nargs++] = arg->val;
+  }
+  if (arg) {
+    return;
+  }
+
+  long val;
+  long budget = info->total_steps < EVAL_MAX_STEPS ? info->total_steps : EVAL_MAX_STEPS;
+  info->steps = budget;
+  info->depth = 0;
+  info->nest = 0;
+  bool ok = call(fi, args, nargs, &val, info);
+  info->total_steps -= budget - (info->steps < 0 ? 0 : info->steps);
+  if (ok) {
+    node->kind = ND_NUM;
+    node->val = val;
+    fold->nfolded++;
+  }
+}
+
+// 定数に畳み込んだ呼び出しの数を返す
+int eval_pure_calls(Function **prog) {
+  EvalInfo info = {};
+  info.total_steps = EVAL_TOTAL_STEPS;
+  for (Function *fn = *prog; fn; fn = fn->next) {
+    info.nfuncs++;
+  }
+  info.funcs = calloc(info.nfuncs, sizeof(FuncInfo));
+  int i = 0;
+  for (Function *fn = *prog; fn; fn = fn->next, i++) {
+    info.funcs[i].fn = fn;
+    hashmap_put(&info.names, fn->name, &info.funcs[i]);
+  }
+
+  find_pure_funcs(&info);
+
+  FoldInfo fold = {&info, 0};
+  for (Function *fn = *prog; fn; fn = fn->next) {
+    visit_nodes(fn->node, NULL, fold_call, &fold);
+  }
+  hashmap_free(&info.names);
+  free(info.funcs);
+  return fold.nfolded;
+}
@@ -0,0 +1,410 @@
+////////////////////////////////////////////////////////////////
+// Interprocedural constant propagation
+//
+// 定数を引数に渡している呼び出しを、その定数を埋め込んだ関数の複製
+// (f.constprop.N)の呼び出しに置き換える。複製では定数になった仮引数を
+// 数値に置き換えて畳み込み、呼び出し側はその引数を渡さなくなる。
+// 元の関数は外から呼ばれるかもしれないので残す。
+//
+// 同じ定数の組で呼んでいるところはまとめて1つの複製を使う。
+// ループの中の呼び出しほど重いとみなし、重いものから大きさの予算内で複製する。
+
+#include <string.h>
+#include <limits.h>
+#include "k9cc.h"
+
+#define IPCP_MAX_CALLEE_NODES 512   // これより大きい関数は複製しない
+#define IPCP_MIN_BUDGET 256          // 複製に使ってよいノード数の最小値
+#define IPCP_LOOP_WEIGHT 10          // ループ1段ごとの実行回数の見積もり
+#define IPCP_MAX_PARAMS 16
+#define IPCP_MAX_WEIGHT 1e30         // 深いループの重みはここで打ち止め
+
+// 同じ関数を同じ定数の組で呼んでいる呼び出しの集まり
+typedef struct CallGroup {
+  Function *callee;
+  bool is_const[IPCP_MAX_PARAMS];
+  long vals[IPCP_MAX_PARAMS];
+  NodeId *sites;
+  int nsites;
+  double weight;                // 見積もった実行回数の合計
+} CallGroup;
+
+typedef struct IpcpInfo {
+  HashMap funcs;                // 名前 -> Function
+  HashMap group_map;            // 関数名と定数の組 -> CallGroup
+  CallGroup **groups;
+  int ngroups;
+  int nclones;
+} IpcpInfo;
+
+static bool count_node(NodeId id, void *ctx) {
+  (*(int *)ctx)++;
+  return true;
+}
+
+static int count_nodes(NodeId id) {
+  int n = 0;
+  visit_nodes(id, count_node, NULL, &n);
+  return n;
+}
+
+static int count_params(Function *fn) {
+  int n = 0;
+  for (VarList *vl = fn->params; vl; vl = vl->next) {
+    n++;
+  }
+  return n;
+}
+
+////////////////////////////////////////////////////////////////
+// 呼び出しを集める
+
+static void add_site(NodeId id, double weight, IpcpInfo *info) {
+  Node *node = node_at(id);
+  Function *callee = hashmap_get(&info->funcs, node->name);
+  if (!callee || !strcmp(callee->name, "main")) {
+    return;
+  }
+  int nparams = count_params(callee);
+  if (IPCP_MAX_PARAMS < nparams) {
+    return;
+  }
+
+  bool is_const[IPCP_MAX_PARAMS] = {};
+  long vals[IPCP_MAX_PARAMS] = {};
+  int nargs = 0, nconst = 0;
+  char *key = format("%s", callee->name);
+  for (Node *arg = node_at(node->args); arg; arg = node_at(arg->next), nargs++) {
+    if (nargs < nparams && arg->kind == ND_NUM) {
+      is_const[nargs] = true;
+      vals[nargs] = arg->val;
+      nconst++;
+      char *k = format("%s,%d=%ld", key, nargs, arg->val);
+      free(key);
+      key = k;
+    }
+  }
+  if (nargs != nparams || !nconst) {
+    free(key);
+    return;
+  }
+
+  CallGroup *g = hashmap_get(&info->group_map, key);
+  if (!g) {
+    g = calloc(1, sizeof(CallGroup));
+    g->callee = callee;
+    memcpy(g->is_const, is_const, sizeof(is_const));
+    memcpy(g->vals, vals, sizeof(vals));
+    hashmap_put(&info->group_map, key, g);
+    info->groups = realloc(info->groups, sizeof(CallGroup *) * (info->ngroups + 1));
+    info->groups[info->ngroups++] = g;
+  }
+  else {
+    free(key);
+  }
+  g->sites = realloc(g->sites, sizeof(NodeId) * (g->nsites + 1));
+  g->sites[g->nsites++] = id;
+  g->weight += weight;
+}
+
+typedef struct SiteScan {
+  IpcpInfo *info;
+  double weight;                // 関数の入口の重み
+  int loops;                    // 囲んでいるループの数
+} SiteScan;
+
+static bool is_loop(Node *node) {
+  return node->kind == ND_WHILE || node->kind == ND_FOR;
+}
+
+static bool enter_loop(NodeId id, void *ctx) {
+  SiteScan *scan = ctx;
+  if (is_loop(node_at(id))) {
+    scan->loops++;
+  }
+  return true;
+}
+
+// 呼び出しは引数を見たあとで加える
+static void leave_site(NodeId id, void *ctx) {
+  SiteScan *scan = ctx;
+  Node *node = node_at(id);
+  if (is_loop(node)) {
+    scan->loops--;
+  }
+  if (node->kind == ND_FUNCALL) {
+    double weight = scan->weight;
+    for (int i = 0; i < scan->loops && weight < IPCP_MAX_WEIGHT; i++) {
+      weight *= IPCP_LOOP_WEIGHT;
+    }
+    add_site(id, weight, scan->info);
+  }
+}
+
+static void collect_sites(NodeId id, double weight, IpcpInfo *info) {
+  SiteScan scan = {info, weight, 0};
+  visit_nodes(id, enter_loop, leave_site, &scan);
+}
+
+////////////////////////////////////////////////////////////////
+// 複製を作る
+
+// 複製の変数。元の関数と変数を共有しないよう作り直す
+typedef struct VarMap {
+  Var **from;
+  Var **to;
+  int n;
+} VarMap;
+
+static Var *map_var(VarMap *map, Var *var) {
+  for (int i = 0; i < map->n; i++) {
+    if (map->from[i] == var) {
+      return map->to[i];
+    }
+  }
+  error("ipcp: unknown variable %s", var->name);
+  return NULL;
+}
+
+static bool remap_var(NodeId id, void *ctx) {
+  Node *node = node_at(id);
+  if (node->kind == ND_VAR) {
+    node->var = map_var(ctx, node->var);
+  }
+  return true;
+}
+
+static void remap_vars(NodeId id, VarMap *map) {
+  visit_nodes(id, remap_var, NULL, map);
+}
+
+typedef struct VarUse {
+  Var *var;
+  long val;
+  bool written;
+} VarUse;
+
+static bool find_write(NodeId id, void *ctx) {
+  VarUse *use = ctx;
+  Node *node = node_at(id);
+  if ((node->kind == ND_ASSIGN || node->kind == ND_ADDR) &&
+      node_at(node->lhs)->kind == ND_VAR && node_at(node->lhs)->var == use->var) {
+    use->written = true;
+  }
+  return !use->written;
+}
+
+// varに代入したりアドレスを取ったりしているか
+static bool var_written(NodeId id, Var *var) {
+  VarUse use = {var, 0, false};
+  visit_nodes(id, find_write, NULL, &use);
+  return use.written;
+}
+
+static bool replace_use(NodeId id, void *ctx) {
+  VarUse *use = ctx;
+  Node *node = node_at(id);
+  if (node->kind == ND_VAR && node->var == use->var) {
+    node->kind = ND_NUM;
+    node->val = use->val;
+  }
+  return true;
+}
+
+static void replace_var(NodeId id, Var *var, long val) {
+  VarUse use = {var, val, false};
+  visit_nodes(id, replace_use, NULL, &use);
+}
+
+// 定数どうしの演算を畳み込む。実行時に例外になる割り算は残す
+static void fold_expr(Node *node) {
+  NodeId kids[4];
+  if (node_children(node, kids) != 2 || node->kind == ND_ASSIGN) {
+    return;
+  }
+  Node *lhs = node_at(node->lhs), *rhs = node_at(node->rhs);
+  if (lhs->kind != ND_NUM || rhs->kind != ND_NUM) {
+    return;
+  }
+  unsigned long l = lhs->val, r = rhs->val;
+  long val;
+  switch (node->kind) {
+  case ND_ADD: val = (long)(l + r); break;
+  case ND_SUB: val = (long)(l - r); break;
+  case ND_MUL: val = (long)(l * r); break;
+  case ND_DIV:
+    if (rhs->val == 0 || (lhs->val == LONG_MIN && rhs->val == -1)) {
+      return;
+    }
+    val = lhs->val / rhs->val;
+    break;
+  case ND_EQ: val = lhs->val == rhs->val; break;
+  case ND_NE: val = lhs->val != rhs->val; break;
+  case ND_LT: val = lhs->val < rhs->val; break;
+  case ND_LE: val = lhs->val <= rhs->val; break;
+  default:
+    return;
+  }
+  node->kind = ND_NUM;
+  node->val = val;
+}
+
+// 条件が定数になったifとwhileを畳む。子は畳み終えている
+static void fold_node(NodeId id, void *ctx) {
+  Node *node = node_at(id);
+  switch (node->kind) {
+  case ND_IF:
+    if (node_at(node->cond)->kind == ND_NUM) {
+      NodeId keep = node_at(node->cond)->val ? node->then : node->els;
+      NodeId next = node->next;
+      if (keep) {
+        *node = *node_at(keep);
+      }
+      else {
+        node->kind = ND_NOP;
+      }
+      node->next = next;
+    }
+    break;
+  case ND_WHILE:
+    if (node_at(node->cond)->kind == ND_NUM && !node_at(node->cond)->val) {
+      node->kind = ND_NOP;
+    }
+    break;
+  default:
+    fold_expr(node);
+    break;
+  }
+}
+
+static void fold_stmt(NodeId id) {
+  visit_nodes(id, NULL, fold_node, NULL);
+}
+
+static Function *clone_function(CallGroup *g, IpcpInfo *info) {
+  Function *fn = g->callee;
+  Function *clone = calloc(1, sizeof(Function));
+  clone->name = format("%s.constprop.%d", fn->name, info->nclones++);
+  clone->tok = fn->tok;
+  clone->stack_size = fn->stack_size;
+  clone->count = -1;
+  clone->local = true;
+
+  // 変数を作り直す
+  VarMap map = {};
+  VarList **link = &clone->locals;
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    Var *var = calloc(1, sizeof(Var));
+    *var = *vl->var;
+    map.from = realloc(map.from, sizeof(Var *) * (map.n + 1));
+    map.to = realloc(map.to, sizeof(Var *) * (map.n + 1));
+    map.from[map.n] = vl->var;
+    map.to[map.n++] = var;
+    *link = calloc(1, sizeof(VarList));
+    (*link)->var = var;
+    link = &(*link)->next;
+  }
+
+  NodeId *body = &clone->node;
+  for (NodeId cur = fn->node; cur; cur = node_at(cur)->next) {
+    *body = node_clone(cur);
+    body = &node_at(*body)->next;
+  }
+  remap_vars(clone->node, &map);
+
+  // 定数になった仮引数を取り除く。書き換えられる仮引数は先頭で代入する
+  int i = 0;
+  link = &clone->params;
+  for (VarList *vl = fn->params; vl; vl = vl->next, i++) {
+    Var *var = map_var(&map, vl->var);
+    if (!g->is_const[i]) {
+      *link = calloc(1, sizeof(VarList));
+      (*link)->var = var;
+      link = &(*link)->next;
+      continue;
+    }
+    if (!var_written(clone->node, var)) {
+      replace_var(clone->node, var, g->vals[i]);
+      continue;
+    }
+    Token *tok = node_at(clone->node)->tok;
+    NodeId lhs = node_new(ND_VAR, tok);
+    node_at(lhs)->var = var;
+    NodeId rhs = node_new(ND_NUM, tok);
+    node_at(rhs)->val = g->vals[i];
+    NodeId assign = node_new(ND_ASSIGN, tok);
+    node_at(assign)->lhs = lhs;
+    node_at(assign)->rhs = rhs;
+    NodeId stmt = node_new(ND_EXPR_STMT, tok);
+    node_at(stmt)->lhs = assign;
+    node_at(stmt)->next = clone->node;
+    clone->node = stmt;
+  }
+  fold_stmt(clone->node);
+  free(map.from);
+  free(map.to);
+  return clone;
+}
+
+// 呼び出しを複製へ向け、定数の引数を渡さないようにする
+static void redirect_site(NodeId id, CallGroup *g, Function *clone) {
+  Node *node = node_at(id);
+  node->name = clone->name;
+  NodeId *link = &node->args;
+  for (int i = 0; *link; i++) {
+    if (g->is_const[i]) {
+      *link = node_at(*link)->next;
+    }
+    else {
+      link = &node_at(*link)->next;
+    }
+  }
+}
+
+static int cmp_group(const void *a, const void *b) {
+  double wa = (*(CallGroup **)a)->weight, wb = (*(CallGroup **)b)->weight;
+  return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+// 複製へ向け直した呼び出しの数を返す
+int specialize_calls(Function **prog) {
+  IpcpInfo info = {};
+  int total = 0;
+  for (Function *fn = *prog; fn; fn = fn->next) {
+    hashmap_put(&info.funcs, fn->name, fn);
+    total += count_nodes(fn->node);
+  }
+  for (Function *fn = *prog; fn; fn = fn->next) {
+    // --profile-useの回数があれば呼び出し元の重みにする
+    collect_sites(fn->node, 0 < fn->count ? fn->count : 1, &info);
+  }
+  qsort(info.groups, info.ngroups, sizeof(CallGroup *), cmp_group);
+
+  int budget = total / 2 < IPCP_MIN_BUDGET ? IPCP_MIN_BUDGET : total / 2;
+  int nredirected = 0;
+  for (int i = 0; i < info.ngroups; i++) {
+    CallGroup *g = info.groups[i];
+    int size = count_nodes(g->callee->node);
+    if (IPCP_MAX_CALLEE_NODES < size || budget < size) {
+      continue;
+    }
+    budget -= size;
+
+    Function *clone = clone_function(g, &info);
+    clone->next = g->callee->next;
+    g->callee->next = clone;
+    for (int j = 0; j < g->nsites; j++) {
+      redirect_site(g->sites[j], g, clone);
+      nredirected++;
+    }
+  }
+
+  for (int i = 0; i < info.ngroups; i++) {
+    free(info.groups[i]->sites);
+    free(info.groups[i]);
+  }
+  free(info.groups);
+  hashmap_free(&info.funcs);
+  hashmap_free(&info.group_map);
+  return nredirected;
+}
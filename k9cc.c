@@ -1,17 +1,271 @@
 ////////////////////////////////////////////////////////////////
 // K9 C Compiler
 
+#include <string.h>
 #include "k9cc.h"
 
+char *opt_profile_generate;
+char *opt_profile_use;
+bool opt_omit_frame_pointer;
+int opt_align_loops = 16;
+int opt_align_jumps = 16;
+bool opt_stats;
+int opt_unroll_factor = 4;
+int opt_lex_threads = 1;
+bool opt_dump_tokens;
+bool opt_streaming = true;
+bool opt_lazy_parsing;
+bool opt_compile_only;
+char *opt_output;
+bool opt_debug_info;
+bool opt_instrument_functions;
+
+static void usage(void) {
+  error("usage: k9cc [-O0|-O1|-O2] [-f[no-]PASS] [--passes=PASS,...] [--print-after=PASS] [-fomit-frame-pointer] [-falign-loops=N] [-falign-jumps=N] [-funroll-factor=N] [-fno-streaming] [-flazy-parsing] [--stats] [--lex-threads=N] [--dump-tokens] [--profile-generate[=FILE]] [--profile-use=FILE] [--instrument-functions] [-g] [-c] [-o FILE] PROGRAM|FILE.c|-");
+}
+
+// プログラムを読む。"-"は標準入力、".c"で終わるものはファイル名、
+// それ以外は引数そのものをプログラムとして扱う
+static char *read_input(char *arg) {
+  size_t len = strlen(arg);
+  if (!strcmp(arg, "-")) {
+    current_filename = "<stdin>";
+    return read_stream(stdin);
+  }
+  if (2 < len && !strcmp(arg + len - 2, ".c")) {
+    FILE *fp = fopen(arg, "r");
+    if (!fp) {
+      error("cannot open %s", arg);
+    }
+    current_filename = arg;
+    char *buf = read_stream(fp);
+    fclose(fp);
+    return buf;
+  }
+  current_filename = "<command line>";
+  return arg;
+}
+
+// オプションを解釈してプログラム本体を返す
+static char *parse_args(int argc, char **argv) {
+  char *input = NULL;
+  size_t len;
+  int omit_frame_pointer = -1;  // -1は-Oのレベルに従う
+
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+    if (!strcmp(arg, "--profile-generate")) {
+      opt_profile_generate = PROFILE_DEFAULT_PATH;
+    }
+    else if ((len = startswith(arg, "--profile-generate="))) {
+      opt_profile_generate = arg + len;
+    }
+    else if ((len = startswith(arg, "--profile-use="))) {
+      opt_profile_use = arg + len;
+    }
+    else if (!strcmp(arg, "--instrument-functions")) {
+      opt_instrument_functions = true;
+    }
+    else if (!strcmp(arg, "-fomit-frame-pointer")) {
+      omit_frame_pointer = true;
+    }
+    else if (!strcmp(arg, "-fno-omit-frame-pointer")) {
+      omit_frame_pointer = false;
+    }
+    else if ((len = startswith(arg, "-falign-loops="))) {
+      opt_align_loops = atoi(arg + len);
+      if (opt_align_loops < 0 || (opt_align_loops & (opt_align_loops - 1))) {
+        error("loop alignment must be a power of 2: %s", arg);
+      }
+      pass_enable("align-loops", true);
+    }
+    else if ((len = startswith(arg, "-falign-jumps="))) {
+      opt_align_jumps = atoi(arg + len);
+      if (opt_align_jumps < 0 || (opt_align_jumps & (opt_align_jumps - 1))) {
+        error("jump alignment must be a power of 2: %s", arg);
+      }
+      pass_enable("align-jumps", true);
+    }
+    else if (!strcmp(arg, "-O")) {
+      pass_set_level(1);
+    }
+    else if (startswith(arg, "-O") && '0' <= arg[2] && arg[2] <= '9' && !arg[3]) {
+      pass_set_level(arg[2] - '0');
+    }
+    else if ((len = startswith(arg, "--passes="))) {
+      pass_set_pipeline(arg + len);
+    }
+    else if ((len = startswith(arg, "--print-after="))) {
+      pass_print_after(arg + len);
+    }
+    else if ((len = startswith(arg, "-funroll-factor="))) {
+      opt_unroll_factor = atoi(arg + len);
+      if (opt_unroll_factor < 2) {
+        error("unroll factor must be at least 2: %s", arg);
+      }
+    }
+    else if ((len = startswith(arg, "--lex-threads="))) {
+      opt_lex_threads = atoi(arg + len);
+      if (opt_lex_threads < 1) {
+        error("invalid number of lexer threads: %s", arg);
+      }
+    }
+    else if (!strcmp(arg, "--dump-tokens")) {
+      opt_dump_tokens = true;
+    }
+    else if (!strcmp(arg, "-fstreaming")) {
+      opt_streaming = true;
+    }
+    else if (!strcmp(arg, "-fno-streaming")) {
+      opt_streaming = false;
+    }
+    else if (!strcmp(arg, "-flazy-parsing")) {
+      opt_lazy_parsing = true;
+    }
+    else if (!strcmp(arg, "-fno-lazy-parsing")) {
+      opt_lazy_parsing = false;
+    }
+    else if (!strcmp(arg, "-c")) {
+      opt_compile_only = true;
+    }
+    else if (!strcmp(arg, "-o")) {
+      if (++i == argc) {
+        usage();
+      }
+      opt_output = argv[i];
+    }
+    else if (!strcmp(arg, "-g")) {
+      opt_debug_info = true;
+    }
+    else if (!strcmp(arg, "--stats")) {
+      opt_stats = true;
+    }
+    else if ((len = startswith(arg, "-fno-")) && pass_enable(arg + len, false)) {
+    }
+    else if ((len = startswith(arg, "-f")) && pass_enable(arg + len, true)) {
+    }
+    else if (arg[0] == '-' && arg[1]) {
+      error("unknown option: %s", arg);
+    }
+    else if (input) {
+      usage();
+    }
+    else {
+      input = arg;
+    }
+  }
+  if (!input) {
+    usage();
+  }
+  if (opt_profile_generate && opt_profile_use) {
+    error("--profile-generate and --profile-use are exclusive");
+  }
+  // 組み込みのアセンブラは行番号表とデバッグ情報のセクションを作れない
+  if (opt_debug_info && opt_compile_only) {
+    error("-g cannot be used with -c");
+  }
+  opt_omit_frame_pointer = omit_frame_pointer == -1 ? 1 <= pass_level() : omit_frame_pointer;
+  pass_setup();
+  return input;
+}
+
+static int max_nodes;
+
+// スタックフレームの大きさ(スロットを共有しなかったとき -> 実際)
+static void print_frame_stats(Function *prog) {
+  for (Function *fun = prog; fun; fun = fun->next) {
+    int nvars = 0;
+    for (VarList *vl = fun->locals; vl; vl = vl->next) {
+      nvars++;
+    }
+    report("frame %s: %d -> %d bytes\n", fun->name, nvars * 8, fun->stack_size);
+  }
+}
+
+static void print_stats(void) {
+  print_pass_stats();
+  if (opt_lazy_parsing) {
+    print_parse_stats();
+  }
+  print_codegen_stats();
+  report("tokens: %d tokens, %zu bytes\n", token_count(), token_count() * sizeof(Token));
+  report("ast: %d nodes at peak, %zu bytes\n", max_nodes, max_nodes * sizeof(Node));
+}
+
+// 最適化のパスを流し、並べ替えたあとの先頭を返す
+static Function *optimize(Function *prog) {
+  for (Function *fun = prog; fun; fun = fun->next) {
+    fun->count = profile_count(fun->name);
+  }
+  prog = run_passes(prog);
+  if (node_count() > max_nodes) {
+    max_nodes = node_count();
+  }
+  if (opt_stats) {
+    print_frame_stats(prog);
+  }
+  return prog;
+}
+
+// 関数を1つ読むたびに最適化してコードを出し、その関数のメモリを捨てる。
+// メモリは一番大きい関数の分だけで済む
+static void compile_streaming(Token *tok, FILE *out) {
+  codegen_begin(out);
+  Function *fun;
+  while ((fun = next_function(&tok))) {
+    fun = optimize(fun);
+    codegen_func(fun);
+    release_functions();
+  }
+  codegen_end();
+}
+
+// プログラム全体を読んでからコードを出す。関数をまたぐ最適化で使う
+static void compile_whole(Token *tok, FILE *out) {
+  Function *prog = opt_lazy_parsing ? program_lazy(tok) : program(tok);
+  prog = optimize(prog);
+  codegen(prog, out);
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    error("引数の個数が正しくありません\n");
+  char *input = read_input(parse_args(argc, argv));
+  if (opt_profile_use) {
+    profile_load(opt_profile_use);
   }
-  Token *tok = tokenize(argv[1]), *toktop = tok;
-  Function *prog = program(tok);
 
-  // dump_token(toktop); walk(prog->node);
+  Token *tok = tokenize(input);
+  if (opt_dump_tokens) {
+    dump_token(tok);
+    return 0;
+  }
+
+  // -cのときはアセンブリを一時ファイルに溜めて自前でアセンブルする
+  FILE *out = stdout;
+  if (opt_compile_only) {
+    out = tmpfile();
+  }
+  else if (opt_output) {
+    out = fopen(opt_output, "w");
+  }
+  if (!out) {
+    error("cannot open output file");
+  }
 
-  codegen(prog);
+  // 遅延読み込みはmainからの呼び出しをたどるので全体を読む
+  if (opt_streaming && !opt_lazy_parsing && !passes_need_whole_program()) {
+    compile_streaming(tok, out);
+  }
+  else {
+    compile_whole(tok, out);
+  }
+
+  if (opt_compile_only) {
+    rewind(out);
+    assemble(read_stream(out), opt_output ? opt_output : "a.o");
+  }
+  fclose(out);
+  if (opt_stats) {
+    print_stats();
+  }
   return 0;
 }
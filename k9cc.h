@@ -1,12 +1,34 @@
 #ifndef K9CC_H
 #define K9CC_H
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////
+// k9cc.c
+#define PROFILE_DEFAULT_PATH "k9cc.prof"
+extern char *opt_profile_generate;  // カウンタを埋め込み、実行終了時にこのファイルへ書き出す
+extern char *opt_profile_use;       // このプロファイルを元にブロックを配置する
+extern bool opt_omit_frame_pointer; // 葉関数でrbpのフレームを作らない
+extern int opt_align_loops;         // align-loopsでループの先頭をそろえるバイト数
+extern int opt_align_jumps;         // align-jumpsでジャンプでしか入らない分岐先をそろえるバイト数
+extern bool opt_stats;              // 統計情報を標準エラーに出す
+extern int opt_unroll_factor;       // 部分展開で並べる本体の数
+extern int opt_lex_threads;         // 字句解析に使うスレッドの数
+extern bool opt_dump_tokens;        // トークン列を出力して終わる
+extern bool opt_streaming;          // 関数ごとに読んでコードを出す
+extern bool opt_lazy_parsing;       // mainからたどれる関数の本体だけを読む
+extern bool opt_compile_only;       // -c: オブジェクトファイルを直接書く
+extern char *opt_output;            // -o
+extern bool opt_debug_info;         // -g: 行番号と変数のデバッグ情報を出す
+extern bool opt_instrument_functions; // 関数ごとの呼び出し回数とサイクル数を数える
 
 ////////////////////////////////////////////////////////////////
 // lexer.c
 extern char *current_input;
+extern char *current_filename;
 
 typedef enum {
   TK_RESERVED,                  // Keywords or punctuators
@@ -15,23 +37,57 @@ typedef enum {
   TK_EOF,                       // End-of-file markers
 } TokenKind;
 
+// TK_RESERVEDのトークンの種類。字句解析で決めておき、構文解析は番号で比べる
+typedef enum {
+  TOK_NONE,                     // TK_RESERVEDでない
+  TOK_PUNCT,                    // 構文にない記号
+  TOK_EQ,                       // ==
+  TOK_NE,                       // !=
+  TOK_LE,                       // <=
+  TOK_GE,                       // >=
+  TOK_LT,                       // <
+  TOK_GT,                       // >
+  TOK_ASSIGN,                   // =
+  TOK_PLUS,                     // +
+  TOK_MINUS,                    // -
+  TOK_STAR,                     // *
+  TOK_SLASH,                    // /
+  TOK_AMP,                      // &
+  TOK_LPAREN,                   // (
+  TOK_RPAREN,                   // )
+  TOK_LBRACE,                   // {
+  TOK_RBRACE,                   // }
+  TOK_SEMICOLON,                // ;
+  TOK_COMMA,                    // ,
+  TOK_RETURN,                   // "return"
+  TOK_IF,                       // "if"
+  TOK_ELSE,                     // "else"
+  TOK_WHILE,                    // "while"
+  TOK_FOR,                      // "for"
+  TOK_INT,                      // "int"
+} TokenId;
+
+// トークンは配列に並べ、次のトークンはtok + 1。
+// 位置はソース先頭からのオフセットで持ち、行と桁は必要なときに求める。
 typedef struct Token Token;
 struct Token {
-  TokenKind kind;
-  Token *next;
-  long val;                     // kindがTK_NUMだったときその値
-  const char *loc;              // Token location
-  size_t len;                   // Token length
-  int column;                   // ソース中の桁番号
+  uint8_t kind;                 // TokenKind
+  uint8_t id;                   // TokenId
+  uint32_t loc;                 // Token location (current_inputからのオフセット)
+  uint32_t len;                 // Token length
+  uint32_t lit;                 // kindがTK_NUMだったときリテラル表の添字
 };
 
+const char *token_str(Token *tok);
 char *identdup(Token *tok);
 long get_number(Token *tok);
-bool equal(Token *tok, const char *op);
-Token *skip(Token *tok, const char *op);
+const char *token_id_str(TokenId id);
+bool equal(Token *tok, TokenId id);
+Token *skip(Token *tok, TokenId id);
 void dump_token_one(Token *tok);
 void dump_token(Token *tok);
 Token *tokenize(char *p);
+int token_count(void);
 
 ////////////////////////////////////////////////////////////////
 // parser.c
@@ -66,6 +122,8 @@ typedef struct Var Var;
 struct Var {
   const char *name;
   int offset;
+  int scope_begin;              // 寿命の始まり(ParseInfo.clockの値)
+  int scope_end;                // 寿命の終わり
 };
 
 typedef struct VarList VarList;
@@ -75,32 +133,56 @@ struct VarList{
 };
 
 // AST node type
+//
+// ノードはノードプールに置き、32ビットの番号(NodeId)で参照する。
+// 種類ごとに使うフィールドが違うので共用体に重ねている。
+typedef uint32_t NodeId;        // 0はnull
+
 typedef struct Node Node;
 struct Node {
-  NodeKind kind;
-  Node *next;                   // Next node
+  uint8_t kind;                 // NodeKind
+  NodeId next;                  // Next node
   Token *tok;
 
-  Node *lhs;                    // 左辺
-  Node *rhs;                    // 右辺
-  Var *var;                     // ND_VARのときに使う
-  int val;                      // ND_NUMのときに使う
+  union {
+    struct {
+      NodeId lhs;               // 左辺
+      NodeId rhs;               // 右辺
+    };
+    struct {
+      NodeId cond;              // if, while, for
+      NodeId then;              // if, while, for
+      union {
+        NodeId els;             // if
+        NodeId succ;            // for
+      };
+      NodeId init;              // for
+    };
+    NodeId body;                // block
+    struct {
+      char *name;               // funcall
+      NodeId args;              // arguments
+    };
+    Var *var;                   // ND_VARのときに使う
+    long val;                   // ND_NUMのときに使う
+  };
+};
 
-  Node *cond;                   // if, while, for
-  Node *then;                   // if, while, for
-  Node *els;                    // if
-  Node *init;                   // for
-  Node *succ;                   // for
+#define NODE_CHUNK_BITS 12
+#define NODE_CHUNK_SIZE (1 << NODE_CHUNK_BITS)
 
-  Node *body;                   // block
+extern Node **node_chunks;
 
-  char *name;                   // funcall
-  Node *args;                   // arguments
-};
+static inline Node *node_at(NodeId id) {
+  return id ? &node_chunks[id >> NODE_CHUNK_BITS][id & (NODE_CHUNK_SIZE - 1)] : NULL;
+}
 
 typedef struct ParseInfo {
   Token *tok;
-  VarList *locals;
+  VarList *locals;              // 関数内のすべての変数(宣言順)
+  VarList *scope;               // 見えている変数(内側が先頭)
+  VarList *block;               // 現在のブロックに入ったときのscope
+  int clock;                    // 変数の寿命を測る時刻
   int stack_size;
 } ParseInfo;
 
@@ -108,26 +190,129 @@ typedef struct Function Function;
 struct Function {
   Function *next;
   char *name;
+  Token *tok;                   // 関数名
   VarList *params;
-  Node *node;
+  NodeId node;
   VarList *locals;
   int stack_size;
+  long count;                   // --profile-useでの呼び出し回数(不明なら-1)
+  bool local;                   // ファイルの外に見せない(特殊化した複製など)
+  bool unlikely;                // 呼ばれないので.text.unlikelyに置く
 };
 
-void walk_real(Node *node, int depth);
+int node_count(void);
+int node_children(Node *node, NodeId *kids);
+NodeId node_new(NodeKind kind, Token *tok);
+NodeId node_dup(NodeId id);
+NodeId node_clone(NodeId id);
+Var *new_temp_var(Function *fn);
+void layout_locals(Function *fn);
+void walk_real(NodeId node, int depth);
 #define walk(node) walk_real(node, 0)
 
 Function *program(Token *tok);
+Function *next_function(Token **rest);
+Function *program_lazy(Token *tok);
+void print_parse_stats(void);
+void release_functions(void);
+
+////////////////////////////////////////////////////////////////
+// traverse.c
+typedef struct Traversal Traversal;
+
+#define VISIT_DONE -1
+#define TRAVERSE_LOCALS 4
+
+// ノードをstate(最初は0)で訪ね、次に呼んでほしい状態かVISIT_DONEを返す
+typedef int VisitFn(Traversal *t, NodeId id, int state, void *ctx);
+typedef bool PreFn(NodeId id, void *ctx);
+typedef void PostFn(NodeId id, void *ctx);
+
+void traverse(NodeId id, VisitFn *visit, void *ctx);
+void traverse_child(Traversal *t, NodeId id);
+void traverse_list(Traversal *t, NodeId id);
+int traverse_level(Traversal *t);
+long *traverse_locals(Traversal *t);
+void visit_nodes(NodeId id, PreFn *pre, PostFn *post, void *ctx);
+
+////////////////////////////////////////////////////////////////
+// pass.c
+typedef struct Pass Pass;
+
+// パスが働く段階
+typedef enum {
+  STAGE_AST,                    // 構文木を書き換える
+  STAGE_EMIT,                   // コード生成の中で命令の出し方を変える
+  STAGE_ASM,                    // 出力した関数のアセンブリを書き換える
+} PassStage;
+
+void pass_set_level(int level);
+int pass_level(void);
+bool pass_enable(const char *name, bool on);
+void pass_set_pipeline(const char *list);
+void pass_print_after(const char *name);
+void pass_setup(void);
+bool pass_enabled(const char *name);
+bool passes_need_whole_program(void);
+Function *run_passes(Function *prog);
+void pass_count(const char *name, long changes);
+void pass_start(const char *name);
+void pass_stop(const char *name);
+bool pass_prints_code(void);
+void pass_print_code(PassStage stage, const char *fn, const char *text);
+void print_pass_stats(void);
+
+////////////////////////////////////////////////////////////////
+// eval.c
+int eval_pure_calls(Function **prog);
+
+////////////////////////////////////////////////////////////////
+// ipcp.c
+int specialize_calls(Function **prog);
+
+////////////////////////////////////////////////////////////////
+// unroll.c
+int unroll_loops(Function **prog);
+
+////////////////////////////////////////////////////////////////
+// cse.c
+int eliminate_common_subexprs(Function **prog);
+
+////////////////////////////////////////////////////////////////
+// reorder.c
+int reorder_functions(Function **prog);
 
 ////////////////////////////////////////////////////////////////
 /// codegen.c
-void codegen(Function *prog);
+void codegen_begin(FILE *out);
+void codegen_func(Function *fun);
+void codegen_end(void);
+void codegen(Function *prog, FILE *out);
+void print_codegen_stats(void);
+
+////////////////////////////////////////////////////////////////
+// cfg.c
+int optimize_cfg(char *text, FILE *out, const char *name, int *insns);
+char *invert_cc(const char *cc);
+
+////////////////////////////////////////////////////////////////
+// asm.c
+void assemble(char *text, const char *path);
+
+////////////////////////////////////////////////////////////////
+// profile.c
+int profile_counter(char *name);
+int profile_ncounters(void);
+char *profile_counter_name(int idx);
+void profile_load(const char *path);
+long profile_count(const char *name);
 
 ////////////////////////////////////////////////////////////////
 // report.c
 void error(const char *fmt, ...);
 void error_tok(Token *tok, const char *fmt, ...);
 void error_at(char *pos, const char *fmt, ...);
+void source_position(uint32_t offset, int *line, int *column);
 void va_report(const char*fmt, va_list ap);
 void report(const char *fmt, ...);
 #define dbgf(fmt, ...)                                                  \
@@ -141,3 +326,29 @@ void report(const char *fmt, ...);
 // utility.c
 char *strndup(const char *s, size_t n);
 size_t startswith(const char *s, const char *key);
+char *format(const char *fmt, ...);
+char *read_stream(FILE *fp);
+
+typedef struct HashEntry {
+  const char *key;
+  void *val;
+} HashEntry;
+
+typedef struct HashMap {
+  HashEntry *buckets;
+  int capacity;
+  int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, const char *key);
+void hashmap_put(HashMap *map, const char *key, void *val);
+void hashmap_free(HashMap *map);
+
+typedef struct ArenaBlock ArenaBlock;
+typedef struct Arena {
+  ArenaBlock *blocks;           // 先頭が今使っているブロック
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *s, size_t n);
+void arena_reset(Arena *arena);
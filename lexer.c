@@ -4,9 +4,39 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "k9cc.h"
 
 char *current_input;
+char *current_filename;
+
+#define LEX_MIN_CHUNK 4096       // 1スレッドに任せる入力の最小の大きさ
+
+// 数値リテラルの値。TokenにはこのTK_NUMの添字だけ持たせる
+static long *literals;
+
+// トークン列(最後はTK_EOF)
+static Token *tokens;
+static int ntokens;
+
+// 入力の一部分を字句解析した結果。
+// 並列に字句解析するときはスレッドごとに持ち、最後につなぎ合わせる
+typedef struct Lexer {
+  char *begin;                  // 担当する範囲
+  char *end;
+  Token *tokens;
+  int ntokens;
+  int token_capacity;
+  long *literals;
+  int nliterals;
+  int literal_capacity;
+  char *error_loc;              // 不正なトークンの位置(なければNULL)
+} Lexer;
+
+int token_count(void) {
+  return ntokens;
+}
 
 // 名前に使える1文字目
 static int is_nameletter1(char c) {
@@ -18,50 +48,67 @@ static int is_nameletter2(char c) {
   return is_nameletter1(c) || isdigit(c);
 }
 
+// トークンの文字列の先頭
+const char *token_str(Token *tok) {
+  return current_input + tok->loc;
+}
+
 // identを切り出して返す
 char *identdup(Token *tok) {
   if (tok->kind != TK_IDENT) {
     error_tok(tok, "token type is not TK_IDENT");
   }
-  return strndup(tok->loc, tok->len);
+  return strndup(token_str(tok), tok->len);
 }
 
 long get_number(Token *tok) {
   if (!tok || tok->kind != TK_NUM) {
     error_tok(tok, "lexser/数字が必要です");
   }
-  return tok->val;
+  return literals[tok->lit];
 }
 
-bool equal(Token *tok, const char *op) {
-  if (!tok || tok->kind != TK_RESERVED) {
-    return false;
-  }
-  return strlen(op) == tok->len && !strncmp(tok->loc, op, tok->len);
+static const char *token_names[] = {
+  [TOK_EQ] = "==", [TOK_NE] = "!=", [TOK_LE] = "<=", [TOK_GE] = ">=",
+  [TOK_LT] = "<", [TOK_GT] = ">", [TOK_ASSIGN] = "=",
+  [TOK_PLUS] = "+", [TOK_MINUS] = "-", [TOK_STAR] = "*", [TOK_SLASH] = "/",
+  [TOK_AMP] = "&", [TOK_LPAREN] = "(", [TOK_RPAREN] = ")",
+  [TOK_LBRACE] = "{", [TOK_RBRACE] = "}", [TOK_SEMICOLON] = ";", [TOK_COMMA] = ",",
+  [TOK_RETURN] = "return", [TOK_IF] = "if", [TOK_ELSE] = "else",
+  [TOK_WHILE] = "while", [TOK_FOR] = "for", [TOK_INT] = "int",
+};
+
+// エラーメッセージ用の綴り
+const char *token_id_str(TokenId id) {
+  return id < sizeof(token_names) / sizeof(*token_names) && token_names[id] ? token_names[id] : "?";
+}
+
+bool equal(Token *tok, TokenId id) {
+  return tok && tok->id == id;
 }
 
-Token *skip(Token *tok, const char *op) {
-  if (!equal(tok, op)) {
-    error_tok(tok, "lexser/expected '%s'", op);
+Token *skip(Token *tok, TokenId id) {
+  if (!equal(tok, id)) {
+    error_tok(tok, "lexser/expected '%s'", token_id_str(id));
   }
-  return tok->next;
+  return tok + 1;
 }
 
 void dump_token_one(Token *tok) {
   char *s;
   switch (tok->kind) {
   case TK_RESERVED:
-    s = strndup(tok->loc, tok->len);
+    s = strndup(token_str(tok), tok->len);
     report("[TK_RESERVED] %s\n", s);
     free(s);
     break;
   case TK_IDENT:
-    s = strndup(tok->loc, tok->len);
+    s = strndup(token_str(tok), tok->len);
     report("[TK_IDENT] %s\n", s);
     free(s);
     break;
   case TK_NUM:
-    report("[TK_NUM] %ld\n", tok->val);
+    report("[TK_NUM] %ld\n", literals[tok->lit]);
     break;
   case TK_EOF:
     report("[TK_EOF]\n");
@@ -72,108 +119,225 @@ void dump_token_one(Token *tok) {
 }
 void dump_token(Token *tok) {
   report("\n** Token\n");
-  for (; tok; tok = tok->next) {
+  for (;; tok++) {
     dump_token_one(tok);
+    if (tok->kind == TK_EOF) {
+      break;
+    }
   }
 }
 
-// tokenを作成してcurにつなげる
-static Token *new_token(TokenKind kind, Token *cur, const char *str, int len, int column) {
-  Token *tok = calloc(1, sizeof(Token));
+// tokenを作成してトークン列の末尾に足す。
+// 列は伸ばすときに動くので、戻り値は次のnew_tokenまでしか使えない
+static Token *new_token(Lexer *lx, TokenKind kind, const char *str, int len) {
+  if (lx->ntokens == lx->token_capacity) {
+    lx->token_capacity = lx->token_capacity ? lx->token_capacity * 2 : 1024;
+    lx->tokens = realloc(lx->tokens, sizeof(Token) * lx->token_capacity);
+  }
+  Token *tok = &lx->tokens[lx->ntokens++];
+  memset(tok, 0, sizeof(Token));
   tok->kind = kind;
-  tok->loc = str;
+  tok->loc = str - current_input;
   tok->len = len;
-  tok->column = column;
-  cur->next = tok;
   return tok;
 }
 
-// srcからkeywordが見つかったらトークンのチェーンにつなげてtrueを返す
-static size_t keyword(Token **pcur, char **psrc, const char *keyword, int column) {
-  size_t len = startswith(*psrc, keyword);
-  if (len && !is_nameletter2((*psrc)[len])) {
-    *pcur = new_token(TK_RESERVED, *pcur, *psrc, len, column);
-    *psrc += len;
-    return len;
+static int new_literal(Lexer *lx, long val) {
+  if (lx->nliterals == lx->literal_capacity) {
+    lx->literal_capacity = lx->literal_capacity ? lx->literal_capacity * 2 : 256;
+    lx->literals = realloc(lx->literals, sizeof(long) * lx->literal_capacity);
   }
-  return 0;
+  lx->literals[lx->nliterals] = val;
+  return lx->nliterals++;
 }
 
-// Tokenize p and returns new tokens.
-Token *tokenize(char *src) {
-  Token head = {};
-  Token *cur = &head;
-  int column = 0;
+// 1文字の記号
+static const uint8_t punct_ids[128] = {
+  ['<'] = TOK_LT, ['>'] = TOK_GT, ['='] = TOK_ASSIGN,
+  ['+'] = TOK_PLUS, ['-'] = TOK_MINUS, ['*'] = TOK_STAR, ['/'] = TOK_SLASH,
+  ['&'] = TOK_AMP, ['('] = TOK_LPAREN, [')'] = TOK_RPAREN,
+  ['{'] = TOK_LBRACE, ['}'] = TOK_RBRACE, [';'] = TOK_SEMICOLON, [','] = TOK_COMMA,
+};
 
-  current_input = src;
-  while (*src) {
+// 予約語の完全ハッシュ表。(先頭の文字 * 2 + 長さ) % 8 がすべて異なる
+#define KEYWORD_HASH(c, len) ((2 * (unsigned char)(c) + (len)) & 7)
+
+static const struct {
+  const char *name;
+  size_t len;
+  TokenId id;
+} keyword_table[8] = {
+  [KEYWORD_HASH('r', 6)] = {"return", 6, TOK_RETURN},
+  [KEYWORD_HASH('i', 2)] = {"if", 2, TOK_IF},
+  [KEYWORD_HASH('e', 4)] = {"else", 4, TOK_ELSE},
+  [KEYWORD_HASH('w', 5)] = {"while", 5, TOK_WHILE},
+  [KEYWORD_HASH('f', 3)] = {"for", 3, TOK_FOR},
+  [KEYWORD_HASH('i', 3)] = {"int", 3, TOK_INT},
+};
+
+// 名前が予約語ならそのID、そうでなければTOK_NONE
+static TokenId keyword_id(const char *s, size_t len) {
+  int h = KEYWORD_HASH(s[0], len);
+  if (keyword_table[h].len == len && !memcmp(keyword_table[h].name, s, len)) {
+    return keyword_table[h].id;
+  }
+  return TOK_NONE;
+}
+
+// lx->beginからlx->endまでを字句解析する。
+// 不正なトークンがあればそこで止まり、位置をerror_locに残す
+static void *tokenize_range(void *arg) {
+  Lexer *lx = arg;
+  char *src = lx->begin;
+
+  while (src < lx->end) {
     if (isspace(*src)) {
       src++;
       continue;
     }
 
-    column = src - current_input;
     // 数字
     if (isdigit(*src)) {
-      cur = new_token(TK_NUM, cur, src, 0, column);
       char *p = src;
-      cur->val = strtol(src, &src, 10);
-      cur->len = src - p;
+      long val = strtol(src, &src, 10);
+      int lit = new_literal(lx, val);
+      new_token(lx, TK_NUM, p, src - p)->lit = lit;
       continue;
     }
 
     // Multi-letter punctuators
-    static char *punctuators[] = {
-      "==", "!=",
-      "<=", ">=",
-      NULL
-    };
-    char **punc;
-    for (punc = punctuators; *punc; punc++) {
-      size_t len = strlen(*punc);
-      if (!strncmp(src, *punc, len)) {
-        cur = new_token(TK_RESERVED, cur, src, len, column);
-        src += len;
-        break;
+    if (src[1] == '=') {
+      TokenId id = src[0] == '=' ? TOK_EQ : src[0] == '!' ? TOK_NE :
+        src[0] == '<' ? TOK_LE : src[0] == '>' ? TOK_GE : TOK_NONE;
+      if (id) {
+        new_token(lx, TK_RESERVED, src, 2)->id = id;
+        src += 2;
+        continue;
       }
     }
-    if (*punc) {
-      continue;
-    }
 
     // Single-letter punctuators
     if (ispunct(*src)) {
-      cur = new_token(TK_RESERVED, cur, src++, 1, column);
+      uint8_t id = punct_ids[*src & 0x7f];
+      new_token(lx, TK_RESERVED, src++, 1)->id = id ? id : TOK_PUNCT;
       continue;
     }
 
-    static char *keywords[] = {
-      "return", "if", "else", "while", "for", "int"
-      , NULL
-    };
-    char **kwd = keywords;
-    for (; *kwd; kwd++) {
-      if (keyword(&cur, &src, *kwd, column)) {
-        break;
-      }
-    }
-    if (*kwd) {
-      continue;
-    }
-
-    // Identifire
+    // Keywords and identifiers
     if (isalpha(*src)) {
       char *p;
       for (p = src + 1; *p && is_nameletter2(*p); p++)
         ;
-      cur = new_token(TK_IDENT, cur, src, p - src, column);
+      TokenId id = keyword_id(src, p - src);
+      new_token(lx, id ? TK_RESERVED : TK_IDENT, src, p - src)->id = id;
       src = p;
       continue;
     }
 
-    error_at(src, "lexser/invalid token");
+    lx->error_loc = src;
+    break;
+  }
+  return NULL;
+}
+
+// 入力をおよそn等分する。トークンの途中で切らないよう、
+// 切れ目は空白まで進める(文字列やコメントはまだないので空白は常にトークンの外)
+static int split_input(char *src, size_t len, Lexer *chunks, int n) {
+  char *end = src + len;
+  char *begin = src;
+  int nchunks = 0;
+  for (int i = 1; i <= n && begin < end; i++) {
+    char *cut = i == n ? end : src + len / n * i;
+    if (cut < begin) {
+      cut = begin;
+    }
+    while (cut < end && !isspace(*cut)) {
+      cut++;
+    }
+    if (cut == begin) {
+      continue;
+    }
+    memset(&chunks[nchunks], 0, sizeof(Lexer));
+    chunks[nchunks].begin = begin;
+    chunks[nchunks].end = cut;
+    nchunks++;
+    begin = cut;
+  }
+  return nchunks;
+}
+
+// Tokenize p and returns new tokens.
+Token *tokenize(char *src) {
+  current_input = src;
+  size_t len = strlen(src);
+  if (UINT32_MAX <= len) {
+    error("input too large");
+  }
+
+  // 小さい入力はスレッドを立てるほうが高くつく
+  int nthreads = opt_lex_threads;
+  if (len / LEX_MIN_CHUNK < nthreads) {
+    nthreads = len / LEX_MIN_CHUNK;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
 
+  Lexer *chunks = calloc(nthreads, sizeof(Lexer));
+  int nchunks = split_input(src, len, chunks, nthreads);
+  if (nchunks == 1) {
+    tokenize_range(&chunks[0]);
+  }
+  else {
+    pthread_t *threads = calloc(nchunks, sizeof(pthread_t));
+    for (int i = 0; i < nchunks; i++) {
+      if (pthread_create(&threads[i], NULL, tokenize_range, &chunks[i])) {
+        error("cannot create a lexer thread");
+      }
+    }
+    for (int i = 0; i < nchunks; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    free(threads);
   }
-  new_token(TK_EOF, cur, src, 0, column);
-  return head.next;
+
+  // エラーは入力の先頭に近いものを報告するので、スレッド数によらない
+  for (int i = 0; i < nchunks; i++) {
+    if (chunks[i].error_loc) {
+      error_at(chunks[i].error_loc, "lexser/invalid token");
+    }
+  }
+
+  // チャンクごとのトークン列をつなぎ、リテラルの添字をずらす
+  int total = 1, nlits = 0;
+  for (int i = 0; i < nchunks; i++) {
+    total += chunks[i].ntokens;
+    nlits += chunks[i].nliterals;
+  }
+  free(tokens);
+  free(literals);
+  tokens = calloc(total, sizeof(Token));
+  literals = calloc(nlits + 1, sizeof(long));
+  ntokens = 0;
+  nlits = 0;
+  for (int i = 0; i < nchunks; i++) {
+    Lexer *lx = &chunks[i];
+    for (int j = 0; j < lx->ntokens; j++) {
+      Token *tok = &tokens[ntokens++];
+      *tok = lx->tokens[j];
+      if (tok->kind == TK_NUM) {
+        tok->lit += nlits;
+      }
+    }
+    memcpy(literals + nlits, lx->literals, sizeof(long) * lx->nliterals);
+    nlits += lx->nliterals;
+    free(lx->tokens);
+    free(lx->literals);
+  }
+  free(chunks);
+
+  Token *eof = &tokens[ntokens++];
+  eof->kind = TK_EOF;
+  eof->loc = len;
+  return tokens;
 }
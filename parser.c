@@ -3,176 +3,378 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <assert.h>
 #include "k9cc.h"
 
-static Node *new_node(ParseInfo *info, NodeKind kind) {
-  Node *node = calloc(1, sizeof(Node));
-  node->kind = kind;
-  node->tok = info->tok;
-  return node;
+// ノードプール。ノードは固定長のチャンクに確保するので、
+// プールが伸びてもNode *は動かない
+Node **node_chunks;
+static int nchunks;
+static NodeId nnodes = 1;       // 0はnull
+
+// ノード以外の関数の部品(変数、名前)を置く領域
+static Arena arena;
+
+static NodeId alloc_node(void) {
+  if ((nnodes >> NODE_CHUNK_BITS) == nchunks) {
+    node_chunks = realloc(node_chunks, sizeof(Node *) * (nchunks + 1));
+    node_chunks[nchunks++] = calloc(NODE_CHUNK_SIZE, sizeof(Node));
+  }
+  // release_functionsのあとはチャンクを使い回すので毎回0にする
+  memset(node_at(nnodes), 0, sizeof(Node));
+  return nnodes++;
 }
 
-static Node *new_binary(ParseInfo *info, NodeKind kind, Node *lhs, Node *rhs) {
-  Node *node = new_node(info, kind);
-  node->lhs = lhs;
-  node->rhs = rhs;
-  node->tok = info->tok;
-  return node;
+// これまでに読んだ関数のノードと変数をすべて捨てる。
+// チャンクとアリーナの最初のブロックは次の関数で使い回す
+void release_functions(void) {
+  nnodes = 1;
+  arena_reset(&arena);
 }
 
-static Node *new_num(ParseInfo *info, long val) {
-  Node *node = new_node(info, ND_NUM);
-  node->val = val;
-  node->tok = info->tok;
-  return node;
+// 確保済みのノード数
+int node_count(void) {
+  return nnodes - 1;
 }
 
-static void walk_one(Node *node, int depth) {
-  report("%*s", depth, "");
-  if (!node) {
-    report("_\n");
-    return;
-  }
-  else if (node->kind == ND_NUM) {
-    report("num: %ld\n", node->val);
-    return;
-  }
-  else if (node->kind == ND_VAR) {
-    report("var: %s\n", node->var->name);
-    return;
-  }
-  else if (node->kind == ND_IF) {
-    report("if:\n");
-    report("cond:\n");
-    walk_one(node->cond, depth + 2);
-    report("then-clause:\n");
-    walk_one(node->then, depth + 2);
-    if (node->els) {
-      report("else-clause:\n");
-      walk_one(node->els, depth + 2);
-    }
-    return;
-  }
-  else if (node->kind == ND_WHILE) {
-    report("while:\n");
-    report("cond:\n");
-    walk_one(node->cond, depth + 2);
-    report("then:\n");
-    walk_one(node->then, depth + 2);
-    return;
-  }
-  else if (node->kind == ND_FOR) {
-    report("while:\n");
-    report("init:\n");
-    walk_one(node->init, depth + 2);
-    report("cond:\n");
-    walk_one(node->cond, depth + 2);
-    report("succ:\n");
-    walk_one(node->succ, depth + 2);
-    report("then:\n");
-    walk_one(node->then, depth + 2);
-    return;
-  }
-  else if (node->kind == ND_FUNCALL) {
-    report("funcall: %s\n", node->name);
-    return;
-  }
-  char *op;
+// nodeの子を返す。文や引数の並びはその先頭を返す
+int node_children(Node *node, NodeId *kids) {
+  int n = 0;
   switch (node->kind) {
   case ND_ADD:
-    op = "+";
-    break;
   case ND_SUB:
-    op = "-";
-    break;
   case ND_MUL:
-    op = "*";
-    break;
   case ND_DIV:
-    op = "/";
-    break;
   case ND_EQ:
-    op = "==";
-    break;
   case ND_NE:
-    op = "!=";
-    break;
   case ND_LT:
-    op = "<";
-    break;
   case ND_LE:
-    op = "<=";
-    break;
   case ND_ASSIGN:
-    op = "=";
+    kids[n++] = node->lhs;
+    kids[n++] = node->rhs;
     break;
+  case ND_ADDR:
+  case ND_DEREF:
   case ND_RETURN:
-    op = "return";
-    break;
   case ND_EXPR_STMT:
-    op = "expr";
+    kids[n++] = node->lhs;
+    break;
+  case ND_IF:
+    kids[n++] = node->cond;
+    kids[n++] = node->then;
+    if (node->els) {
+      kids[n++] = node->els;
+    }
+    break;
+  case ND_WHILE:
+    kids[n++] = node->cond;
+    kids[n++] = node->then;
+    break;
+  case ND_FOR:
+    if (node->init) {
+      kids[n++] = node->init;
+    }
+    if (node->cond) {
+      kids[n++] = node->cond;
+    }
+    if (node->succ) {
+      kids[n++] = node->succ;
+    }
+    kids[n++] = node->then;
+    break;
+  case ND_BLOCK:
+    if (node->body) {
+      kids[n++] = node->body;
+    }
+    break;
+  case ND_FUNCALL:
+    if (node->args) {
+      kids[n++] = node->args;
+    }
     break;
   default:
-    report("unknown kind\n");
-    return;
+    break;
   }
-  if (op) {
-    report("OP[%s]:\n", op);
+  return n;
+}
+
+// 最適化パスがノードを作るときに使う
+NodeId node_new(NodeKind kind, Token *tok) {
+  NodeId id = alloc_node();
+  Node *node = node_at(id);
+  node->kind = kind;
+  node->tok = tok;
+  return id;
+}
+
+// nodeだけを複製する(子は共有する)。nextは切る
+NodeId node_dup(NodeId id) {
+  NodeId dup = alloc_node();
+  *node_at(dup) = *node_at(id);
+  node_at(dup)->next = 0;
+  return dup;
+}
+
+// nextでつながった並びを、nodeだけ複製した並びにする
+static NodeId dup_list(NodeId id) {
+  NodeId head = 0;
+  NodeId *link = &head;
+  for (NodeId cur = id; cur; cur = node_at(cur)->next) {
+    *link = node_dup(cur);
+    link = &node_at(*link)->next;
   }
-  walk_real(node->lhs, depth + 2);
-  walk_real(node->rhs, depth + 2);
+  return head;
 }
-void walk_real(Node *node, int depth) {
-  for (Node *cur = node; cur; cur = cur->next) {
-    walk_one(cur, depth);
+
+static NodeId dup_child(Traversal *t, NodeId id) {
+  if (!id) {
+    return 0;
   }
+  NodeId dup = node_dup(id);
+  traverse_child(t, dup);
+  return dup;
+}
+
+// 複製したノードの子はまだ元の木を指しているので、複製に差し替えて訪ねる
+static int clone_step(Traversal *t, NodeId id, int state, void *ctx) {
+  Node *node = node_at(id);
+  switch (node->kind) {
+  case ND_IF:
+  case ND_WHILE:
+  case ND_FOR:
+    node->cond = dup_child(t, node->cond);
+    node->then = dup_child(t, node->then);
+    node->els = dup_child(t, node->els);
+    node->init = dup_child(t, node->init);
+    break;
+  case ND_BLOCK:
+  case ND_FUNCALL: {
+    // 並びはnextごと複製する
+    NodeId *link = node->kind == ND_BLOCK ? &node->body : &node->args;
+    *link = dup_list(*link);
+    traverse_list(t, *link);
+    break;
+  }
+  default: {
+    NodeId kids[4];
+    int n = node_children(node, kids);
+    if (0 < n) {
+      node->lhs = dup_child(t, kids[0]);
+    }
+    if (1 < n) {
+      node->rhs = dup_child(t, kids[1]);
+    }
+    break;
+  }
+  }
+  return VISIT_DONE;
+}
+
+// 部分木を丸ごと複製する。変数は共有し、根のnextは切る
+NodeId node_clone(NodeId id) {
+  NodeId dup = node_dup(id);
+  traverse(dup, clone_step, NULL);
+  return dup;
+}
+
+static NodeId new_node(ParseInfo *info, NodeKind kind) {
+  NodeId id = alloc_node();
+  Node *node = node_at(id);
+  node->kind = kind;
+  node->tok = info->tok;
+  return id;
+}
+
+static NodeId new_unary(ParseInfo *info, NodeKind kind, NodeId lhs) {
+  NodeId id = new_node(info, kind);
+  node_at(id)->lhs = lhs;
+  return id;
+}
+
+static NodeId new_binary(ParseInfo *info, NodeKind kind, NodeId lhs, NodeId rhs) {
+  NodeId id = new_node(info, kind);
+  Node *node = node_at(id);
+  node->lhs = lhs;
+  node->rhs = rhs;
+  return id;
+}
+
+static NodeId new_num(ParseInfo *info, long val) {
+  NodeId id = new_node(info, ND_NUM);
+  node_at(id)->val = val;
+  return id;
+}
+
+// 子を1つ表示する。なければ"_"
+static void walk_child(Traversal *t, NodeId id, int depth) {
+  if (id) {
+    traverse_child(t, id);
+  }
+  else {
+    report("%*s_\n", depth + 2, "");
+  }
+}
+
+static const char *walk_op_name(NodeKind kind) {
+  switch (kind) {
+  case ND_ADD: return "+";
+  case ND_SUB: return "-";
+  case ND_MUL: return "*";
+  case ND_DIV: return "/";
+  case ND_EQ: return "==";
+  case ND_NE: return "!=";
+  case ND_LT: return "<";
+  case ND_LE: return "<=";
+  case ND_ASSIGN: return "=";
+  case ND_ADDR: return "&";
+  case ND_DEREF: return "deref";
+  case ND_RETURN: return "return";
+  case ND_EXPR_STMT: return "expr";
+  default: return NULL;
+  }
+}
+
+static int walk_step(Traversal *t, NodeId id, int state, void *ctx) {
+  Node *node = node_at(id);
+  int depth = *(int *)ctx + traverse_level(t) * 2;
+
+  switch (node->kind) {
+  case ND_NUM:
+    report("%*snum: %ld\n", depth, "", node->val);
+    return VISIT_DONE;
+  case ND_VAR:
+    report("%*svar: %s\n", depth, "", node->var->name);
+    return VISIT_DONE;
+  case ND_IF:
+    switch (state) {
+    case 0:
+      report("%*sif:\n", depth, "");
+      report("%*scond:\n", depth, "");
+      traverse_list(t, node->cond);
+      return 1;
+    case 1:
+      report("%*sthen-clause:\n", depth, "");
+      traverse_list(t, node->then);
+      return node->els ? 2 : VISIT_DONE;
+    default:
+      report("%*selse-clause:\n", depth, "");
+      traverse_list(t, node->els);
+      return VISIT_DONE;
+    }
+  case ND_WHILE:
+    if (state == 0) {
+      report("%*swhile:\n", depth, "");
+      report("%*scond:\n", depth, "");
+      traverse_list(t, node->cond);
+      return 1;
+    }
+    report("%*sthen:\n", depth, "");
+    traverse_list(t, node->then);
+    return VISIT_DONE;
+  case ND_FOR:
+    switch (state) {
+    case 0:
+      report("%*sfor:\n", depth, "");
+      report("%*sinit:\n", depth, "");
+      walk_child(t, node->init, depth);
+      return 1;
+    case 1:
+      report("%*scond:\n", depth, "");
+      walk_child(t, node->cond, depth);
+      return 2;
+    case 2:
+      report("%*ssucc:\n", depth, "");
+      walk_child(t, node->succ, depth);
+      return 3;
+    default:
+      report("%*sthen:\n", depth, "");
+      traverse_list(t, node->then);
+      return VISIT_DONE;
+    }
+  case ND_FUNCALL:
+    report("%*sfuncall: %s\n", depth, "", node->name);
+    traverse_list(t, node->args);
+    return VISIT_DONE;
+  case ND_BLOCK:
+    report("%*sblock:\n", depth, "");
+    traverse_list(t, node->body);
+    return VISIT_DONE;
+  case ND_NOP:
+    report("%*snop\n", depth, "");
+    return VISIT_DONE;
+  default:
+    break;
+  }
+
+  const char *op = walk_op_name(node->kind);
+  if (!op) {
+    report("%*sunknown kind\n", depth, "");
+    return VISIT_DONE;
+  }
+  report("%*sOP[%s]:\n", depth, "", op);
+  NodeId kids[4];
+  int n = node_children(node, kids);
+  for (int i = 0; i < n; i++) {
+    traverse_list(t, kids[i]);
+  }
+  return VISIT_DONE;
+}
+
+void walk_real(NodeId node, int depth) {
+  traverse(node, walk_step, &depth);
 }
 
 static Function *funcdef(ParseInfo *info);
+static Function *func_signature(ParseInfo *info);
+static void func_body(ParseInfo *info, Function *func);
 static VarList *params(ParseInfo *info);
-static Node *stmt(ParseInfo *info);
-static Node *var_def(ParseInfo *info);
-static Node *expr_stmt(ParseInfo *info);
-static Node *expr(ParseInfo *info);
-static Node *assign(ParseInfo *info);
-static Node *equality(ParseInfo *info);
-static Node *relational(ParseInfo *info);
-static Node *add(ParseInfo *info);
-static Node *mul(ParseInfo *info);
-static Node *unary(ParseInfo *info);
-static Node *func_args(ParseInfo *info);
-static Node *primary(ParseInfo *info);
+static NodeId stmt(ParseInfo *info);
+static NodeId var_def(ParseInfo *info);
+static NodeId expr_stmt(ParseInfo *info);
+static NodeId expr(ParseInfo *info);
+static bool primary(ParseInfo *info);
 
 static ParseInfo *advance_tok(ParseInfo *info) {
-  info->tok = info->tok->next;
+  if (info->tok->kind != TK_EOF) {
+    info->tok++;
+  }
   return info;
 }
-static ParseInfo *skip_tok(ParseInfo *info, const char *key) {
-  info->tok = skip(info->tok, key);
+static ParseInfo *skip_tok(ParseInfo *info, TokenId id) {
+  info->tok = skip(info->tok, id);
   return info;
 }
 static bool at_eot(ParseInfo *info) {
   return info->tok->kind == TK_EOF;
 }
-static bool peek(ParseInfo *info, const char *key) {
-  return info->tok->kind == TK_RESERVED && equal(info->tok, key);
+static bool peek(ParseInfo *info, TokenId id) {
+  return info->tok->id == id;
 }
-static bool consume(ParseInfo *info, const char *key) {
-  if (peek(info, key)) {
-    skip_tok(info, key);
+static bool consume(ParseInfo *info, TokenId id) {
+  if (peek(info, id)) {
+    info->tok++;
     return true;
   }
   return false;
 }
+// 識別子の名前をアリーナに切り出す
+static char *ident_name(Token *tok) {
+  if (tok->kind != TK_IDENT) {
+    error_tok(tok, "token type is not TK_IDENT");
+  }
+  return arena_strndup(&arena, token_str(tok), tok->len);
+}
+
 static char *expect_ident(ParseInfo *info) {
-  char *r = identdup(info->tok);
+  char *r = ident_name(info->tok);
   advance_tok(info);
   return r;
 }
 
-// 変数を探す
-static Var *find_var(VarList *vl, const char *ident) {
-  for (; vl; vl = vl->next) {
+// 変数を探す。vlからendの手前まで
+static Var *find_var(VarList *vl, VarList *end, const char *ident) {
+  for (; vl != end; vl = vl->next) {
     if (strcmp(vl->var->name, ident) == 0) {
       return vl->var;
     }
@@ -180,52 +382,129 @@ static Var *find_var(VarList *vl, const char *ident) {
   return NULL;
 }
 
-// 変数を探す。見つからなかったときはエラー
-static Var *detect_var(VarList *vl, const char *ident, ParseInfo *info) {
-  Var *v = find_var(vl, ident);
+// 見えている変数を探す。見つからなかったときはエラー
+static Var *detect_var(const char *ident, Token *tok, ParseInfo *info) {
+  Var *v = find_var(info->scope, NULL, ident);
   if (!v) {
-    error_tok(info->tok, "unknown variable: %s", ident);
+    error_tok(tok, "unknown variable: %s", ident);
   }
   return v;
 }
 
-// 変数作る。すでに変数が存在していたときはエラー
-static Var *new_var(VarList *vl, const char *ident, ParseInfo *info) {
-  Var *v = find_var(vl, ident);
+// 変数作る。同じブロックにすでに変数が存在していたときはエラー
+static Var *new_var(const char *ident, ParseInfo *info) {
+  Var *v = find_var(info->scope, info->block, ident);
 
   if (v) {
     error_tok(info->tok, "duplicate variable definition: %s", ident);
   }
 
-  v = calloc(1, sizeof(Var));
+  v = arena_alloc(&arena, sizeof(Var));
   v->name = ident;
-  for (VarList *nvl = vl; ; nvl = nvl->next) {
+  v->scope_begin = info->clock++;
+  v->scope_end = INT_MAX;
+  for (VarList *nvl = info->locals; ; nvl = nvl->next) {
     if (!nvl->next) {
-      nvl->next = calloc(sizeof(VarList), 1);
+      nvl->next = arena_alloc(&arena, sizeof(VarList));
       nvl->next->var = v;
       break;
     }
   }
+
+  VarList *sc = arena_alloc(&arena, sizeof(VarList));
+  sc->var = v;
+  sc->next = info->scope;
+  info->scope = sc;
   return v;
 }
 
+// ブロックに入る。戻り値はleave_blockに渡す
+static VarList *enter_block(ParseInfo *info) {
+  VarList *outer = info->block;
+  info->block = info->scope;
+  return outer;
+}
+
+// ブロックを抜ける。ブロック内の変数の寿命はここまで
+static void leave_block(ParseInfo *info, VarList *outer) {
+  for (VarList *vl = info->scope; vl != info->block; vl = vl->next) {
+    vl->var->scope_end = info->clock;
+  }
+  info->clock++;
+  info->scope = info->block;
+  info->block = outer;
+}
+
+// 寿命が重ならない変数には同じスロットを割り当てる。
+// localsは宣言順(寿命の始まり順)に並んでいるので、
+// 空いているスロットのうち一番浅いものを貪欲に選ぶ。
 // returns stacksize
 static int set_locals(VarList *locals) {
-  size_t offset = 0;
+  int nslots = 0, capacity = 16;
+  int *slot_end = calloc(capacity, sizeof(int));
+
   for (VarList *v = locals; v; v = v->next) {
-    offset += 8;
-    v->var->offset = offset;
+    int slot;
+    for (slot = 0; slot < nslots; slot++) {
+      if (slot_end[slot] <= v->var->scope_begin) {
+        break;
+      }
+    }
+    if (slot == nslots) {
+      if (nslots == capacity) {
+        capacity *= 2;
+        slot_end = realloc(slot_end, capacity * sizeof(int));
+      }
+      nslots++;
+    }
+    slot_end[slot] = v->var->scope_end;
+    v->var->offset = (slot + 1) * 8;
   }
-  return offset;
+  free(slot_end);
+  return nslots * 8;
+}
+
+// 最適化パスが使う一時変数。寿命は関数全体とする
+Var *new_temp_var(Function *fn) {
+  static int ntemps;
+  Var *var = arena_alloc(&arena, sizeof(Var));
+  char name[32];
+  snprintf(name, sizeof(name), ".t%d", ntemps++);
+  var->name = arena_strndup(&arena, name, strlen(name));
+  var->scope_begin = 0;
+  var->scope_end = INT_MAX;
+
+  VarList *vl = arena_alloc(&arena, sizeof(VarList));
+  vl->var = var;
+  VarList **link = &fn->locals;
+  while (*link) {
+    link = &(*link)->next;
+  }
+  *link = vl;
+  return var;
+}
+
+// 変数を足したあとでスロットを割り当て直す
+void layout_locals(Function *fn) {
+  fn->stack_size = set_locals(fn->locals);
+}
+
+// 関数定義を1つ読み、*restを次の関数の先頭に進める。
+// 入力の終わりならNULLを返す
+Function *next_function(Token **rest) {
+  ParseInfo info = {};
+  info.tok = *rest;
+  if (at_eot(&info)) {
+    return NULL;
+  }
+  Function *fun = funcdef(&info);
+  *rest = info.tok;
+  return fun;
 }
 
 Function *program(Token *tok) {
   Function top, *fun = &top;
-  ParseInfo info;
-  info.tok = tok;
-
-  while (!at_eot(&info)) {
-    fun->next = funcdef(&info);
+  while ((fun->next = next_function(&tok))) {
     fun = fun->next;
   }
   return top.next;
@@ -233,58 +512,65 @@ Function *program(Token *tok) {
 
 // funcdef = "int" ident "(" params? ")" "{" stmt* "}"
 static Function *funcdef(ParseInfo *info) {
-  skip_tok(info, "int");
+  Function *func = func_signature(info);
+  func_body(info, func);
+  return func;
+}
+
+// "int" ident "(" params? ")" まで。infoは本体の"{"を指し、引数が見えている状態になる
+static Function *func_signature(ParseInfo *info) {
+  skip_tok(info, TOK_INT);
 
   if (info->tok->kind != TK_IDENT) {
     error_tok(info->tok, "need a function definition");
   }
-  Function *func = calloc(sizeof(Function), 1);
+  Function *func = arena_alloc(&arena, sizeof(Function));
 
+  func->tok = info->tok;
   func->name = expect_ident(info);
-  skip_tok(info, "(");
-
-  // params
-  Var var = {0};
-  var.name = "";
-  VarList vl = {0};
-  vl.var = &var;
-  info->locals = &vl;
+  skip_tok(info, TOK_LPAREN);
+
+  // params。本体をあとで読むときのため、変数の並びの頭もアリーナに置く
+  info->locals = arena_alloc(&arena, sizeof(VarList));
+  info->scope = info->block = NULL;
   func->params = params(info);
 
-  skip_tok(info, ")");
-  skip_tok(info, "{");
+  skip_tok(info, TOK_RPAREN);
+  return func;
+}
 
+// "{" stmt* "}"
+static void func_body(ParseInfo *info, Function *func) {
+  skip_tok(info, TOK_LBRACE);
 
-  Node head = {}, *cur = &head, *next;
+  NodeId head = 0, *link = &head;
 
-  while (!consume(info, "}")) {
-    next = stmt(info);
-    cur->next = next;
-    cur = next;
+  while (!consume(info, TOK_RBRACE)) {
+    *link = stmt(info);
+    link = &node_at(*link)->next;
   }
   func->locals = info->locals->next;
   func->stack_size = set_locals(func->locals);
-  func->node = head.next;
-  return func;
+  func->node = head;
 }
 
 // params  = "int" ident ("," "int" ident)*
 static VarList *params(ParseInfo *info) {
-  if (peek(info, ")")) {
+  if (peek(info, TOK_RPAREN)) {
     return NULL;
   }
 
-  skip_tok(info, "int");
+  skip_tok(info, TOK_INT);
 
-  VarList *top, *cur = top = calloc(1, sizeof(VarList));
-  cur->var = new_var(info->locals, expect_ident(info), info);
-  while (consume(info, ",")) {
+  VarList *top, *cur = top = arena_alloc(&arena, sizeof(VarList));
+  cur->var = new_var(expect_ident(info), info);
+  while (consume(info, TOK_COMMA)) {
 
-    skip_tok(info, "int");
+    skip_tok(info, TOK_INT);
 
-    cur->next = calloc(1, sizeof(VarList));
+    cur->next = arena_alloc(&arena, sizeof(VarList));
     cur = cur->next;
-    cur->var = new_var(info->locals, expect_ident(info), info);
+    cur->var = new_var(expect_ident(info), info);
   }
   return top;
 }
@@ -296,261 +582,431 @@ static VarList *params(ParseInfo *info) {
 //      | "{" stmt* "}"
 //      | var-def
 //      | expr-stmt
-static Node *stmt(ParseInfo *info) {
+static NodeId stmt(ParseInfo *info) {
+  NodeId id;
   Node *node;
-  if (consume(info, "return")) {
-    node = new_node(info, ND_RETURN);
-    node->lhs = expr(info);
-    skip_tok(info, ";");
-    return node;
-  }
-  else if (consume(info, "if")) {
-    node = new_node(info, ND_IF);
-    skip_tok(info, "(");
-    node->cond = expr(info);
-    skip_tok(info, ")");
-    node->then = stmt(info);
-    if (consume(info, "else")) {
-      node->els = stmt(info);
+  if (consume(info, TOK_RETURN)) {
+    id = new_unary(info, ND_RETURN, expr(info));
+    skip_tok(info, TOK_SEMICOLON);
+    return id;
+  }
+  else if (consume(info, TOK_IF)) {
+    id = new_node(info, ND_IF);
+    skip_tok(info, TOK_LPAREN);
+    NodeId cond = expr(info);
+    skip_tok(info, TOK_RPAREN);
+    NodeId then = stmt(info);
+    NodeId els = 0;
+    if (consume(info, TOK_ELSE)) {
+      els = stmt(info);
     }
-    return node;
-  }
-  else if (consume(info, "while")) {
-    node = new_node(info, ND_WHILE);
-    skip_tok(info, "(");
-    node->cond = expr(info);
-    skip_tok(info, ")");
-    node->then = stmt(info);
-    return node;
-  }
-  else if (consume(info, "for")) {
-    node = new_node(info, ND_FOR);
-    skip_tok(info, "(");
-
-    if (!equal(info->tok, ";")) {
-      node->init = expr(info);
+    node = node_at(id);
+    node->cond = cond;
+    node->then = then;
+    node->els = els;
+    return id;
+  }
+  else if (consume(info, TOK_WHILE)) {
+    id = new_node(info, ND_WHILE);
+    skip_tok(info, TOK_LPAREN);
+    NodeId cond = expr(info);
+    skip_tok(info, TOK_RPAREN);
+    NodeId then = stmt(info);
+    node = node_at(id);
+    node->cond = cond;
+    node->then = then;
+    return id;
+  }
+  else if (consume(info, TOK_FOR)) {
+    id = new_node(info, ND_FOR);
+    skip_tok(info, TOK_LPAREN);
+
+    NodeId init = 0, cond = 0, succ = 0;
+    if (!equal(info->tok, TOK_SEMICOLON)) {
+      init = expr(info);
     }
-    skip_tok(info, ";");
+    skip_tok(info, TOK_SEMICOLON);
 
-    if (!equal(info->tok, ";")) {
-      node->cond = expr(info);
+    if (!equal(info->tok, TOK_SEMICOLON)) {
+      cond = expr(info);
     }
-    skip_tok(info, ";");
+    skip_tok(info, TOK_SEMICOLON);
 
-    if (!equal(info->tok, ")")) {
-      node->succ = expr(info);
+    if (!equal(info->tok, TOK_RPAREN)) {
+      succ = expr(info);
     }
-    skip_tok(info, ")");
-    node->then = stmt(info);
-    return node;
-  }
-  else if (consume(info, "{")) {
-    node = new_node(info, ND_BLOCK);
-    Node top, *cur = &top;
-    while (!consume(info, "}")) {
-      cur->next = stmt(info);
-      cur = cur->next;
+    skip_tok(info, TOK_RPAREN);
+    NodeId then = stmt(info);
+    node = node_at(id);
+    node->init = init;
+    node->cond = cond;
+    node->succ = succ;
+    node->then = then;
+    return id;
+  }
+  else if (consume(info, TOK_LBRACE)) {
+    id = new_node(info, ND_BLOCK);
+    NodeId top = 0, *link = &top;
+    VarList *outer = enter_block(info);
+    while (!consume(info, TOK_RBRACE)) {
+      *link = stmt(info);
+      link = &node_at(*link)->next;
     }
-    node->body = top.next;
-    return node;
+    leave_block(info, outer);
+    node_at(id)->body = top;
+    return id;
   }
-  else if ((node = var_def(info))) {
-    return node;
+  else if ((id = var_def(info))) {
+    return id;
   }
   return expr_stmt(info);
 }
 
 // var-def = "int" ident ";"
-static Node *var_def(ParseInfo *info) {
-  if (!consume(info, "int")) {
-    return NULL;
+static NodeId var_def(ParseInfo *info) {
+  if (!consume(info, TOK_INT)) {
+    return 0;
   }
-  Node *node = new_node(info, ND_NOP);
-  new_var(info->locals, expect_ident(info), info);
-  skip_tok(info, ";");
-  return node;
+  NodeId id = new_node(info, ND_NOP);
+  new_var(expect_ident(info), info);
+  skip_tok(info, TOK_SEMICOLON);
+  return id;
 
 }
 
 // expr-stmt = expr ";"
-static Node *expr_stmt(ParseInfo *info) {
-  Node *node = new_node(info, ND_EXPR_STMT);
-  node->lhs = expr(info);
-  skip_tok(info, ";");
-  return node;
+static NodeId expr_stmt(ParseInfo *info) {
+  NodeId id = new_unary(info, ND_EXPR_STMT, expr(info));
+  skip_tok(info, TOK_SEMICOLON);
+  return id;
 }
 
-// expr = assign
-static Node *expr(ParseInfo *info) {
-  return assign(info);
+// 二項演算子の表。優先順位が高いほど強く結びつく
+static const struct {
+  uint8_t prec;                 // 0は二項演算子でない
+  uint8_t kind;                 // NodeKind
+  bool swap;                    // a > b は b < a にする
+  bool right;                   // 右結合
+} binary_ops[] = {
+  [TOK_ASSIGN] = {1, ND_ASSIGN, false, true},
+  [TOK_EQ] = {2, ND_EQ},
+  [TOK_NE] = {2, ND_NE},
+  [TOK_LT] = {3, ND_LT},
+  [TOK_LE] = {3, ND_LE},
+  [TOK_GT] = {3, ND_LT, true},
+  [TOK_GE] = {3, ND_LE, true},
+  [TOK_PLUS] = {4, ND_ADD},
+  [TOK_MINUS] = {4, ND_SUB},
+  [TOK_STAR] = {5, ND_MUL},
+  [TOK_SLASH] = {5, ND_DIV},
+};
+
+static int binary_prec(int id) {
+  return id < (int)(sizeof(binary_ops) / sizeof(*binary_ops)) ? binary_ops[id].prec : 0;
 }
 
-// assign = equality ("=" assign)?
-static Node *assign(ParseInfo *info) {
-  Node *lhs = equality(info);
-  if (consume(info, "=")) {
-    Node *rhs = assign(info);
-    Node *node = new_binary(info, ND_ASSIGN, lhs, rhs);
-    return node;
-  }
-  else {
-    return lhs;
+// 式を読むときの演算子スタックの要素
+typedef enum {
+  OP_BINARY,                    // 右辺を待っている二項演算子
+  OP_PAREN,                     // "("
+  OP_NEG,                       // "-" 単項。nodeは左辺の0
+  OP_PREFIX,                    // "*" "&" 単項。nodeはND_DEREFかND_ADDR
+  OP_CALL,                      // 引数を読んでいる関数呼び出し。nodeはND_FUNCALL
+} OpKind;
+
+typedef struct Op {
+  uint8_t kind;                 // OpKind
+  uint8_t tok_id;               // OP_BINARYのときの演算子
+  NodeId node;
+  int base;                     // OP_CALLのとき、最初の引数を積む被演算子スタックの位置
+} Op;
+
+// 深く入れ子になった式でもCのスタックを使わないよう、
+// 演算子と被演算子はヒープのスタックに積む。
+// 関数呼び出しも"("と同じく印を積み、読んだ引数は被演算子スタックに並べる
+static Op *ops;
+static int nops, ops_capacity;
+static NodeId *operands;
+static int noperands, operands_capacity;
+
+static void push_op(OpKind kind, int tok_id, NodeId node) {
+  if (nops == ops_capacity) {
+    ops_capacity = ops_capacity ? ops_capacity * 2 : 64;
+    ops = realloc(ops, sizeof(Op) * ops_capacity);
+  }
+  ops[nops++] = (Op){kind, tok_id, node, noperands};
+}
+
+static void push_operand(NodeId id) {
+  if (noperands == operands_capacity) {
+    operands_capacity = operands_capacity ? operands_capacity * 2 : 64;
+    operands = realloc(operands, sizeof(NodeId) * operands_capacity);
   }
+  operands[noperands++] = id;
 }
 
-// equality = relational ("==" relational | "!=" relational)*
-static Node *equality(ParseInfo *info) {
-  Node *node = relational(info);
+// 一番上の二項演算子を被演算子2つに適用する
+static void reduce_binary(ParseInfo *info) {
+  int id = ops[--nops].tok_id;
+  NodeId rhs = operands[--noperands];
+  NodeId lhs = operands[--noperands];
+  if (binary_ops[id].swap) {
+    NodeId t = lhs;
+    lhs = rhs;
+    rhs = t;
+  }
+  push_operand(new_binary(info, binary_ops[id].kind, lhs, rhs));
+}
 
-  for (;;) {
-    if (consume(info, "==")) {
-      Node *rhs = relational(info);
-      node = new_binary(info, ND_EQ, node, rhs);
-      continue;
+// 読み終えた被演算子に、その前にある単項演算子を内側から適用する
+static void reduce_prefix(ParseInfo *info, int base) {
+  while (base < nops && (ops[nops - 1].kind == OP_NEG || ops[nops - 1].kind == OP_PREFIX)) {
+    Op *op = &ops[--nops];
+    NodeId operand = operands[--noperands];
+    if (op->kind == OP_NEG) {
+      push_operand(new_binary(info, ND_SUB, op->node, operand));
     }
-    if (consume(info, "!=")) {
-      Node *rhs = relational(info);
-      node = new_binary(info, ND_NE, node, rhs);
-      continue;
+    else {
+      node_at(op->node)->lhs = operand;
+      push_operand(op->node);
     }
-    return node;
   }
 }
 
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-static Node *relational(ParseInfo *info) {
-  Node *node = add(info);
+// expr = unary (binary-op unary)*
+// unary = ("+" | "-") primary
+//       | ("*" | "&") unary
+//       | primary
+// binary-op = "=" | "==" | "!=" | "<" | "<=" | ">" | ">=" | "+" | "-" | "*" | "/"
+//
+// 優先順位は低い順に "=", "==" "!=", "<" "<=" ">" ">=", "+" "-", "*" "/"。
+// "="だけ右結合。"(" expr ")"と関数呼び出しの引数もスタックで扱うので、
+// 式の入れ子の深さはCのスタックに縛られない
+static NodeId expr(ParseInfo *info) {
+  int op_base = nops, operand_base = noperands;
+
   for (;;) {
-    if (consume(info, "<")) {
-      Node *rhs = add(info);
-      node = new_binary(info, ND_LT, node, rhs);
-      continue;
-    }
-    if (consume(info, "<=")) {
-      Node *rhs = add(info);
-      node = new_binary(info, ND_LE, node, rhs);
-      continue;
+    // 被演算子を読む。単項演算子と"("は積んでおく
+    for (;;) {
+      if (consume(info, TOK_STAR)) {
+        push_op(OP_PREFIX, 0, new_node(info, ND_DEREF));
+      }
+      else if (consume(info, TOK_AMP)) {
+        push_op(OP_PREFIX, 0, new_node(info, ND_ADDR));
+      }
+      else if (consume(info, TOK_LPAREN)) {
+        push_op(OP_PAREN, 0, 0);
+      }
+      else {
+        // 単項の"+" "-"のあとには"("か識別子か数しか来ない
+        if (consume(info, TOK_MINUS)) {
+          push_op(OP_NEG, 0, new_num(info, 0));
+        }
+        else if (!consume(info, TOK_PLUS)) {
+          if (primary(info)) {
+            break;
+          }
+          continue;
+        }
+        if (!consume(info, TOK_LPAREN)) {
+          if (primary(info)) {
+            break;
+          }
+          continue;
+        }
+        push_op(OP_PAREN, 0, 0);
+      }
     }
-    if (consume(info, ">")) {
-      Node *rhs = add(info);
-      node = new_binary(info, ND_LT, rhs, node);
-      continue;
-    }
-    if (consume(info, ">=")) {
-      Node *rhs = add(info);
-      node = new_binary(info, ND_LE, rhs, node);
-      continue;
+
+    // 二項演算子か")"を読む
+    for (;;) {
+      reduce_prefix(info, op_base);
+      int prec = binary_prec(info->tok->id);
+      if (prec) {
+        bool right = binary_ops[info->tok->id].right;
+        while (op_base < nops && ops[nops - 1].kind == OP_BINARY) {
+          int top = binary_prec(ops[nops - 1].tok_id);
+          if (top < prec || (top == prec && right)) {
+            break;
+          }
+          reduce_binary(info);
+        }
+        push_op(OP_BINARY, info->tok->id, 0);
+        advance_tok(info);
+        break;
+      }
+
+      // 式か引数の終わり。開いている"("か呼び出しがあれば閉じる
+      while (op_base < nops && ops[nops - 1].kind == OP_BINARY) {
+        reduce_binary(info);
+      }
+      if (nops == op_base) {
+        assert(noperands == operand_base + 1);
+        return operands[--noperands];
+      }
+      if (ops[nops - 1].kind == OP_CALL && consume(info, TOK_COMMA)) {
+        break;                  // 次の引数を読む
+      }
+      skip_tok(info, TOK_RPAREN);
+      Op op = ops[--nops];
+      if (op.kind == OP_CALL) {
+        // 積んだ引数をnextでつなぐ
+        for (int i = op.base; i + 1 < noperands; i++) {
+          node_at(operands[i])->next = operands[i + 1];
+        }
+        node_at(op.node)->args = operands[op.base];
+        noperands = op.base;
+        push_operand(op.node);
+      }
     }
-    return node;
   }
 }
 
-// add = mul ("+" mul | "-" mul)*
-static Node *add(ParseInfo *info) {
-  Node *node = mul(info);
-
-  for (;;) {
-    if (consume(info, "+")) {
-      Node *rhs = mul(info);
-      node = new_binary(info, ND_ADD, node, rhs);
-      continue;
-    }
-    if (consume(info, "-")) {
-      Node *rhs = mul(info);
-      node = new_binary(info, ND_SUB, node, rhs);
-      continue;
+// primary = ident ("(" (expr ("," expr)*)? ")")?
+//         | num
+// ("(" expr ")"と引数はexprが読む)
+//
+// 読んだものを被演算子スタックに積んでtrueを返す。
+// 引数のある関数呼び出しなら印を積んでfalseを返し、exprが引数を読む
+static bool primary(ParseInfo *info) {
+  if (info->tok->kind == TK_IDENT) {
+    Token *tok = info->tok;
+    char *name = ident_name(tok);
+    advance_tok(info);
+    if (peek(info, TOK_LPAREN)) {
+      NodeId id = new_node(info, ND_FUNCALL);
+      node_at(id)->name = name;
+      advance_tok(info);
+      if (consume(info, TOK_RPAREN)) {
+        push_operand(id);
+        return true;
+      }
+      push_op(OP_CALL, 0, id);
+      return false;
     }
-    return node;
+    Var *var = detect_var(name, tok, info);
+    NodeId id = new_node(info, ND_VAR);
+    node_at(id)->var = var;
+    push_operand(id);
+    return true;
   }
+  NodeId node = new_num(info, get_number(info->tok));
+  advance_tok(info);
+  push_operand(node);
+  return true;
 }
 
-// mul = unary ("*" unary | "/" unary)*
-static Node *mul(ParseInfo *info) {
-  Node *node = unary(info);
-
-  for (;;) {
-    if (consume(info, "*")) {
-      Node *rhs = unary(info);
-      node = new_binary(info, ND_MUL, node, rhs);
-      continue;
+////////////////////////////////////////////////////////////////
+// 本体の遅延読み込み
+//
+// -flazy-parsingのときは、まず各関数のシグネチャだけを読んで本体は括弧の対応で
+// 読み飛ばす。本体はmainから呼び出しをたどって初めて参照されたときに読み、
+// たどれなかった関数は捨てる(読まないので構文エラーも報告しない)。
+
+// シグネチャまで読んだ関数。infoは本体の"{"から読み直すための状態
+typedef struct LazyFunc {
+  Function *fun;
+  ParseInfo info;
+  bool parsed;
+} LazyFunc;
+
+typedef struct LazyWork {
+  HashMap *funcs;               // 名前 -> LazyFunc
+  LazyFunc **stack;
+  int depth;
+} LazyWork;
+
+static int stat_bodies, stat_parsed;
+
+// "{"から対応する"}"の次まで進める
+static void skip_body(ParseInfo *info) {
+  Token *open = info->tok;
+  skip_tok(info, TOK_LBRACE);
+  for (int depth = 1; depth;) {
+    if (at_eot(info)) {
+      error_tok(open, "関数の本体が閉じていません");
     }
-    if (consume(info, "/")) {
-      Node *rhs = unary(info);
-      node = new_binary(info, ND_DIV, node, rhs);
-      continue;
+    if (peek(info, TOK_LBRACE)) {
+      depth++;
     }
-    return node;
+    else if (peek(info, TOK_RBRACE)) {
+      depth--;
+    }
+    advance_tok(info);
   }
 }
-// unary = ("+" | "-") ? primary
-//       | "*" unary
-//       | "&" unary
 
-static Node *unary(ParseInfo *info) {
-  if (consume(info, "-")) {
-    return new_binary(info, ND_SUB, new_num(info, 0), primary(info));
-  }
-  else if (consume(info, "+")) {
-    return primary(info);
-  }
-  else if (consume(info, "*")) {
-    Node *node = new_node(info, ND_DEREF);
-    node->lhs = unary(info);
-    return node;
-  }
-  else if (consume(info, "&")) {
-    Node *node = new_node(info, ND_ADDR);
-    node->lhs = unary(info);
-    return node;
-  }
-  else {
-    return primary(info);
+static void lazy_enqueue(LazyWork *work, LazyFunc *lf) {
+  if (lf && !lf->parsed) {
+    lf->parsed = true;
+    work->stack[work->depth++] = lf;
   }
 }
 
-// func-args = "(" assign ("," assign)* ")"
-static Node *func_args(ParseInfo *info) {
-  skip_tok(info, "(");
-  if (consume(info, ")")) {
-    return NULL;
+// 呼び出し先の本体を読む予定に入れる
+static bool enqueue_callee(NodeId id, void *ctx) {
+  Node *node = node_at(id);
+  if (node->kind == ND_FUNCALL) {
+    LazyWork *work = ctx;
+    lazy_enqueue(work, hashmap_get(work->funcs, node->name));
   }
-  Node *top = assign(info), *n = top;
-  while (consume(info, ",")) {
-    n->next = assign(info);
-    n = n->next;
-  }
-  skip_tok(info, ")");
-  return top;
+  return true;
 }
 
-// primary = ident func-args?
-//         | "(" expr ")"
-//         | num
-static Node *primary(ParseInfo *info) {
-  if (info->tok->kind == TK_IDENT) {
-    char *name = strndup(info->tok->loc, info->tok->len);
-    advance_tok(info);
-    if (peek(info, "(")) {
-      Node *node = new_node(info, ND_FUNCALL);
-      node->name = name;
-      node->args = func_args(info);
-      return node;
+// mainから呼び出しをたどれる関数だけを、本体を読んで元の順番で返す。
+// mainがなければすべての関数を読む
+Function *program_lazy(Token *tok) {
+  LazyFunc *funcs = NULL;
+  int n = 0, capacity = 0;
+  while (tok->kind != TK_EOF) {
+    ParseInfo info = {};
+    info.tok = tok;
+    if (n == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      funcs = realloc(funcs, sizeof(LazyFunc) * capacity);
     }
-    else {
-      Var *var = detect_var(info->locals, name, info);
-      Node *node = new_node(info, ND_VAR);
-      node->var = var;
-      return node;
+    funcs[n].fun = func_signature(&info);
+    funcs[n].info = info;
+    funcs[n].parsed = false;
+    n++;
+    skip_body(&info);
+    tok = info.tok;
+  }
+
+  HashMap map = {};
+  for (int i = 0; i < n; i++) {
+    if (!hashmap_get(&map, funcs[i].fun->name)) {
+      hashmap_put(&map, funcs[i].fun->name, &funcs[i]);
     }
   }
-  else if (consume(info, "(")) {
-    Node *node = expr(info);
-    info->tok = skip(info->tok, ")");
-    return node;
+  LazyWork work = {&map, calloc(n + 1, sizeof(LazyFunc *)), 0};
+  LazyFunc *root = hashmap_get(&map, "main");
+  for (int i = 0; i < n; i++) {
+    if (!root || &funcs[i] == root) {
+      lazy_enqueue(&work, &funcs[i]);
+    }
   }
-  else {
-    Node *node = new_num(info, get_number(info->tok));
-    advance_tok(info);
-    return node;
+  while (work.depth) {
+    LazyFunc *lf = work.stack[--work.depth];
+    ParseInfo info = lf->info;
+    func_body(&info, lf->fun);
+    stat_parsed++;
+    visit_nodes(lf->fun->node, enqueue_callee, NULL, &work);
+  }
+  stat_bodies += n;
+
+  Function top = {}, *fun = &top;
+  for (int i = 0; i < n; i++) {
+    if (funcs[i].parsed) {
+      fun = fun->next = funcs[i].fun;
+    }
   }
+  free(work.stack);
+  hashmap_free(&map);
+  free(funcs);
+  return top.next;
+}
+
+void print_parse_stats(void) {
+  report("parse: %d of %d function bodies parsed\n", stat_parsed, stat_bodies);
 }
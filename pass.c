@@ -0,0 +1,192 @@
+////////////////////////////////////////////////////////////////
+// Pass manager
+//
+// 最適化はパスとしてpassesに登録する。-Oのレベルで既定の組み合わせが決まり、
+// -f<name>/-fno-<name>で個別に切り替え、--passes=で順番ごと指定できる。
+// コード生成の中で働くパスも同じ表に置き、codegenがpass_enabledで調べる。
+
+#include <string.h>
+#include <time.h>
+#include "k9cc.h"
+
+struct Pass {
+  const char *name;
+  int level;                    // この-Oレベル以上で有効
+  PassStage stage;
+  bool whole_program;           // すべての関数がそろっていないと動かない
+  int (*run)(Function **prog);  // 変えた数を返す。並べ替えたら*progを先頭にする
+
+  int enabled;                  // -1は未指定(レベルに従う)
+  clock_t time;
+  clock_t start;                // pass_startで測り始めた時刻
+  long changes;
+};
+
+// 既定の実行順。コード生成の段階のパスは順番に関係なくcodegenが使う
+static Pass passes[] = {
+  {"pure-eval", 2, STAGE_AST, true, eval_pure_calls, -1},
+  {"ipcp", 2, STAGE_AST, true, specialize_calls, -1},
+  {"unroll-loops", 2, STAGE_AST, false, unroll_loops, -1},
+  {"cse", 1, STAGE_AST, false, eliminate_common_subexprs, -1},
+  {"reorder-functions", 2, STAGE_AST, true, reorder_functions, -1},
+  {"rotate-loops", 1, STAGE_EMIT, false, NULL, -1},
+  {"align-loops", 2, STAGE_EMIT, false, NULL, -1},
+  {"align-jumps", 2, STAGE_EMIT, false, NULL, -1},
+  {"split-cold-blocks", 2, STAGE_EMIT, false, NULL, -1},
+  {"thread-jumps", 1, STAGE_ASM, false, NULL, -1},
+};
+
+#define NPASSES ((int)(sizeof(passes) / sizeof(*passes)))
+
+static int level;
+static Pass *pipeline[64];      // 実行するパス(順番どおり)
+static int npipeline;
+static bool explicit_pipeline;  // --passes=で指定された
+static Pass *print_after;
+
+static Pass *find_pass(const char *name, size_t len) {
+  for (int i = 0; i < NPASSES; i++) {
+    if (strlen(passes[i].name) == len && !strncmp(passes[i].name, name, len)) {
+      return &passes[i];
+    }
+  }
+  return NULL;
+}
+
+void pass_set_level(int lv) {
+  level = lv;
+}
+
+int pass_level(void) {
+  return level;
+}
+
+// -f<name>, -fno-<name>。知らない名前ならfalse
+bool pass_enable(const char *name, bool on) {
+  Pass *pass = find_pass(name, strlen(name));
+  if (!pass) {
+    return false;
+  }
+  pass->enabled = on;
+  return true;
+}
+
+// --passes=a,b,c
+void pass_set_pipeline(const char *list) {
+  explicit_pipeline = true;
+  npipeline = 0;
+  for (const char *p = list; *p; ) {
+    const char *end = strchr(p, ',');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    Pass *pass = find_pass(p, len);
+    if (!pass) {
+      error("unknown pass: %.*s", (int)len, p);
+    }
+    if (npipeline == sizeof(pipeline) / sizeof(*pipeline)) {
+      error("too many passes: %s", list);
+    }
+    pipeline[npipeline++] = pass;
+    p += len;
+    if (*p == ',') {
+      p++;
+    }
+  }
+}
+
+// --print-after=name
+void pass_print_after(const char *name) {
+  print_after = find_pass(name, strlen(name));
+  if (!print_after) {
+    error("unknown pass: %s", name);
+  }
+}
+
+// オプションをすべて読んでから、実行するパスを決める
+void pass_setup(void) {
+  if (explicit_pipeline) {
+    return;
+  }
+  npipeline = 0;
+  for (int i = 0; i < NPASSES; i++) {
+    Pass *pass = &passes[i];
+    if (pass->enabled == 1 || (pass->enabled == -1 && pass->level <= level)) {
+      pipeline[npipeline++] = pass;
+    }
+  }
+}
+
+bool pass_enabled(const char *name) {
+  for (int i = 0; i < npipeline; i++) {
+    if (!strcmp(pipeline[i]->name, name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 関数ごとに流して処理できないパスがあるか
+bool passes_need_whole_program(void) {
+  for (int i = 0; i < npipeline; i++) {
+    if (pipeline[i]->whole_program) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// パスを順に流し、関数の並びの新しい先頭を返す
+Function *run_passes(Function *prog) {
+  for (int i = 0; i < npipeline; i++) {
+    Pass *pass = pipeline[i];
+    if (pass->stage != STAGE_AST) {
+      continue;
+    }
+    clock_t start = clock();
+    pass->changes += pass->run(&prog);
+    pass->time += clock() - start;
+
+    if (pass == print_after) {
+      for (Function *fun = prog; fun; fun = fun->next) {
+        report("\n** %s after %s\n", fun->name, pass->name);
+        walk(fun->node);
+      }
+    }
+  }
+  return prog;
+}
+
+// コード生成の段階のパスが変えた数を足す
+void pass_count(const char *name, long changes) {
+  find_pass(name, strlen(name))->changes += changes;
+}
+
+// コード生成の段階のパスにかかった時間を、pass_startからpass_stopまで測る
+void pass_start(const char *name) {
+  find_pass(name, strlen(name))->start = clock();
+}
+
+void pass_stop(const char *name) {
+  Pass *pass = find_pass(name, strlen(name));
+  pass->time += clock() - pass->start;
+}
+
+// --print-after=にコード生成の段階のパスが指定されているか。
+// codegenはそのとき関数のアセンブリを溜めてpass_print_codeに渡す
+bool pass_prints_code(void) {
+  return print_after && print_after->stage != STAGE_AST && pass_enabled(print_after->name);
+}
+
+// stageの段階を終えた関数のアセンブリを、指定されたパスのあとの姿として出す
+void pass_print_code(PassStage stage, const char *fn, const char *text) {
+  if (pass_prints_code() && print_after->stage == stage) {
+    report("\n** %s after %s\n%s", fn, print_after->name, text);
+  }
+}
+
+void print_pass_stats(void) {
+  for (int i = 0; i < npipeline; i++) {
+    Pass *pass = pipeline[i];
+    report("pass %s: %ld changes, %.3f ms\n", pass->name, pass->changes,
+           pass->time * 1000.0 / CLOCKS_PER_SEC);
+  }
+}
@@ -0,0 +1,107 @@
+////////////////////////////////////////////////////////////////
+// Profile
+//
+// --profile-generate: 生成コードに埋め込むカウンタの登録
+// --profile-use: 実行時に書き出されたカウンタ値の読み込み
+//
+// プロファイルファイルは1行1カウンタの "名前 回数" 形式。
+// 同じ名前が複数回現れたときは合算する(複数回の実行を追記できる)。
+
+#include <stdio.h>
+#include <string.h>
+#include "k9cc.h"
+
+// 生成コードに埋め込むカウンタの名前。添字がカウンタ番号
+static char **counter_names;
+static int ncounters;
+static int counter_capacity;
+
+int profile_counter(char *name) {
+  if (ncounters == counter_capacity) {
+    counter_capacity = counter_capacity ? counter_capacity * 2 : 64;
+    counter_names = realloc(counter_names, sizeof(char *) * counter_capacity);
+  }
+  counter_names[ncounters] = name;
+  return ncounters++;
+}
+
+int profile_ncounters(void) {
+  return ncounters;
+}
+
+char *profile_counter_name(int idx) {
+  return counter_names[idx];
+}
+
+// 読み込んだプロファイル(オープンアドレス法のハッシュ表)
+typedef struct ProfEntry {
+  char *name;
+  long count;
+} ProfEntry;
+
+static ProfEntry *entries;
+static int nentries;
+static int entry_capacity;
+
+static unsigned long hash(const char *s) {
+  unsigned long h = 2166136261UL;
+  for (; *s; s++) {
+    h = (h ^ (unsigned char)*s) * 16777619UL;
+  }
+  return h;
+}
+
+static ProfEntry *lookup(ProfEntry *tab, int cap, const char *name) {
+  for (unsigned long i = hash(name) & (cap - 1); ; i = (i + 1) & (cap - 1)) {
+    if (!tab[i].name || !strcmp(tab[i].name, name)) {
+      return &tab[i];
+    }
+  }
+}
+
+static void add_entry(const char *name, long count) {
+  if (entry_capacity <= nentries * 2) {
+    int cap = entry_capacity ? entry_capacity * 2 : 256;
+    ProfEntry *tab = calloc(cap, sizeof(ProfEntry));
+    for (int i = 0; i < entry_capacity; i++) {
+      if (entries[i].name) {
+        *lookup(tab, cap, entries[i].name) = entries[i];
+      }
+    }
+    free(entries);
+    entries = tab;
+    entry_capacity = cap;
+  }
+  ProfEntry *e = lookup(entries, entry_capacity, name);
+  if (!e->name) {
+    e->name = strndup(name, strlen(name));
+    nentries++;
+  }
+  e->count += count;
+}
+
+void profile_load(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    error("cannot open profile: %s", path);
+  }
+  char name[4096];
+  long count;
+  int r;
+  while ((r = fscanf(fp, "%4095s %ld", name, &count)) == 2) {
+    add_entry(name, count);
+  }
+  if (r != EOF) {
+    error("%s: broken profile", path);
+  }
+  fclose(fp);
+}
+
+// nameの実行回数を返す。プロファイルにないときは-1
+long profile_count(const char *name) {
+  if (!entries) {
+    return -1;
+  }
+  ProfEntry *e = lookup(entries, entry_capacity, name);
+  return e->name ? e->count : -1;
+}
@@ -0,0 +1,390 @@
+////////////////////////////////////////////////////////////////
+// Function reordering
+//
+// 呼び出しグラフを作り、よく呼び合う関数どうしが隣に並ぶよう出力の順番を
+// 並べ替える(Pettis-Hansen)。辺の重みは呼び出し元の実行回数の見積もりに
+// 呼び出しのループの深さを掛けたもので、--profile-useの回数があればそれを使う。
+// 呼ばれない関数は.text.unlikelyに追い出す。
+
+#include <string.h>
+#include "k9cc.h"
+
+#define REORDER_LOOP_WEIGHT 10.0   // ループ1段ごとの実行回数の見積もり
+#define REORDER_MAX_LOOP_DEPTH 6
+#define REORDER_MAX_FREQ 1e15
+
+typedef struct CallEdge {
+  int from;
+  int to;
+  double weight;
+} CallEdge;
+
+typedef struct CallGraph {
+  Function **fns;
+  int nfns;
+  HashMap index;                // 関数名 -> 添字+1
+  CallEdge *edges;              // 呼び出し元と先の組ごとにまとめたもの
+  int nedges;
+  HashMap edge_index;           // "from,to" -> 添字+1
+  double *freq;                 // 関数の実行回数の見積もり
+  int caller;                   // 調べている関数
+  int loop_depth;
+} CallGraph;
+
+static int function_index(CallGraph *cg, const char *name) {
+  return (int)(long)hashmap_get(&cg->index, name) - 1;
+}
+
+static void add_edge(CallGraph *cg, int from, int to, double weight) {
+  char *key = format("%d,%d", from, to);
+  int i = (int)(long)hashmap_get(&cg->edge_index, key) - 1;
+  if (0 <= i) {
+    cg->edges[i].weight += weight;
+    free(key);
+    return;
+  }
+  cg->edges = realloc(cg->edges, sizeof(CallEdge) * (cg->nedges + 1));
+  cg->edges[cg->nedges] = (CallEdge){from, to, weight};
+  hashmap_put(&cg->edge_index, key, (void *)(long)(cg->nedges + 1));
+  cg->nedges++;
+}
+
+// 呼び出しを辺にする。重みはループの深さによる呼び出し1回あたりの回数
+static int collect_calls(Traversal *t, NodeId id, int state, void *ctx) {
+  CallGraph *cg = ctx;
+  Node *node = node_at(id);
+  bool loop = node->kind == ND_WHILE || node->kind == ND_FOR;
+  if (state == 1) {
+    cg->loop_depth--;
+    return VISIT_DONE;
+  }
+
+  if (node->kind == ND_FUNCALL) {
+    int callee = function_index(cg, node->name);
+    if (0 <= callee) {
+      double w = 1;
+      for (int i = 0; i < cg->loop_depth && i < REORDER_MAX_LOOP_DEPTH; i++) {
+        w *= REORDER_LOOP_WEIGHT;
+      }
+      add_edge(cg, cg->caller, callee, w);
+    }
+  }
+  NodeId kids[4];
+  int n = node_children(node, kids);
+  for (int i = 0; i < n; i++) {
+    traverse_list(t, kids[i]);
+  }
+  if (loop) {
+    cg->loop_depth++;
+    return 1;
+  }
+  return VISIT_DONE;
+}
+
+// mainからたどった逆後順で回数を流し込む。再帰の戻り辺はループとみなす
+static void estimate_frequency(CallGraph *cg, int root) {
+  int n = cg->nfns;
+
+  // 呼び出し元ごとの辺の一覧。同じ呼び出し元の中では辺の順番を保つ
+  int *out_start = calloc(n + 1, sizeof(int));
+  int *out = malloc(sizeof(int) * (cg->nedges ? cg->nedges : 1));
+  for (int e = 0; e < cg->nedges; e++) {
+    out_start[cg->edges[e].from + 1]++;
+  }
+  for (int f = 0; f < n; f++) {
+    out_start[f + 1] += out_start[f];
+  }
+  int *fill = malloc(sizeof(int) * n);
+  memcpy(fill, out_start, sizeof(int) * n);
+  for (int e = 0; e < cg->nedges; e++) {
+    out[fill[cg->edges[e].from]++] = e;
+  }
+
+  int *order = calloc(n, sizeof(int));
+  int *pos = malloc(sizeof(int) * n);   // orderでの位置(たどれなければ-1)
+  int norder = 0;
+  char *mark = calloc(n, 1);    // 0: 未訪問, 1: 訪問中, 2: 済み
+  int *stack = calloc(n, sizeof(int));
+  int *next_edge = calloc(n, sizeof(int));
+  int depth = 0;
+  for (int f = 0; f < n; f++) {
+    pos[f] = -1;
+    next_edge[f] = out_start[f];
+  }
+
+  stack[depth++] = root;
+  mark[root] = 1;
+  while (depth) {
+    int f = stack[depth - 1];
+    if (next_edge[f] < out_start[f + 1]) {
+      int to = cg->edges[out[next_edge[f]++]].to;
+      if (!mark[to]) {
+        mark[to] = 1;
+        stack[depth++] = to;
+      }
+      continue;
+    }
+    mark[f] = 2;
+    pos[f] = norder;
+    order[norder++] = f;
+    depth--;
+  }
+
+  cg->freq[root] = 1;
+  for (int i = norder - 1; 0 <= i; i--) {
+    int f = order[i];
+    double freq = cg->freq[f];
+    if (0 <= cg->fns[f]->count) {
+      freq = cg->fns[f]->count;
+    }
+    else {
+      for (int j = out_start[f]; j < out_start[f + 1]; j++) {
+        if (cg->edges[out[j]].to == f) {
+          freq *= REORDER_LOOP_WEIGHT;
+        }
+      }
+    }
+    if (REORDER_MAX_FREQ < freq) {
+      freq = REORDER_MAX_FREQ;
+    }
+    cg->freq[f] = freq;
+    for (int j = out_start[f]; j < out_start[f + 1]; j++) {
+      CallEdge *edge = &cg->edges[out[j]];
+      // 後順で前にあるものへの辺(戻り辺)は流さない
+      if (edge->to != f && pos[edge->to] < i) {
+        cg->freq[edge->to] += freq * edge->weight;
+      }
+    }
+  }
+  free(out_start);
+  free(out);
+  free(fill);
+  free(order);
+  free(pos);
+  free(mark);
+  free(stack);
+  free(next_edge);
+}
+
+////////////////////////////////////////////////////////////////
+// 鎖をつなぐ
+
+typedef struct Chain {
+  int *fns;
+  int len;
+} Chain;
+
+static int chain_pos(Chain *c, int f) {
+  for (int i = 0; i < c->len; i++) {
+    if (c->fns[i] == f) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void reverse_chain(Chain *c) {
+  for (int i = 0, j = c->len - 1; i < j; i++, j--) {
+    int t = c->fns[i];
+    c->fns[i] = c->fns[j];
+    c->fns[j] = t;
+  }
+}
+
+// aとbの距離が一番近くなる向きでつなぐ。bの鎖は空になる
+static void merge_chains(Chain *a, Chain *b, int fa, int fb) {
+  int pa = chain_pos(a, fa), pb = chain_pos(b, fb);
+  int ab = a->len - pa + pb;                    // a b
+  int arb = a->len - pa + b->len - 1 - pb;      // a rev(b)
+  int rab = pa + 1 + pb;                        // rev(a) b
+  int ba = b->len - pb + pa;                    // b a
+  int best = ab;
+  if (arb < best) {
+    best = arb;
+  }
+  if (rab < best) {
+    best = rab;
+  }
+  if (ba < best) {
+    best = ba;
+  }
+
+  if (best == ab) {
+  }
+  else if (best == arb) {
+    reverse_chain(b);
+  }
+  else if (best == rab) {
+    reverse_chain(a);
+  }
+  else {
+    Chain t = *a;
+    *a = *b;
+    *b = t;
+  }
+  a->fns = realloc(a->fns, sizeof(int) * (a->len + b->len));
+  memcpy(a->fns + a->len, b->fns, sizeof(int) * b->len);
+  a->len += b->len;
+  free(b->fns);
+  b->fns = NULL;
+  b->len = 0;
+}
+
+static int cmp_edge(const void *x, const void *y) {
+  const CallEdge *a = x, *b = y;
+  if (a->weight != b->weight) {
+    return a->weight < b->weight ? 1 : -1;
+  }
+  if (a->from != b->from) {
+    return a->from - b->from;
+  }
+  return a->to - b->to;
+}
+
+typedef struct ChainOrder {
+  Chain *chain;
+  double freq;                  // 鎖の中で一番熱い関数
+  int first;                    // ソースで一番前の関数
+} ChainOrder;
+
+static int cmp_chain(const void *x, const void *y) {
+  const ChainOrder *a = x, *b = y;
+  if (a->freq != b->freq) {
+    return a->freq < b->freq ? 1 : -1;
+  }
+  return a->first - b->first;
+}
+
+// orderの順にnextをつなぎ直し、新しい先頭を返す
+static Function *relink(Function **fns, int *order, int n) {
+  for (int i = 0; i < n; i++) {
+    fns[order[i]]->next = i + 1 < n ? fns[order[i + 1]] : NULL;
+  }
+  return fns[order[0]];
+}
+
+// 並びを動かした関数と.text.unlikelyへ追い出した関数の数を返す
+int reorder_functions(Function **prog) {
+  CallGraph cg = {};
+  for (Function *fn = *prog; fn; fn = fn->next) {
+    cg.fns = realloc(cg.fns, sizeof(Function *) * (cg.nfns + 1));
+    cg.fns[cg.nfns] = fn;
+    hashmap_put(&cg.index, fn->name, (void *)(long)(cg.nfns + 1));
+    cg.nfns++;
+  }
+  int n = cg.nfns;
+  if (n < 2) {
+    free(cg.fns);
+    hashmap_free(&cg.index);
+    return 0;
+  }
+
+  for (int i = 0; i < n; i++) {
+    cg.caller = i;
+    cg.loop_depth = 0;
+    traverse(cg.fns[i]->node, collect_calls, &cg);
+  }
+
+  // mainがあればそこから、なければどの関数も外から呼ばれうる
+  cg.freq = calloc(n, sizeof(double));
+  int main_idx = function_index(&cg, "main");
+  if (0 <= main_idx) {
+    estimate_frequency(&cg, main_idx);
+  }
+  else {
+    for (int i = 0; i < n; i++) {
+      cg.freq[i] = 0 <= cg.fns[i]->count ? cg.fns[i]->count : 1;
+    }
+  }
+
+  int changes = 0;
+  bool *unlikely = calloc(n, sizeof(bool));
+  for (int i = 0; i < n; i++) {
+    Function *fn = cg.fns[i];
+    unlikely[i] = i != main_idx && (fn->count == 0 || (fn->count < 0 && cg.freq[i] == 0));
+    if (unlikely[i] && !fn->unlikely) {
+      changes++;
+    }
+  }
+
+  // 重い辺から順に、両端の鎖をつなぐ
+  Chain *chains = calloc(n, sizeof(Chain));
+  int *chain_of = calloc(n, sizeof(int));
+  for (int i = 0; i < n; i++) {
+    chains[i].fns = malloc(sizeof(int));
+    chains[i].fns[0] = i;
+    chains[i].len = 1;
+    chain_of[i] = i;
+  }
+  for (int i = 0; i < cg.nedges; i++) {
+    cg.edges[i].weight *= cg.freq[cg.edges[i].from];
+  }
+  qsort(cg.edges, cg.nedges, sizeof(CallEdge), cmp_edge);
+  for (int i = 0; i < cg.nedges; i++) {
+    CallEdge *e = &cg.edges[i];
+    int a = chain_of[e->from], b = chain_of[e->to];
+    if (a == b || unlikely[e->from] || unlikely[e->to] || e->weight <= 0) {
+      continue;
+    }
+    merge_chains(&chains[a], &chains[b], e->from, e->to);
+    for (int j = 0; j < chains[a].len; j++) {
+      chain_of[chains[a].fns[j]] = a;
+    }
+  }
+
+  // 熱い鎖から並べ、呼ばれない関数は最後に元の順で置く
+  ChainOrder *co = calloc(n, sizeof(ChainOrder));
+  int nco = 0;
+  for (int i = 0; i < n; i++) {
+    Chain *c = &chains[i];
+    if (!c->len || (c->len == 1 && unlikely[c->fns[0]])) {
+      continue;
+    }
+    co[nco] = (ChainOrder){c, 0, n};
+    for (int j = 0; j < c->len; j++) {
+      if (co[nco].freq < cg.freq[c->fns[j]]) {
+        co[nco].freq = cg.freq[c->fns[j]];
+      }
+      if (c->fns[j] < co[nco].first) {
+        co[nco].first = c->fns[j];
+      }
+    }
+    nco++;
+  }
+  qsort(co, nco, sizeof(ChainOrder), cmp_chain);
+
+  int *order = calloc(n, sizeof(int));
+  int norder = 0;
+  for (int i = 0; i < nco; i++) {
+    for (int j = 0; j < co[i].chain->len; j++) {
+      order[norder++] = co[i].chain->fns[j];
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (unlikely[i]) {
+      order[norder++] = i;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    cg.fns[i]->unlikely = unlikely[i];
+    if (order[i] != i) {
+      changes++;
+    }
+  }
+  *prog = relink(cg.fns, order, n);
+
+  for (int i = 0; i < n; i++) {
+    free(chains[i].fns);
+  }
+  free(chains);
+  free(chain_of);
+  free(co);
+  free(order);
+  free(unlikely);
+  free(cg.freq);
+  free(cg.edges);
+  free(cg.fns);
+  hashmap_free(&cg.index);
+  hashmap_free(&cg.edge_index);
+  return changes;
+}
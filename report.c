@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include "k9cc.h"
 
 // report an error and abnormal exit
@@ -13,9 +14,56 @@ void error(const char *fmt, ...) {
   exit(1);
 }
 
-void verror_at(const char *fmt, int pos, va_list ap) {
-  fprintf(stderr, "%s\n", current_input);
-  fprintf(stderr, "%*s", pos, "");
+// 各行の先頭のオフセット。エラーを報告するときに初めて作る
+static uint32_t *line_starts;
+static int nlines;
+
+static void build_line_index(void) {
+  int capacity = 1024;
+  line_starts = malloc(sizeof(uint32_t) * capacity);
+  line_starts[nlines++] = 0;
+  for (char *p = current_input; *p; p++) {
+    if (*p != '\n') {
+      continue;
+    }
+    if (nlines == capacity) {
+      capacity *= 2;
+      line_starts = realloc(line_starts, sizeof(uint32_t) * capacity);
+    }
+    line_starts[nlines++] = p + 1 - current_input;
+  }
+}
+
+// offsetの行番号と桁番号(どちらも1から)を返す
+void source_position(uint32_t offset, int *line, int *column) {
+  if (!line_starts) {
+    build_line_index();
+  }
+  int lo = 0, hi = nlines;
+  while (1 < hi - lo) {
+    int mid = (lo + hi) / 2;
+    if (line_starts[mid] <= offset) {
+      lo = mid;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  *line = lo + 1;
+  *column = offset - line_starts[lo] + 1;
+}
+
+static void verror_at(const char *fmt, uint32_t pos, va_list ap) {
+  int line, column;
+  source_position(pos, &line, &column);
+
+  char *start = current_input + pos - (column - 1);
+  char *end = strchr(start, '\n');
+  int len = end ? end - start : (int)strlen(start);
+
+  fprintf(stderr, "%s:%d:%d:\n", current_filename, line, column);
+  fprintf(stderr, "%.*s\n", len, start);
+  fprintf(stderr, "%*s", column - 1, "");
   fprintf(stderr, "^ ");
   vfprintf(stderr, fmt, ap);
   fprintf(stderr, "\n");
@@ -26,7 +74,7 @@ void error_tok(Token *tok, const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
 
-  verror_at(fmt, tok->column, ap);
+  verror_at(fmt, tok->loc, ap);
   va_end(ap);
   exit(1);
 }
@@ -0,0 +1,77 @@
+////////////////////////////////////////////////////////////////
+// k9cc --instrument-functions の実行時ライブラリ
+//
+// 計測したプログラムと一緒にリンクする。
+//   k9cc --instrument-functions prog.c > prog.s
+//   cc -o prog prog.s runtime/instrument.c
+// 終了時に、関数ごとの呼び出し回数とサイクル数をサイクル数の多い順に
+// 標準エラー(環境変数K9CC_INSTRUMENTがあればそのファイル)へ書き出す。
+// サイクル数は呼んだ先の関数の分も含む。
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// k9ccが出力する表の1行
+typedef struct Entry {
+  const char *name;
+  long calls;
+  long cycles;
+} Entry;
+
+typedef struct Table {
+  Entry *entries;
+  long n;
+} Table;
+
+static Table *tables;
+static int ntables;
+
+static int compare_cycles(const void *a, const void *b) {
+  const Entry *x = *(const Entry **)a, *y = *(const Entry **)b;
+  return x->cycles < y->cycles ? 1 : x->cycles > y->cycles ? -1 : 0;
+}
+
+static void dump(void) {
+  long n = 0;
+  for (int i = 0; i < ntables; i++) {
+    n += tables[i].n;
+  }
+  Entry **sorted = calloc(n ? n : 1, sizeof(Entry *));
+  n = 0;
+  for (int i = 0; i < ntables; i++) {
+    for (long j = 0; j < tables[i].n; j++) {
+      Entry *e = &tables[i].entries[j];
+      if (e->calls) {
+        sorted[n++] = e;
+      }
+    }
+  }
+  qsort(sorted, n, sizeof(Entry *), compare_cycles);
+
+  char *path = getenv("K9CC_INSTRUMENT");
+  FILE *fp = path ? fopen(path, "w") : stderr;
+  if (!fp) {
+    perror(path);
+    fp = stderr;
+  }
+  fprintf(fp, "%16s %12s %12s  %s\n", "cycles", "calls", "cycles/call", "function");
+  for (long i = 0; i < n; i++) {
+    Entry *e = sorted[i];
+    fprintf(fp, "%16ld %12ld %12ld  %s\n", e->cycles, e->calls, e->cycles / e->calls, e->name);
+  }
+  if (fp != stderr) {
+    fclose(fp);
+  }
+  free(sorted);
+}
+
+// 計測したオブジェクトごとに起動時に呼ばれる
+void __k9cc_instrument_register(Entry *entries, long n) {
+  if (!ntables) {
+    atexit(dump);
+  }
+  tables = realloc(tables, sizeof(Table) * (ntables + 1));
+  tables[ntables].entries = entries;
+  tables[ntables].n = n;
+  ntables++;
+}
@@ -1,13 +1,14 @@
 #!/bin/bash
 
 CC='k9cc'
+OPTS=''
 
 assert () {
     local exfile="tmp"
     local asfile="tmp.s"
     local expected="$1"
     local input="$2"
-    ./$CC "$input" > $asfile
+    ./$CC $OPTS "$input" > $asfile
     cc -o $exfile $asfile
 
     ./$exfile
@@ -16,9 +17,9 @@ assert () {
     # rm -f $exfile $asfile
 
     if [ "$actual" = "$expected" ]; then
-        echo "$input => $actual"
+        echo "[$OPTS] $input => $actual"
     else
-        echo "$input => $expected expected, but got $actual"
+        echo "[$OPTS] $input => $expected expected, but got $actual"
         exit 1
     fi
 }
@@ -30,7 +31,7 @@ assert_exsrc() {
     local exsrc="$2"
     local input="$3"
 
-    ./$CC "$input" > $asfile
+    ./$CC $OPTS "$input" > $asfile
     cc -o $exfile $asfile $exsrc
 
     ./$exfile
@@ -39,69 +40,510 @@ assert_exsrc() {
     # rm -f $exfile $asfile
 
     if [ "$actual" = "$expected" ]; then
-        echo "$input => $actual"
+        echo "[$OPTS] $input => $actual"
     else
-        echo "$input => $expected expected, but got $actual"
-        exit 1
-    fi
-}
-assert 4 'int main(){int a; a=4;return *&a;}'
-assert 123 'int main(){int aa; set(&aa,120);return aa;} int set(int adr, int val){*adr=val+3;}'
-assert 42 'int main(){int aa; set(&aa,42);return aa;} int set(int adr, int val){*adr=val;}'
-assert 42 'int main(){return fun();} int fun(){return 42;}'
-assert 55 'int main(){return fib(9);} int fib(int n){if(n<=1)return 1;else{return fib(n-1) + fib(n-2);}}'
-assert 6 'int main(){return fun(1,2,3,4,5,6);} int fun(int a,int b,int c,int d,int e,int f){return f;}'
-assert 3 'int main(){return fun(1,2,3,4,5,6);} int fun(int a,int b,int c,int d,int e,int f){return c;}'
-assert 1 'int main(){return fun(1,2,3,4,5,6);} int fun(int a,int b,int c,int d,int e,int f){return a;}'
-assert 40 'int main(){return twice(20);} int twice(int a){return a * 2;}'
-assert 42 'int main(){return fourty_two();} int fourty_two(){return 42;}'
-assert_exsrc 6 test/add2.c 'int main() {return return6th(1,2,3,4,5,6);}'
-assert_exsrc 1 test/add2.c 'int main() {return return1st(1,2,3,4,5,6);}'
-assert_exsrc 231 test/add2.c 'int main() {return add_each2_and_multiply(1,2,3,4,5,6);}'
-assert_exsrc 42 test/add2.c 'int main() {return add2(add2(10, 30), 2);}'
-assert_exsrc 42 test/value40.c 'int main() {return value40() + 2;}'
-
-assert 55 'int main() {int sum;int i;for(sum=i=0;i<11;i=i+1){int b;b=i;sum=sum+b;}return sum;}'
-assert 55 'int main() {int sum; int i; sum = 0; for(i=0;i<11;i=i+1){sum=sum+i;}return sum;}'
-assert 24 'int main() {for(;0;)return 42;return 24;}'
-assert 42 'int main() {for(;1;)return 42;return 24;}'
-assert 10 'int main() {int i; i=0;for(;i<10;)i=i+1;return i;}'
-assert 55 'int main() {int sum; int i; sum=0;for(i=0;i<11;i=i+1)sum=sum+i;return sum;}'
-assert 42 'int main() {int a; a=0;while(a<10)if(a==5)return 42;else a=a+1;}'
-assert 11 'int main() {int a; a=0;while(a<=10)a=a+1;return a;}'
-assert 10 'int main() {if (1) return 10; else return 0;}'
-assert 10 'int main() {if (0) return 100; else return 10;}'
-assert 20 'int main() {if (0) return 100; return 20;}'
-assert 100 'int main() {if (1) return 100; return 20;}'
-assert 100 'int main() {int a; int b;a=100; b=100; if (a==b) return b; return a;}'
-assert 101 'int main() {int a; int b;a=101; b=100; if (a==b) return b; return a;}'
-assert 3 'int main() {int a;a=3; return a;}'
-assert 8 'int main() {int abc; int xyzz; abc=3; xyzz=5; return abc+xyzz;}'
-assert 6 'int main() {int a; int b; a=b=3; return a+b;}'
-assert 10 'int main() {return 10;}'
-assert 3 'int main() {1;2; return 3;}'
-assert 0 'int main() {return 3>=4;}'
-assert 1 'int main() {return 3>=3;}'
-assert 1 'int main() {return 3>=2;}'
-assert 1 'int main() {return 3>2;}'
-assert 0 'int main() {return -1<=-2;}'
-assert 1 'int main() {return -1<=-1;}'
-assert 1 'int main() {return -1<=5;}'
-assert 1 'int main() {return -1<5;}'
-assert 0 'int main() {return 1!=1;}'
-assert 1 'int main() {return -1==(-2+3)*(-1);}'
-assert 1 'int main() {return 1==1;}'
-assert 4 'int main() {return 2+2;}'
-assert 5 'int main() {return 1-(-4);}'
-assert 4 'int main() {return -(- 4);}'
-assert 3 'int main() {return +3;}'
-assert 42 'int main() {return (18 + 3)*(2 + 2) / 2;}'
-assert 26 'int main() {return 2* 3+4 *5;}'
-assert 42 'int main() {return   12 + 20 - 10 +20;}'
-assert 0 'int main() {return 10+20-30;}'
-assert 42 'int main() {return 20+22;}'
-assert 0 'int main() {return 0;}'
-assert 42 'int main() {return 42;}'
+        echo "[$OPTS] $input => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+# --profile-generateで実行回数を取り、--profile-useで再コンパイルしても結果が同じこと
+assert_profile() {
+    local exfile="tmp"
+    local asfile="tmp.s"
+    local profile="tmp.prof"
+    local expected="$1"
+    local input="$2"
+
+    rm -f $profile
+    ./$CC $OPTS --profile-generate=$profile "$input" > $asfile
+    cc -o $exfile $asfile
+    ./$exfile
+    local actual="$?"
+    if [ "$actual" != "$expected" ]; then
+        echo "[$OPTS profile-generate] $input => $expected expected, but got $actual"
+        exit 1
+    fi
+
+    ./$CC $OPTS --profile-use=$profile "$input" > $asfile
+    cc -o $exfile $asfile
+    ./$exfile
+    actual="$?"
+    if [ "$actual" = "$expected" ]; then
+        echo "[$OPTS profile-use] $input => $actual"
+    else
+        echo "[$OPTS profile-use] $input => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+# 組み込みのアセンブラで.oを作ってリンクする
+assert_obj() {
+    local expected="$1"
+    local input="$2"
+
+    ./$CC $OPTS -c -o tmp.o "$input"
+    cc -o tmp tmp.o test/add2.c
+    ./tmp
+    local actual="$?"
+    if [ "$actual" = "$expected" ]; then
+        echo "[$OPTS -c] $input => $actual"
+    else
+        echo "[$OPTS -c] $input => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+# プログラムを標準入力から読む
+assert_stdin() {
+    local expected="$1"
+    local input="$2"
+
+    echo "$input" | ./$CC $OPTS - > tmp.s
+    cc -o tmp tmp.s
+    ./tmp
+    local actual="$?"
+    if [ "$actual" = "$expected" ]; then
+        echo "[$OPTS stdin] $input => $actual"
+    else
+        echo "[$OPTS stdin] $input => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+# パスの指定とダンプ
+assert_passes() {
+    local src='int main(){int a;int b;a=3;b=4;return a*b+a*b;}'
+    if ! ./$CC --passes=cse --print-after=cse "$src" 2>&1 >/dev/null | grep -q 'var: .t'; then
+        echo "[passes] --print-after=cse does not show the cse temporary"
+        exit 1
+    fi
+    if ./$CC -O0 --print-after=cse "$src" 2>&1 >/dev/null | grep -q 'after cse'; then
+        echo "[passes] cse ran at -O0"
+        exit 1
+    fi
+    local call='int main(){int x;x=4;return pw(2,x);} int pw(int b,int e){if(e==0)return 1;return b*pw(b,e-1);}'
+    if ! ./$CC -fipcp "$call" | grep -q '^pw.constprop.0:'; then
+        echo "[passes] ipcp did not specialize pw"
+        exit 1
+    fi
+    if ./$CC -fipcp "$call" | grep -q 'global pw.constprop'; then
+        echo "[passes] ipcp clone is global"
+        exit 1
+    fi
+    local order='int main(){int i;int s;s=0;for(i=0;i<10;i=i+1)s=s+hot(i);return s;} int unused(int a){return a;} int hot(int a){return a*2;}'
+    if [ "$(./$CC -freorder-functions "$order" | grep -E '^[a-z]+:|^\.section' | tr '\n' ' ')" != 'main: hot: .section .text.unlikely,"ax",@progbits unused: ' ]; then
+        echo "[passes] reorder-functions did not place hot next to main and unused in .text.unlikely"
+        exit 1
+    fi
+    local loop='int main(){int i;int s;s=0;for(i=0;i<10;i=i+1)s=s+i;return s;}'
+    if ! ./$CC -O1 --print-after=rotate-loops "$loop" 2>&1 >/dev/null | grep -q '^\.L\.body_main'; then
+        echo "[passes] --print-after=rotate-loops does not show the rotated loop"
+        exit 1
+    fi
+    if ! ./$CC --passes=rotate-loops,align-loops --stats "$loop" 2>&1 >/dev/null | grep -q '^pass align-loops: 1 changes'; then
+        echo "[passes] align-loops is not counted in --stats"
+        exit 1
+    fi
+    if ./$CC --passes=no-such-pass "$src" > /dev/null 2>&1; then
+        echo "[passes] unknown pass accepted"
+        exit 1
+    fi
+    echo "[passes] OK"
+}
+
+# 関数のたくさんある大きな入力を作る
+gen_corpus() {
+    for i in $(seq 1 2000); do
+        echo "int f$i(int a, int b){int x; x = a*$i + b; if (x >= 10) return x - 10; else return x;}"
+    done > $1
+    echo 'int main(){return f7(1,2);}' >> $1
+}
+
+# 関数ごとに出力しても、全体を読んでから出力したときと同じコードになるか
+assert_streaming() {
+    local src="tmp.stream"
+    gen_corpus $src
+    for opts in "" "-fcse -funroll-loops" "--profile-generate"; do
+        ./$CC $opts - < $src > tmp.stream.1.s
+        ./$CC -fno-streaming $opts - < $src > tmp.stream.2.s
+        if ! cmp -s tmp.stream.1.s tmp.stream.2.s; then
+            echo "[streaming $opts] output differs from whole-program compilation"
+            exit 1
+        fi
+    done
+    echo "[streaming] OK"
+}
+
+# 深く入れ子になった括弧でもCのスタックを使い切らずに読めるか。
+# 最適化パスも通るよう、最適化のレベルごとに試す
+assert_deep_nesting() {
+    local depth=100000
+    for opts in "" "-O1" "-O2"; do
+        { printf 'int main(){return '
+          printf '%*s' $depth '' | tr ' ' '('
+          printf '42'
+          printf '%*s' $depth '' | tr ' ' ')'
+          printf ';}\n'; } > tmp.deep
+        ./$CC $opts - < tmp.deep > tmp.s || exit 1
+        cc -o tmp tmp.s 2>/dev/null
+        ./tmp
+        if [ "$?" != 42 ]; then
+            echo "[deep nesting $opts] wrong result"
+            exit 1
+        fi
+
+        # 長い代入の連鎖と深い二項演算の木もコード生成できるか
+        { printf 'int main(){int a;int b;a=1;b='
+          printf '%*s' $depth '' | sed 's/ /a=/g'
+          printf '1;return b+'
+          printf '%*s' $depth '' | sed 's/ /(1+/g'
+          printf '0'
+          printf '%*s' $depth '' | tr ' ' ')'
+          printf ';}\n'; } > tmp.deep
+        ./$CC $opts - < tmp.deep > tmp.s || exit 1
+        cc -o tmp tmp.s 2>/dev/null
+        ./tmp
+        if [ "$?" != $(((depth + 1) % 256)) ]; then
+            echo "[deep nesting $opts] wrong result for deep expressions"
+            exit 1
+        fi
+
+        # 深い式を本体に持つ関数を定数の引数で呼ぶ(呼び出しの評価と特殊化)
+        { printf 'int f(int x){return '
+          printf '%*s' $depth '' | sed 's/ /(x+/g'
+          printf '0'
+          printf '%*s' $depth '' | tr ' ' ')'
+          printf ';} int main(){return f(1)+f(2);}\n'; } > tmp.deep
+        ./$CC $opts - < tmp.deep > tmp.s || exit 1
+        cc -o tmp tmp.s 2>/dev/null
+        ./tmp
+        if [ "$?" != $(((depth * 3) % 256)) ]; then
+            echo "[deep nesting $opts] wrong result for a deep function body"
+            exit 1
+        fi
+
+        # 呼び出しの引数の中の呼び出しも入れ子にできるか
+        { printf 'int f(int x,int y){return x+y;} int main(){return '
+          printf '%*s' $depth '' | sed 's/ /f(1,/g'
+          printf '0'
+          printf '%*s' $depth '' | tr ' ' ')'
+          printf ';}\n'; } > tmp.deep
+        ./$CC $opts - < tmp.deep > tmp.s || exit 1
+        cc -o tmp tmp.s 2>/dev/null
+        ./tmp
+        if [ "$?" != $((depth % 256)) ]; then
+            echo "[deep nesting $opts] wrong result for nested calls"
+            exit 1
+        fi
+    done
+    echo "[deep nesting] OK"
+}
+
+# -gで行番号表と変数の位置、関数の型と大きさが出るか
+assert_debug() {
+    local src='int main(){int a; a=3;
+return add(a, 4);}
+int add(int x, int y){int s;
+  s = x + y;
+  return s;}'
+    for opts in "" "-fomit-frame-pointer"; do
+        ./$CC -g $opts "$src" > tmp.g.s
+        cc -g -o tmp tmp.g.s 2>/dev/null
+        ./tmp
+        if [ "$?" != 7 ]; then
+            echo "[debug $opts] wrong result"
+            exit 1
+        fi
+        if ! objdump --dwarf=decodedline tmp | grep -q '^<command line> *4 '; then
+            echo "[debug $opts] no line table entry for line 4"
+            exit 1
+        fi
+        if ! readelf --debug-dump=info tmp | grep -q 'DW_AT_name *: s$'; then
+            echo "[debug $opts] no debug info for local variable s"
+            exit 1
+        fi
+        if ! readelf -s tmp | grep -q '[1-9][0-9]* FUNC *GLOBAL DEFAULT *[0-9]* add$'; then
+            echo "[debug $opts] add has no function type or size"
+            exit 1
+        fi
+    done
+    if ./$CC -g -c -o tmp.g.o "$src" 2>/dev/null; then
+        echo "[debug] -g -c accepted without debug info"
+        exit 1
+    fi
+    echo "[debug] OK"
+}
+
+# -fthread-jumpsで、次の行へのジャンプや到達しないコードが残らないか
+assert_cfg() {
+    local src='int main(){int i;int s;s=0;for(i=0;i<10;i=i+1){if(i==3)s=s+1;else{if(i<5)s=s+2;}}for(;;){return s;}return 24;}'
+    ./$CC -fthread-jumps "$src" > tmp.s
+    cc -o tmp tmp.s 2>/dev/null
+    ./tmp
+    if [ "$?" != 9 ]; then
+        echo "[cfg] wrong result"
+        exit 1
+    fi
+    if awk '/^ *jmp /{t=$2; next} $0 == t ":"{found=1} {t=""} END{exit !found}' tmp.s; then
+        echo "[cfg] jump to the next block remains"
+        exit 1
+    fi
+    if grep -q 'mov rax, 24' tmp.s; then
+        echo "[cfg] unreachable code remains"
+        exit 1
+    fi
+    if ! ./$CC -fthread-jumps --stats "$src" 2>&1 >/dev/null | grep -q '^pass thread-jumps: [1-9][0-9]* changes'; then
+        echo "[cfg] thread-jumps changes are not counted in --stats"
+        exit 1
+    fi
+    echo "[cfg] OK"
+}
+
+# 変数や即値を直接オペランドにして、値を積まずに済ませているか
+assert_isel() {
+    local src='int main(){int a;int b;a=6;b=a*4;a=a+3;if(b-a>10)return a*5;return b/a;}'
+    ./$CC --stats "$src" > tmp.s 2> tmp.err
+    cc -o tmp tmp.s 2>/dev/null
+    ./tmp
+    if [ "$?" != 45 ]; then
+        echo "[isel] wrong result"
+        exit 1
+    fi
+    if grep 'push' tmp.s | grep -qv 'push rbp'; then
+        echo "[isel] temporary value pushed"
+        exit 1
+    fi
+    if ! grep -q 'add qword ptr \[rbp-[0-9]*\], 3' tmp.s; then
+        echo "[isel] read-modify-write not selected"
+        exit 1
+    fi
+    if ! grep -q '^codegen: [0-9]* instructions' tmp.err; then
+        echo "[isel] no instruction count in --stats"
+        exit 1
+    fi
+    echo "[isel] OK"
+}
+
+# --instrument-functionsの表をruntime/instrument.cが書き出すか
+assert_instrument() {
+    local src='int fib(int n){if(n<2)return n;return fib(n-1)+fib(n-2);} int main(){return fib(10);}'
+    for opts in "" "-c -o tmp.o"; do
+        ./$CC --instrument-functions $opts "$src" > tmp.s
+        if [ -n "$opts" ]; then
+            cc -o tmp tmp.o runtime/instrument.c 2>/dev/null
+        else
+            cc -o tmp tmp.s runtime/instrument.c 2>/dev/null
+        fi
+        K9CC_INSTRUMENT=tmp.inst ./tmp
+        if [ "$?" != 55 ]; then
+            echo "[instrument $opts] wrong result"
+            exit 1
+        fi
+        if ! awk '$4 == "fib" && $2 == 177 {found=1} END{exit !found}' tmp.inst; then
+            echo "[instrument $opts] fib is not counted 177 times"
+            cat tmp.inst
+            exit 1
+        fi
+    done
+    echo "[instrument] OK"
+}
+
+# -flazy-parsingでは、mainからたどれない関数の本体を読まずに捨てる
+assert_lazy_parsing() {
+    local src='int unused(int a){return a+undefined;} int helper(int a){{int b;b=a*2;return b;}} int main(){return helper(3)+leaf(4);} int leaf(int x){if(x){return x;}return 0;}'
+    ./$CC -flazy-parsing --stats "$src" > tmp.s 2> tmp.err
+    cc -o tmp tmp.s 2>/dev/null
+    ./tmp
+    if [ "$?" != 10 ]; then
+        echo "[lazy parsing] wrong result"
+        exit 1
+    fi
+    if grep -q '^unused:' tmp.s; then
+        echo "[lazy parsing] unreachable function remains"
+        exit 1
+    fi
+    if ! grep -q '^parse: 3 of 4 function bodies parsed' tmp.err; then
+        echo "[lazy parsing] unexpected parse stats"
+        exit 1
+    fi
+    echo "[lazy parsing] OK"
+}
+
+# プロファイルがなくても、returnで抜けるだけの分岐を関数末尾へ追い出し、
+# ジャンプでしか入らない分岐先をそろえるか
+assert_cold_split() {
+    local src='int main(){int i;int s;s=0;for(i=0;i<10;i=i+1){if(i==77){return 99;}if(i<5){s=s+1;}else{s=s+2;}}return s;}'
+    ./$CC -O2 "$src" > tmp.s
+    cc -o tmp tmp.s 2>/dev/null
+    ./tmp
+    if [ "$?" != 15 ]; then
+        echo "[cold split] wrong result"
+        exit 1
+    fi
+    if ! awk '/^ *ret$/{ret=1} ret && /mov rax, 99/{found=1} END{exit !found}' tmp.s; then
+        echo "[cold split] early return is not moved after ret"
+        exit 1
+    fi
+    if ! grep -A1 '^\.p2align' tmp.s | grep -q '^\.L\.else_'; then
+        echo "[cold split] jump target is not aligned"
+        exit 1
+    fi
+    if ! ./$CC --passes=split-cold-blocks,align-jumps --stats "$src" 2>&1 >/dev/null | grep -q '^pass split-cold-blocks: 1 changes'; then
+        echo "[cold split] split-cold-blocks is not counted in --stats"
+        exit 1
+    fi
+    echo "[cold split] OK"
+}
+
+# 生成した大きな入力で、並列の字句解析が逐次と同じトークン列を返すか
+assert_lex_threads() {
+    local src="tmp.lex"
+    gen_corpus $src
+
+    ./$CC --dump-tokens --lex-threads=1 - < $src 2> tmp.lex.1
+    for n in 2 3 8; do
+        ./$CC --dump-tokens --lex-threads=$n - < $src 2> tmp.lex.n
+        if ! cmp -s tmp.lex.1 tmp.lex.n; then
+            echo "[lex-threads=$n] token stream differs from the serial lexer"
+            exit 1
+        fi
+    done
+
+    # エラーはスレッド数によらず一番前のものを報告する
+    sed -i '700s/x = a/x = \x01a/; 1800s/x = a/x = \x01a/' $src
+    ./$CC --lex-threads=1 - < $src 2> tmp.lex.1
+    ./$CC --lex-threads=8 - < $src 2> tmp.lex.n
+    if ! grep -q ':700:' tmp.lex.n || ! cmp -s tmp.lex.1 tmp.lex.n; then
+        echo "[lex-threads=8] error report differs from the serial lexer"
+        exit 1
+    fi
+    echo "[lex-threads] OK"
+}
+
+run_tests() {
+    assert_profile 199 'int main(){int i;int s;s=0;for(i=0;i<100;i=i+1){if(i==50)s=s+100;else s=s+1;} while(s<0)s=1; return s;}'
+    assert_profile 55 'int main(){return fib(9);} int fib(int n){if(n<=1)return 1;else{return fib(n-1) + fib(n-2);}}'
+    assert_profile 3 'int main(){int i; int n; n=0; for(i=0;i<300;i=i+1){if(i<3)n=n+1;} return n;}'
+    assert_profile 10 'int main() {int i; i=0;for(;;){if(i==10)return i;i=i+1;}}'
+
+    assert_obj 94 'int main(){int a;int b;a=3;b=4;if(a<b)return fib(10)+a*b/2-1; return 0;} int fib(int n){if(n<=1)return 1;return fib(n-1)+fib(n-2);}'
+    assert_obj 61 'int main(){int i;int s;s=0;for(i=0;i<1000;i=i+1){s=s+i*3;}return s/7 + return6th(1,2,3,4,5,6);}'
+    assert_obj 204 'int main(){int x;x=1;return sum8(x,2,3,4,5,6,x+6,8);}'
+    assert_obj 13 'int main(){int a;int b;a=3;b=4;return sub(a*b, 2) + *&a;} int sub(int x,int y){int t; t=x-y; return t;}'
+    assert_obj 7 'int main(){int i;i=0;while(i<7)i=i+1;return (i==7)+(i!=7)+(i<=7)+(3>=i)+5;}'
+    assert_obj 44 'int main(){return 5000000000/1000000000*10 - 6;}'
+    assert_stdin 7 'int main(){int a; a=3;
+return a+4;}'
+    assert 4 'int main(){int a; a=4;return *&a;}'
+    assert 123 'int main(){int aa; set(&aa,120);return aa;} int set(int adr, int val){*adr=val+3;}'
+    assert 42 'int main(){int aa; set(&aa,42);return aa;} int set(int adr, int val){*adr=val;}'
+    assert 42 'int main(){return fun();} int fun(){return 42;}'
+    assert 3 'int main(){int iffy;int int2;int forx;iffy=1;int2=2;forx=iffy>=int2;return iffy+int2+forx;}'
+    assert 55 'int main(){return fib(9);} int fib(int n){if(n<=1)return 1;else{return fib(n-1) + fib(n-2);}}'
+    assert 6 'int main(){return fun(1,2,3,4,5,6);} int fun(int a,int b,int c,int d,int e,int f){return f;}'
+    assert 3 'int main(){return fun(1,2,3,4,5,6);} int fun(int a,int b,int c,int d,int e,int f){return c;}'
+    assert 1 'int main(){return fun(1,2,3,4,5,6);} int fun(int a,int b,int c,int d,int e,int f){return a;}'
+    assert 40 'int main(){return twice(20);} int twice(int a){return a * 2;}'
+    assert 50 'int main(){return twice(twice(3)) * 2 + g(2);} int twice(int a){return a * 2;} int g(int a){int b; b=&a; return *b + 24;}'
+    assert 89 'int main(){return fibl(10) - big(1) + spin(3) - 3;} int fibl(int n){int a;int b;int t;a=1;b=1;while(n>1){t=a+b;a=b;b=t;n=n-1;}return b;} int big(int a){int i;int s;s=1;for(i=0;i<40;i=i+1)s=s*2;return s/1099511627776-a;} int spin(int a){int i;i=0;while(i<10000000)i=i+1;return a;}'
+    assert 6 'int main(){int a;int b;a=b=3;return -(a+b)*-b/2- +(b)+((((a))))+ -(-(a))-6;}'
+    assert 24 'int main(){int a;int b;a=3;b=4;return a*b+a*b;}'
+    assert 32 'int main(){int a;int b;int c;a=3;b=4;c=a*b;a=5;return c+a*b;}'
+    assert 24 'int main(){int x;int p;int s;x=5;p=&x;s=*p+*p;*p=7;return s+*p+*p;}'
+    assert 18 'int main(){int x;int p;int s;x=2;p=&x;s=x*3;*p=4;return s+x*3;}'
+    assert 15 'int main(){int x;int p;x=5;p=&x;return *p+set(p)+*p;} int set(int p){*p=10;return 0;}'
+    assert 108 'int main(){int a;a=6;return add(a*a,a*a)+a*a;} int add(int x,int y){return x+y;}'
+    assert 8 'int main(){int a;int s;a=2;s=0;if(a*a==4)s=a*a;else s=1;return s+a*a;}'
+    assert 55 'int main(){int i;int s;s=0;for(i=0;i<11;i=i+1)s=s+i;return s;}'
+    assert 253 'int main(){int i;int s;int n;n=103;s=0;for(i=0;i<n;i=i+1)s=s+i;return s-5000;}'
+    assert 167 'int main(){int i;int s;s=0;for(i=3;i<=100;i=i+7)s=s+i;return s;}'
+    assert 80 'int main(){int i;int j;int s;s=0;for(i=0;i<10;i=i+1){for(j=0;j<i;j=j+1)s=s+2;}return s-i;}'
+    assert 37 'int main(){int i;for(i=0;i<1000;i=i+1){if(i==37)return i;}return 0;}'
+    assert 60 'int main(){int i;int s;s=0;for(i=0;i<5;i=i+1)s=s+scale(i,3)+scale(i,3);return s;} int scale(int x,int k){if(k==3)return x*3;return x;}'
+    assert 14 'int main(){int i;int s;s=0;for(i=0;i<4;i=i+1)s=s+down(5,i);return s;} int down(int n,int d){int c;c=0;while(n>d){n=n-1;c=c+1;}return c;}'
+    assert 97 'int main(){int x;x=4;return pw(2,x)+pw(3,x);} int pw(int b,int e){if(e==0)return 1;return b*pw(b,e-1);}'
+    assert 20 'int main(){int i;int s;s=0;for(i=0;i<20;i=i+1){s=s+1;i=i+0;}return s;}'
+    assert 0 'int main(){int i;int s;s=0;for(i=5;i<3;i=i+1)s=s+1;return s;}'
+    assert 42 'int main(){return fourty_two();} int fourty_two(){return 42;}'
+    assert 107 'int main(){return leaf(3);} int leaf(int x){int a;int b;int c;int d;int e;int f;int g;int h;int i;int j;int k;int l;int m;int n;int o;int p;a=x;p=&a;b=*p+1;o=b*(a+(b+(a+(b+(a+(b+(a+b)))))));return o-(b-a)*5;}'
+    assert 21 'int main(){return leaf(1,2,3,4,5,6);} int leaf(int a,int b,int c,int d,int e,int f){int s;s=&a;*s=*s+0;return a+b+c+d+e+f;}'
+    assert_exsrc 6 test/add2.c 'int main() {return return6th(1,2,3,4,5,6);}'
+    assert_exsrc 1 test/add2.c 'int main() {return return1st(1,2,3,4,5,6);}'
+    assert_exsrc 231 test/add2.c 'int main() {return add_each2_and_multiply(1,2,3,4,5,6);}'
+    assert_exsrc 42 test/add2.c 'int main() {return add2(add2(10, 30), 2);}'
+    assert_exsrc 42 test/value40.c 'int main() {return value40() + 2;}'
+    assert_exsrc 204 test/add2.c 'int main() {return sum8(1,2,3,4,5,6,7,8);}'
+    assert 204 'int main(){return f(1,2,3,4,5,6,7,8);} int f(int a,int b,int c,int d,int e,int f,int g,int h){return a+2*b+3*c+4*d+5*e+6*f+7*g+8*h;}'
+    assert 190 'int main(){int x;x=3;return f(x+1,g(x),x*2,g(1)+1,x,&x==&x,x-1,g(g(2)),9);} int g(int a){return a+1;} int f(int a,int b,int c,int d,int e,int f,int g,int h,int i){return a+b*2+c*3+d*4+e*5+f*6+g*7+h*8+i*9;}'
+    assert 145 'int main(){int a;int b;a=1;b=2;return s(b-a,a+b,a*b,b/a,b*b,a);} int s(int a,int b,int c,int d,int e,int f){return a*100000+b*10000+c*1000+d*100+e*10+f;}'
+    assert 155 'int main(){int a;a=1;return s(a,a=5,a);} int s(int x,int y,int z){return x*100+y*10+z;}'
+    assert 90 'int main(){int i;int t;t=0;for(i=0;i<5;i=i+1)t=t+f(i,i+1,i+2,i+3,i+4,i+5,i+6,i+7,i+8,i+9);return t;} int f(int a,int b,int c,int d,int e,int f,int g,int h,int i,int j){return j-a+h;}'
+
+    assert 55 'int main() {int sum;int i;for(sum=i=0;i<11;i=i+1){int b;b=i;sum=sum+b;}return sum;}'
+    assert 12 'int main() {int a; a=2; {int b; b=3; a=a+b;} {int c; int d; c=4; d=3; a=a+c+d;} return a;}'
+    assert 7 'int main() {int a; a=3; {int a; a=4; {int b; b=a;} } {int a; a=10;} return a+4;}'
+    assert 9 'int main() {int x; x=1; {int y; y=&x; {int z; z=3; *y=*y+z;}} {int w; w=5; x=x+w;} return x;}'
+    assert 55 'int main() {int sum; int i; sum = 0; for(i=0;i<11;i=i+1){sum=sum+i;}return sum;}'
+    assert 24 'int main() {for(;0;)return 42;return 24;}'
+    assert 7 'int main() {int i; i=0; for(;;){i=i+1; if(i==7)return i;}}'
+    assert 5 'int main() {int a; a=0; if (a==1) a=3; return a+5;}'
+    assert 42 'int main() {for(;1;)return 42;return 24;}'
+    assert 10 'int main() {int i; i=0;for(;i<10;)i=i+1;return i;}'
+    assert 55 'int main() {int sum; int i; sum=0;for(i=0;i<11;i=i+1)sum=sum+i;return sum;}'
+    assert 42 'int main() {int a; a=0;while(a<10)if(a==5)return 42;else a=a+1;}'
+    assert 11 'int main() {int a; a=0;while(a<=10)a=a+1;return a;}'
+    assert 10 'int main() {if (1) return 10; else return 0;}'
+    assert 10 'int main() {if (0) return 100; else return 10;}'
+    assert 20 'int main() {if (0) return 100; return 20;}'
+    assert 100 'int main() {if (1) return 100; return 20;}'
+    assert 100 'int main() {int a; int b;a=100; b=100; if (a==b) return b; return a;}'
+    assert 101 'int main() {int a; int b;a=101; b=100; if (a==b) return b; return a;}'
+    assert 3 'int main() {int a;a=3; return a;}'
+    assert 8 'int main() {int abc; int xyzz; abc=3; xyzz=5; return abc+xyzz;}'
+    assert 6 'int main() {int a; int b; a=b=3; return a+b;}'
+    assert 10 'int main() {return 10;}'
+    assert 3 'int main() {1;2; return 3;}'
+    assert 0 'int main() {return 3>=4;}'
+    assert 1 'int main() {return 3>=3;}'
+    assert 1 'int main() {return 3>=2;}'
+    assert 1 'int main() {return 3>2;}'
+    assert 0 'int main() {return -1<=-2;}'
+    assert 1 'int main() {return -1<=-1;}'
+    assert 1 'int main() {return -1<=5;}'
+    assert 1 'int main() {return -1<5;}'
+    assert 0 'int main() {return 1!=1;}'
+    assert 1 'int main() {return -1==(-2+3)*(-1);}'
+    assert 1 'int main() {return 1==1;}'
+    assert 4 'int main() {return 2+2;}'
+    assert 5 'int main() {return 1-(-4);}'
+    assert 4 'int main() {return -(- 4);}'
+    assert 3 'int main() {return +3;}'
+    assert 42 'int main() {return (18 + 3)*(2 + 2) / 2;}'
+    assert 26 'int main() {return 2* 3+4 *5;}'
+    assert 42 'int main() {return   12 + 20 - 10 +20;}'
+    assert 0 'int main() {return 10+20-30;}'
+    assert 42 'int main() {return 20+22;}'
+    assert 0 'int main() {return 0;}'
+    assert 42 'int main() {return 42;}'
+}
+
+assert_lex_threads
+assert_streaming
+assert_passes
+assert_debug
+assert_cfg
+assert_isel
+assert_instrument
+assert_lazy_parsing
+assert_cold_split
+assert_deep_nesting
+run_tests
+OPTS='-fomit-frame-pointer' run_tests
+OPTS='-fpure-eval' run_tests
+OPTS='-fcse' run_tests
+OPTS='-funroll-loops -funroll-factor=3' run_tests
+OPTS='-O2' run_tests
+OPTS='-flazy-parsing' run_tests
 
 wait
 echo OK
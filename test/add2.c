@@ -10,3 +10,6 @@ int return1st(int a, int b, int c, int d, int e, int f) {
 int return6th(int a, int b, int c, int d, int e, int f) {
   return f;
 }
+int sum8(int a, int b, int c, int d, int e, int f, int g, int h) {
+  return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h;
+}
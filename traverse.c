@@ -0,0 +1,147 @@
+////////////////////////////////////////////////////////////////
+// AST traversal
+//
+// 木を再帰せずにたどる。訪問中のノードはヒープに置いたスタックに積み、
+// 各ノードは状態番号つきで何度か呼ばれる(小さな状態機械として書く)。
+// 入れ子がどれだけ深くても、Cのスタックは一定しか使わない。
+// 木をたどる処理(コード生成、最適化パス、node_clone)はすべてこれを使う。
+// ただし文は構文解析が再帰で読むので、文の入れ子の深さはそちらで決まる。
+
+#include <string.h>
+#include "k9cc.h"
+
+typedef struct Frame {
+  NodeId id;                    // listのときは次に訪ねる要素
+  int state;                    // 次に呼ぶときの状態(VISIT_DONEなら終わり)
+  int level;                    // 根からの入れ子の深さ
+  bool list;                    // nextでつながった並び
+  long locals[TRAVERSE_LOCALS];
+} Frame;
+
+// 浅い木ならヒープを使わずに済むよう、最初はCのスタックの小さな配列を使う
+#define TRAVERSE_SMALL 16
+
+struct Traversal {
+  Frame *stack;
+  int depth;
+  int capacity;
+  Frame *current;               // 呼び出し中のノード
+  VisitFn *visit;
+  void *ctx;
+  Frame small[TRAVERSE_SMALL];
+};
+
+static void push_frame(Traversal *t, NodeId id, bool list, int level) {
+  if (t->depth == t->capacity) {
+    int cur = t->current ? t->current - t->stack : -1;
+    if (t->stack == t->small) {
+      t->stack = malloc(sizeof(Frame) * t->capacity * 2);
+      memcpy(t->stack, t->small, sizeof(t->small));
+    }
+    else {
+      t->stack = realloc(t->stack, sizeof(Frame) * t->capacity * 2);
+    }
+    t->capacity *= 2;
+    if (0 <= cur) {
+      t->current = &t->stack[cur];
+    }
+  }
+  Frame *f = &t->stack[t->depth++];
+  memset(f, 0, sizeof(Frame));
+  f->id = id;
+  f->list = list;
+  f->level = level;
+}
+
+// 呼び出し中のノードの子として1つだけ訪ねる
+void traverse_child(Traversal *t, NodeId id) {
+  push_frame(t, id, false, t->current->level + 1);
+}
+
+// 呼び出し中のノードの子として、idからnextでつながった並びを順に訪ねる
+void traverse_list(Traversal *t, NodeId id) {
+  push_frame(t, id, true, t->current->level + 1);
+}
+
+// 呼び出し中のノードの入れ子の深さ(根の並びが0)
+int traverse_level(Traversal *t) {
+  return t->current->level;
+}
+
+// 呼び出し中のノードが状態をまたいで使える変数。子を積むと動くので、
+// traverse_child/traverse_listより前に読み書きする
+long *traverse_locals(Traversal *t) {
+  return t->current->locals;
+}
+
+// idからnextでつながった並びをたどる。
+// visitは戻り値の状態で、積んだ子を訪ね終えたあとにまた呼ばれる
+void traverse(NodeId id, VisitFn *visit, void *ctx) {
+  Traversal t = {.visit = visit, .ctx = ctx, .capacity = TRAVERSE_SMALL};
+  t.stack = t.small;
+  push_frame(&t, id, true, 0);
+
+  while (t.depth) {
+    Frame *f = &t.stack[t.depth - 1];
+    if (f->list) {
+      NodeId cur = f->id;
+      if (!cur) {
+        t.depth--;
+        continue;
+      }
+      f->id = node_at(cur)->next;
+      t.current = f;
+      push_frame(&t, cur, false, f->level);
+      continue;
+    }
+    if (f->state == VISIT_DONE) {
+      t.depth--;
+      continue;
+    }
+
+    // 1回の呼び出しで積んだ子は、積んだ順に訪ねる
+    int base = t.depth;
+    t.current = f;
+    int next = visit(&t, f->id, f->state, ctx);
+    t.stack[base - 1].state = next;
+    for (int i = base, j = t.depth - 1; i < j; i++, j--) {
+      Frame tmp = t.stack[i];
+      t.stack[i] = t.stack[j];
+      t.stack[j] = tmp;
+    }
+  }
+  if (t.stack != t.small) {
+    free(t.stack);
+  }
+}
+
+// 行きがけと帰りがけの関数だけでたどる
+typedef struct PrePost {
+  PreFn *pre;
+  PostFn *post;
+  void *ctx;
+} PrePost;
+
+static int visit_pre_post(Traversal *t, NodeId id, int state, void *ctx) {
+  PrePost *pp = ctx;
+  if (state == 0) {
+    if (pp->pre && !pp->pre(id, pp->ctx)) {
+      return VISIT_DONE;
+    }
+    NodeId kids[4];
+    int n = node_children(node_at(id), kids);
+    for (int i = 0; i < n; i++) {
+      traverse_list(t, kids[i]);
+    }
+    return pp->post ? 1 : VISIT_DONE;
+  }
+  pp->post(id, pp->ctx);
+  return VISIT_DONE;
+}
+
+// idからnextでつながった並びと、その子孫すべてをたどる。
+// preがfalseを返したノードの子とpostは飛ばす
+void visit_nodes(NodeId id, PreFn *pre, PostFn *post, void *ctx) {
+  PrePost pp = {pre, post, ctx};
+  traverse(id, visit_pre_post, &pp);
+}
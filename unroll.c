@@ -0,0 +1,294 @@
+////////////////////////////////////////////////////////////////
+// Loop unrolling
+//
+// for (i = a; i < n; i = i + k) body
+// の形で、本体がiとnを書き換えないループを展開する。
+// 回数がわかっていて少なければ完全に展開し、
+// そうでなければfactor回分の本体を並べたループと余りのループに分ける。
+//
+//   i = a;
+//   for (; i < n - (factor-1)*k; ) { body; i = i + k; ... }
+//   for (; i < n; i = i + k) body
+
+#include "k9cc.h"
+
+#define UNROLL_MAX_NODES 256    // 展開後の本体の大きさの上限
+#define UNROLL_FULL_TRIPS 16    // これ以下の回数なら完全に展開する
+#define UNROLL_MAX_CONST (1L << 40)
+
+typedef struct UnrollInfo {
+  bool *addressed;              // アドレスを取られた変数のスロット
+  int nunrolled;
+} UnrollInfo;
+
+// 展開できるループの形
+typedef struct CountedLoop {
+  Var *iv;                      // 誘導変数
+  NodeId bound;                 // ND_NUMかループ不変なND_VAR
+  long step;
+  bool inclusive;               // i <= n
+  bool const_init;
+  long init;
+} CountedLoop;
+
+static bool count_node(NodeId id, void *ctx) {
+  (*(int *)ctx)++;
+  return true;
+}
+
+static int count_nodes(NodeId id) {
+  int n = 0;
+  visit_nodes(id, count_node, NULL, &n);
+  return n;
+}
+
+typedef struct AssignScan {
+  Var *var;
+  bool found;
+} AssignScan;
+
+static bool find_assign(NodeId id, void *ctx) {
+  AssignScan *scan = ctx;
+  Node *node = node_at(id);
+  if (node->kind == ND_ASSIGN) {
+    Node *lhs = node_at(node->lhs);
+    if (lhs->kind == ND_VAR && lhs->var->offset == scan->var->offset) {
+      scan->found = true;
+    }
+  }
+  return !scan->found;
+}
+
+// varに代入しているところがあるか
+static bool assigns_var(NodeId id, Var *var) {
+  AssignScan scan = {var, false};
+  visit_nodes(id, find_assign, NULL, &scan);
+  return scan.found;
+}
+
+static bool mark_addressed(NodeId id, void *ctx) {
+  UnrollInfo *info = ctx;
+  Node *node = node_at(id);
+  if (node->kind == ND_ADDR && node_at(node->lhs)->kind == ND_VAR) {
+    info->addressed[node_at(node->lhs)->var->offset / 8] = true;
+  }
+  return true;
+}
+
+static bool is_var(NodeId id, Var *var) {
+  Node *node = node_at(id);
+  return node->kind == ND_VAR && node->var == var;
+}
+
+// ループ中で変わらない変数か
+static bool invariant_var(Var *var, Node *loop, UnrollInfo *info) {
+  return !info->addressed[var->offset / 8] && !assigns_var(loop->then, var);
+}
+
+// forがi = i + kで進む数え上げのループならtrue
+static bool match_counted_loop(Node *node, CountedLoop *cl, UnrollInfo *info) {
+  Node *cond = node_at(node->cond);
+  Node *succ = node_at(node->succ);
+  if (!cond || (cond->kind != ND_LT && cond->kind != ND_LE) ||
+      node_at(cond->lhs)->kind != ND_VAR || !succ || succ->kind != ND_ASSIGN) {
+    return false;
+  }
+  cl->iv = node_at(cond->lhs)->var;
+  cl->inclusive = cond->kind == ND_LE;
+  cl->bound = cond->rhs;
+
+  // i = i + k または i = k + i
+  Node *add = node_at(succ->rhs);
+  if (!is_var(succ->lhs, cl->iv) || add->kind != ND_ADD) {
+    return false;
+  }
+  Node *step;
+  if (is_var(add->lhs, cl->iv)) {
+    step = node_at(add->rhs);
+  }
+  else if (is_var(add->rhs, cl->iv)) {
+    step = node_at(add->lhs);
+  }
+  else {
+    return false;
+  }
+  if (step->kind != ND_NUM || step->val <= 0 || UNROLL_MAX_CONST < step->val) {
+    return false;
+  }
+  cl->step = step->val;
+
+  if (info->addressed[cl->iv->offset / 8] || assigns_var(node->then, cl->iv)) {
+    return false;
+  }
+  Node *bound = node_at(cl->bound);
+  if (bound->kind == ND_NUM) {
+    if (bound->val < -UNROLL_MAX_CONST || UNROLL_MAX_CONST < bound->val) {
+      return false;
+    }
+  }
+  else if (bound->kind != ND_VAR || bound->var == cl->iv ||
+           !invariant_var(bound->var, node, info)) {
+    return false;
+  }
+
+  cl->const_init = false;
+  Node *init = node_at(node->init);
+  if (init && init->kind == ND_ASSIGN && is_var(init->lhs, cl->iv)) {
+    Node *val = node_at(init->rhs);
+    if (val->kind == ND_NUM && -UNROLL_MAX_CONST <= val->val && val->val <= UNROLL_MAX_CONST) {
+      cl->const_init = true;
+      cl->init = val->val;
+    }
+  }
+  return true;
+}
+
+// 回数がわからなければ-1
+static long trip_count(CountedLoop *cl) {
+  Node *bound = node_at(cl->bound);
+  if (!cl->const_init || bound->kind != ND_NUM) {
+    return -1;
+  }
+  long last = cl->inclusive ? bound->val : bound->val - 1;
+  if (last < cl->init) {
+    return 0;
+  }
+  return (last - cl->init) / cl->step + 1;
+}
+
+static NodeId new_expr_stmt(NodeId expr) {
+  NodeId stmt = node_new(ND_EXPR_STMT, node_at(expr)->tok);
+  node_at(stmt)->lhs = expr;
+  return stmt;
+}
+
+// body; i = i + k; をcount回並べる
+static void append_copies(NodeId *link, Node *loop, long count) {
+  for (long i = 0; i < count; i++) {
+    *link = node_clone(loop->then);
+    link = &node_at(*link)->next;
+    *link = new_expr_stmt(node_clone(loop->succ));
+    link = &node_at(*link)->next;
+  }
+}
+
+// ループをすべて本体の並びに置き換える
+static void unroll_fully(Node *node, long trips) {
+  NodeId head = 0, *link = &head;
+  if (node->init) {
+    *link = new_expr_stmt(node->init);
+    link = &node_at(*link)->next;
+  }
+  append_copies(link, node, trips);
+
+  node->kind = ND_BLOCK;
+  node->body = head;
+}
+
+// factor回分の本体を並べたループと余りのループに分ける
+static void unroll_partially(Node *node, CountedLoop *cl, int factor) {
+  NodeId head = 0, *link = &head;
+  if (node->init) {
+    *link = new_expr_stmt(node->init);
+    link = &node_at(*link)->next;
+  }
+
+  // i < n - (factor-1)*k の間は本体をfactor回続けて実行できる
+  long margin = (factor - 1) * cl->step;
+  Node *bound = node_at(cl->bound);
+  NodeId limit;
+  if (bound->kind == ND_NUM) {
+    limit = node_new(ND_NUM, bound->tok);
+    node_at(limit)->val = bound->val - margin;
+  }
+  else {
+    NodeId num = node_new(ND_NUM, bound->tok);
+    node_at(num)->val = margin;
+    limit = node_new(ND_SUB, bound->tok);
+    node_at(limit)->lhs = node_clone(cl->bound);
+    node_at(limit)->rhs = num;
+  }
+  NodeId cond = node_dup(node->cond);
+  node_at(cond)->lhs = node_clone(node_at(node->cond)->lhs);
+  node_at(cond)->rhs = limit;
+
+  NodeId body = node_new(ND_BLOCK, node->tok);
+  append_copies(&node_at(body)->body, node, factor);
+
+  NodeId main_loop = node_new(ND_FOR, node->tok);
+  node_at(main_loop)->cond = cond;
+  node_at(main_loop)->then = body;
+  *link = main_loop;
+  link = &node_at(*link)->next;
+
+  // 余り
+  NodeId rest = node_new(ND_FOR, node->tok);
+  node_at(rest)->cond = node->cond;
+  node_at(rest)->succ = node->succ;
+  node_at(rest)->then = node->then;
+  *link = rest;
+
+  node->kind = ND_BLOCK;
+  node->body = head;
+}
+
+static void unroll_loop(Node *node, UnrollInfo *info) {
+  CountedLoop cl;
+  if (!match_counted_loop(node, &cl, info)) {
+    return;
+  }
+
+  int size = count_nodes(node->then) + count_nodes(node->succ) + 1;
+  long trips = trip_count(&cl);
+  if (0 <= trips && trips <= UNROLL_FULL_TRIPS && trips * size <= UNROLL_MAX_NODES) {
+    unroll_fully(node, trips);
+    info->nunrolled++;
+    return;
+  }
+
+  int factor = opt_unroll_factor;
+  if (UNROLL_MAX_NODES / size < factor) {
+    factor = UNROLL_MAX_NODES / size;
+  }
+  if (0 <= trips && trips < factor) {
+    return;
+  }
+  if (factor < 2) {
+    return;
+  }
+  unroll_partially(node, &cl, factor);
+  info->nunrolled++;
+}
+
+// 文だけをたどる。式の中にループはない
+static bool enter_stmt(NodeId id, void *ctx) {
+  switch (node_at(id)->kind) {
+  case ND_IF:
+  case ND_WHILE:
+  case ND_FOR:
+  case ND_BLOCK:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// 帰りがけに展開するので、内側のループから展開される
+static void unroll_stmt(NodeId id, void *ctx) {
+  Node *node = node_at(id);
+  if (node->kind == ND_FOR) {
+    unroll_loop(node, ctx);
+  }
+}
+
+// 展開したループの数を返す
+int unroll_loops(Function **prog) {
+  UnrollInfo info = {};
+  for (Function *fn = *prog; fn; fn = fn->next) {
+    info.addressed = calloc(fn->stack_size / 8 + 1, sizeof(bool));
+    visit_nodes(fn->node, mark_addressed, NULL, &info);
+    visit_nodes(fn->node, enter_stmt, unroll_stmt, &info);
+    free(info.addressed);
+  }
+  return info.nunrolled;
+}
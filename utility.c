@@ -2,6 +2,7 @@
 // Utility
 
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include "k9cc.h"
 
@@ -15,3 +16,134 @@ size_t startswith(const char *s, const char *key) {
   size_t len = strlen(key);
   return strncmp(s, key, len) == 0 ? len : 0;
 }
+
+// printf形式で新しい文字列を作る
+char *format(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  char *buf = calloc(len + 1, 1);
+  va_start(ap, fmt);
+  vsnprintf(buf, len + 1, fmt, ap);
+  va_end(ap);
+  return buf;
+}
+
+// 文字列をキーにするハッシュ表(オープンアドレス法)。
+// キーの文字列はコピーしないので、表を使う間は呼び出し側で保持すること
+static unsigned long hash_string(const char *s) {
+  unsigned long h = 2166136261UL;
+  for (; *s; s++) {
+    h = (h ^ (unsigned char)*s) * 16777619UL;
+  }
+  return h;
+}
+
+static HashEntry *hashmap_find(HashEntry *buckets, int capacity, const char *key) {
+  for (unsigned long i = hash_string(key) & (capacity - 1); ; i = (i + 1) & (capacity - 1)) {
+    if (!buckets[i].key || !strcmp(buckets[i].key, key)) {
+      return &buckets[i];
+    }
+  }
+}
+
+void *hashmap_get(HashMap *map, const char *key) {
+  if (!map->buckets) {
+    return NULL;
+  }
+  return hashmap_find(map->buckets, map->capacity, key)->val;
+}
+
+void hashmap_put(HashMap *map, const char *key, void *val) {
+  if (map->capacity <= map->used * 2) {
+    int capacity = map->capacity ? map->capacity * 2 : 64;
+    HashEntry *buckets = calloc(capacity, sizeof(HashEntry));
+    for (int i = 0; i < map->capacity; i++) {
+      if (map->buckets[i].key) {
+        *hashmap_find(buckets, capacity, map->buckets[i].key) = map->buckets[i];
+      }
+    }
+    free(map->buckets);
+    map->buckets = buckets;
+    map->capacity = capacity;
+  }
+  HashEntry *e = hashmap_find(map->buckets, map->capacity, key);
+  if (!e->key) {
+    e->key = key;
+    map->used++;
+  }
+  e->val = val;
+}
+
+void hashmap_free(HashMap *map) {
+  free(map->buckets);
+  map->buckets = NULL;
+  map->capacity = map->used = 0;
+}
+
+// fpの中身をすべて読み込んで返す
+char *read_stream(FILE *fp) {
+  size_t capacity = BUFSIZ, len = 0, n;
+  char *buf = malloc(capacity);
+  while ((n = fread(buf + len, 1, capacity - len - 1, fp))) {
+    len += n;
+    if (capacity - len == 1) {
+      capacity *= 2;
+      buf = realloc(buf, capacity);
+    }
+  }
+  buf[len] = '\0';
+  return buf;
+}
+
+// まとめて解放するためのメモリ領域。
+// 確保したものは個別には解放せず、arena_resetで一度に捨てる
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct ArenaBlock {
+  ArenaBlock *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+// 0で埋めた領域を返す
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  ArenaBlock *block = arena->blocks;
+  if (!block || block->size - block->used < size) {
+    size_t bsize = size < ARENA_BLOCK_SIZE ? ARENA_BLOCK_SIZE : size;
+    block = malloc(sizeof(ArenaBlock) + bsize);
+    block->size = bsize;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+  void *p = block->data + block->used;
+  block->used += size;
+  memset(p, 0, size);
+  return p;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t n) {
+  char *p = arena_alloc(arena, n + 1);
+  memcpy(p, s, n);
+  return p;
+}
+
+// 最初のブロックだけ残して再利用する
+void arena_reset(Arena *arena) {
+  ArenaBlock *block = arena->blocks;
+  if (!block) {
+    return;
+  }
+  while (block->next) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  block->used = 0;
+  arena->blocks = block;
+}